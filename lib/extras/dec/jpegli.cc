@@ -21,6 +21,7 @@
 #include "lib/base/compiler_specific.h"
 #include "lib/base/data_parallel.h"
 #include "lib/base/sanitizers.h"
+#include "lib/base/span.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/cms/color_encoding.h"
@@ -40,7 +41,7 @@ constexpr unsigned char kExifSignature[6] = {0x45, 0x78, 0x69,
 constexpr int kExifMarker = JPEG_APP0 + 1;
 constexpr int kICCMarker = JPEG_APP0 + 2;
 
-inline bool IsJPG(const std::vector<uint8_t>& bytes) {
+inline bool IsJPG(Bytes bytes) {
   if (bytes.size() < 2) return false;
   if (bytes[0] != 0xFF || bytes[1] != 0xD8) return false;
   return true;
@@ -151,9 +152,8 @@ Status UnmapColors(uint8_t* row, size_t xsize, int components,
 
 }  // namespace
 
-Status DecodeJpeg(const std::vector<uint8_t>& compressed,
-                  const JpegDecompressParams& dparams, ThreadPool* pool,
-                  PackedPixelFile* ppf) {
+Status DecodeJpeg(Bytes compressed, const JpegDecompressParams& dparams,
+                  ThreadPool* pool, PackedPixelFile* ppf) {
   // Don't do anything for non-JPEG files (no need to report an error)
   if (!IsJPG(compressed)) return false;
 
@@ -181,6 +181,13 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
     jpegli_mem_src(&cinfo,
                    reinterpret_cast<const unsigned char*>(compressed.data()),
                    compressed.size());
+    if (pool != nullptr && pool->runner() != nullptr) {
+      jpegli_set_decompress_parallel_runner(&cinfo, pool->runner(),
+                                            pool->runner_opaque());
+      if (dparams.speculative_decoding) {
+        jpegli_enable_speculative_decoding(&cinfo, TRUE);
+      }
+    }
     jpegli_save_markers(&cinfo, kICCMarker, 0xFFFF);
     jpegli_save_markers(&cinfo, kExifMarker, 0xFFFF);
     const auto failure = [&cinfo](const char* str) -> Status {
@@ -294,5 +301,11 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
   return success;
 }
 
+Status DecodeJpeg(const std::vector<uint8_t>& compressed,
+                  const JpegDecompressParams& dparams, ThreadPool* pool,
+                  PackedPixelFile* ppf) {
+  return DecodeJpeg(Bytes(compressed), dparams, pool, ppf);
+}
+
 }  // namespace extras
 }  // namespace jxl
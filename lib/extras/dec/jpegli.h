@@ -13,6 +13,7 @@
 #include <vector>
 
 #include "lib/base/data_parallel.h"
+#include "lib/base/span.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 
@@ -30,8 +31,15 @@ struct JpegDecompressParams {
   bool two_pass_quant = true;
   // 0 = none, 1 = ordered, 2 = Floyd-Steinberg
   int dither_mode = 2;
+  // If true and a thread pool is given, scans without restart markers are
+  // decoded speculatively in parallel. This requires buffering the whole
+  // coefficient image.
+  bool speculative_decoding = false;
 };
 
+Status DecodeJpeg(Bytes compressed, const JpegDecompressParams& dparams,
+                  ThreadPool* pool, PackedPixelFile* ppf);
+
 Status DecodeJpeg(const std::vector<uint8_t>& compressed,
                   const JpegDecompressParams& dparams, ThreadPool* pool,
                   PackedPixelFile* ppf);
@@ -299,72 +299,11 @@ void ToFloatRow(const uint8_t* row_in, JxlPixelFormat format, size_t xsize,
   }
 }
 
-Status EncodeJpegToTargetSize(const PackedPixelFile& ppf,
-                              const JpegSettings& jpeg_settings,
-                              size_t target_size, ThreadPool* pool,
-                              std::vector<uint8_t>* output) {
-  output->clear();
-  size_t best_error = std::numeric_limits<size_t>::max();
-  float distance0 = -1.0f;
-  float distance1 = -1.0f;
-  float distance = 1.0f;
-  for (int step = 0; step < 15; ++step) {
-    JpegSettings settings = jpeg_settings;
-    settings.libjpeg_quality = 0;
-    settings.distance = distance;
-    settings.target_size = 0;
-    std::vector<uint8_t> compressed;
-    JXL_RETURN_IF_ERROR(EncodeJpeg(ppf, settings, pool, &compressed));
-    size_t size = compressed.size();
-    // prefer being under the target size to being over it
-    size_t error = size < target_size
-                       ? target_size - size
-                       : static_cast<size_t>(1.2f * (size - target_size));
-    if (error < best_error) {
-      best_error = error;
-      std::swap(*output, compressed);
-    }
-    float rel_error = size * 1.0f / target_size;
-    if (std::abs(rel_error - 1.0f) < 0.002f) {
-      break;
-    }
-    if (size < target_size) {
-      distance1 = distance;
-    } else {
-      distance0 = distance;
-    }
-    if (distance1 == -1) {
-      distance *= std::pow(rel_error, 1.5) * 1.05;
-    } else if (distance0 == -1) {
-      distance *= std::pow(rel_error, 1.5) * 0.95;
-    } else {
-      distance = 0.5 * (distance0 + distance1);
-    }
-  }
-  return true;
-}
-
-}  // namespace
-
-Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
-                  ThreadPool* pool, std::vector<uint8_t>* compressed) {
-  if (jpeg_settings.libjpeg_quality > 0) {
-    auto encoder = Encoder::FromExtension(".jpg");
-    encoder->SetOption("q", std::to_string(jpeg_settings.libjpeg_quality));
-    if (!jpeg_settings.libjpeg_chroma_subsampling.empty()) {
-      encoder->SetOption("chroma_subsampling",
-                         jpeg_settings.libjpeg_chroma_subsampling);
-    }
-    EncodedImage encoded;
-    JXL_RETURN_IF_ERROR(encoder->Encode(ppf, &encoded, pool));
-    size_t target_size = encoded.bitstreams[0].size();
-    return EncodeJpegToTargetSize(ppf, jpeg_settings, target_size, pool,
-                                  compressed);
-  }
-  if (jpeg_settings.target_size > 0) {
-    return EncodeJpegToTargetSize(ppf, jpeg_settings, jpeg_settings.target_size,
-                                  pool, compressed);
-  }
+// Encodes the image with jpegli, if target_size is non-zero, the distance is
+// selected by jpegli to meet the target size.
+Status EncodeJpegInternal(const PackedPixelFile& ppf,
+                          const JpegSettings& jpeg_settings, size_t target_size,
+                          ThreadPool* pool, std::vector<uint8_t>* compressed) {
   JXL_RETURN_IF_ERROR(VerifyInput(ppf));
 
   ColorEncoding color_encoding;
@@ -411,6 +350,9 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     cinfo.client_data = static_cast<void*>(&env);
     jpegli_create_compress(&cinfo);
     jpegli_mem_dest(&cinfo, &output_buffer, &output_size);
+    if (pool != nullptr && pool->runner() != nullptr) {
+      jpegli_set_parallel_runner(&cinfo, pool->runner(), pool->runner_opaque());
+    }
     const JxlBasicInfo& info = ppf.info;
     cinfo.image_width = info.xsize;
     cinfo.image_height = info.ysize;
@@ -461,7 +403,9 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     }
     jpegli_enable_adaptive_quantization(
         &cinfo, TO_JXL_BOOL(jpeg_settings.use_adaptive_quantization));
-    if (jpeg_settings.psnr_target > 0.0) {
+    if (target_size > 0) {
+      jpegli_set_target_size(&cinfo, target_size);
+    } else if (jpeg_settings.psnr_target > 0.0) {
       jpegli_set_psnr(&cinfo, jpeg_settings.psnr_target,
                       jpeg_settings.search_tolerance,
                       jpeg_settings.min_distance, jpeg_settings.max_distance);
@@ -566,5 +510,54 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
   return success;
 }
 
+Status EncodeJpegToTargetSize(const PackedPixelFile& ppf,
+                              const JpegSettings& jpeg_settings,
+                              size_t target_size, ThreadPool* pool,
+                              std::vector<uint8_t>* output) {
+  // The output size is estimated by jpegli during encoding, if the estimate
+  // was too low, we try again with a proportionally smaller target. If no
+  // attempt fits into the target size, the smallest output is returned.
+  size_t jpegli_target_size = target_size;
+  std::vector<uint8_t> compressed;
+  output->clear();
+  for (int attempt = 0; attempt < 4; ++attempt) {
+    JXL_RETURN_IF_ERROR(EncodeJpegInternal(ppf, jpeg_settings,
+                                           jpegli_target_size, pool,
+                                           &compressed));
+    const size_t size = compressed.size();
+    if (output->empty() || size < output->size()) {
+      output->swap(compressed);
+    }
+    if (size <= target_size) break;
+    jpegli_target_size = std::max<size_t>(
+        1, static_cast<size_t>(0.998 * jpegli_target_size * target_size / size));
+  }
+  return true;
+}
+
+}  // namespace
+
+Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
+                  ThreadPool* pool, std::vector<uint8_t>* compressed) {
+  if (jpeg_settings.libjpeg_quality > 0) {
+    auto encoder = Encoder::FromExtension(".jpg");
+    encoder->SetOption("q", std::to_string(jpeg_settings.libjpeg_quality));
+    if (!jpeg_settings.libjpeg_chroma_subsampling.empty()) {
+      encoder->SetOption("chroma_subsampling",
+                         jpeg_settings.libjpeg_chroma_subsampling);
+    }
+    EncodedImage encoded;
+    JXL_RETURN_IF_ERROR(encoder->Encode(ppf, &encoded, pool));
+    size_t target_size = encoded.bitstreams[0].size();
+    return EncodeJpegToTargetSize(ppf, jpeg_settings, target_size, pool,
+                                  compressed);
+  }
+  if (jpeg_settings.target_size > 0) {
+    return EncodeJpegToTargetSize(ppf, jpeg_settings, jpeg_settings.target_size,
+                                  pool, compressed);
+  }
+  return EncodeJpegInternal(ppf, jpeg_settings, 0, pool, compressed);
+}
+
 }  // namespace extras
 }  // namespace jxl
@@ -34,6 +34,7 @@
 #include "lib/extras/packed_image.h"
 #include "lib/extras/test_image.h"
 #include "lib/extras/test_utils.h"
+#include "lib/threads/test_utils.h"
 
 namespace jxl {
 namespace extras {
@@ -226,6 +227,58 @@ TEST(JpegliTest, JpegliYUVEncodeTest) {
                         1.32f);
 }
 
+TEST(JpegliTest, JpegliThreadPoolTest) {
+  TEST_LIBJPEG_SUPPORT();
+  std::string testimage = "jxl/flower/flower_small.rgb.depth8.ppm";
+  PackedPixelFile ppf_in;
+  ASSERT_TRUE(ReadTestImage(testimage, &ppf_in));
+  jxl::test::ThreadPoolForTests pool(4);
+
+  std::vector<uint8_t> compressed0;
+  std::vector<uint8_t> compressed1;
+  JpegSettings settings;
+  ASSERT_TRUE(EncodeJpeg(ppf_in, settings, nullptr, &compressed0));
+  ASSERT_TRUE(EncodeJpeg(ppf_in, settings, pool.get(), &compressed1));
+  EXPECT_EQ(compressed0, compressed1);
+
+  std::vector<std::vector<uint8_t>> inputs = {compressed0};
+  for (const char* fn : {"jxl/flower/flower.png.im_q85_444.jpg",
+                         "jxl/flower/flower.png.im_q85_420_R13B.jpg"}) {
+    inputs.push_back(jxl::test::ReadTestData(fn));
+  }
+  for (const std::vector<uint8_t>& compressed : inputs) {
+    PackedPixelFile ppf0;
+    JpegDecompressParams dparams;
+    ASSERT_TRUE(DecodeJpeg(compressed, dparams, nullptr, &ppf0));
+    for (bool speculative : {false, true}) {
+      PackedPixelFile ppf1;
+      dparams.speculative_decoding = speculative;
+      ASSERT_TRUE(DecodeJpeg(compressed, dparams, pool.get(), &ppf1));
+      ASSERT_EQ(ppf0.frames[0].color.pixels_size,
+                ppf1.frames[0].color.pixels_size);
+      EXPECT_EQ(0, memcmp(ppf0.frames[0].color.pixels(),
+                          ppf1.frames[0].color.pixels(),
+                          ppf0.frames[0].color.pixels_size));
+    }
+  }
+}
+
+TEST(JpegliTest, JpegliTargetSizeTest) {
+  TEST_LIBJPEG_SUPPORT();
+  std::string testimage = "jxl/flower/flower_small.rgb.depth8.ppm";
+  PackedPixelFile ppf_in;
+  ASSERT_TRUE(ReadTestImage(testimage, &ppf_in));
+
+  for (size_t target_size : {5000, 20000, 50000}) {
+    std::vector<uint8_t> compressed;
+    JpegSettings settings;
+    settings.target_size = target_size;
+    ASSERT_TRUE(EncodeJpeg(ppf_in, settings, nullptr, &compressed));
+    EXPECT_LE(compressed.size(), target_size);
+    EXPECT_GE(compressed.size(), target_size * 0.8);
+  }
+}
+
 TEST(JpegliTest, JpegliYUVChromaSubsamplingEncodeTest) {
   TEST_LIBJPEG_SUPPORT();
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
@@ -36,8 +36,11 @@ struct MemoryMappedFileImpl {
 
     f->ptr = mmap(nullptr, f->mmap_len, PROT_READ, MAP_SHARED, f->fd, 0);
     if (f->ptr == MAP_FAILED) {
+      f->ptr = nullptr;
       return JXL_FAILURE("mmap failure");
     }
+    // Files are mostly consumed front to back by the decoders.
+    madvise(f->ptr, f->mmap_len, MADV_SEQUENTIAL);
     return f;
   }
 
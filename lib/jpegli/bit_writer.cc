@@ -21,6 +21,11 @@ void JpegBitWriterInit(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   JpegBitWriter* bw = &m->bw;
   size_t buffer_size = m->blocks_per_iMCU_row * (DCTSIZE2 * 16 + 8) + (1 << 16);
+  if (cinfo->restart_interval > 0 || cinfo->restart_in_rows > 0) {
+    // In streaming mode there can be a restart marker before each MCU, with up
+    // to 8 stuffed bytes of padding before it.
+    buffer_size += m->blocks_per_iMCU_row * 18;
+  }
   bw->cinfo = cinfo;
   bw->data = Allocate<uint8_t>(cinfo, buffer_size, JPOOL_IMAGE);
   bw->len = buffer_size;
@@ -13,6 +13,7 @@
 #include "lib/base/byte_order.h"
 #include "lib/base/compiler_specific.h"
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 
 namespace jpegli {
 
@@ -34,12 +35,6 @@ bool EmptyBitWriterBuffer(JpegBitWriter* bw);
 
 void JumpToByteBoundary(JpegBitWriter* bw);
 
-// Returns non-zero if and only if x has a zero byte, i.e. one of
-// x & 0xff, x & 0xff00, ..., x & 0xff00000000000000 is zero.
-static JXL_INLINE uint64_t HasZeroByte(uint64_t x) {
-  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
-}
-
 /**
  * Writes the given byte to the output, writes an extra zero if byte is 0xFF.
  *
@@ -51,6 +46,13 @@ static JXL_INLINE void EmitByte(JpegBitWriter* bw, int byte) {
   if (byte == 0xFF) bw->data[bw->pos++] = 0;
 }
 
+// Writes a marker to the output, the caller must make sure that the bit writer
+// is at a byte boundary and that there is enough space in the output buffer.
+static JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
+  bw->data[bw->pos++] = 0xFF;
+  bw->data[bw->pos++] = marker;
+}
+
 static JXL_INLINE void DischargeBitBuffer(JpegBitWriter* bw) {
   // At this point we are ready to emit the bytes of put_buffer to the output.
   // The JPEG format requires that after every 0xff byte in the entropy
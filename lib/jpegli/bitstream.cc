@@ -19,6 +19,7 @@
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/error.h"
+#include "lib/jpegli/memory_manager.h"
 
 namespace jpegli {
 
@@ -35,6 +36,7 @@ void WriteOutput(j_compress_ptr cinfo, const uint8_t* buf, size_t bufsize) {
     cinfo->dest->free_in_buffer -= len;
     cinfo->dest->next_output_byte += len;
   }
+  cinfo->master->output_bytes_written += bufsize;
 }
 
 void WriteOutput(j_compress_ptr cinfo, const std::vector<uint8_t>& bytes) {
@@ -310,41 +312,38 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
 
 namespace {
 
-JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
-  bw->data[bw->pos++] = 0xFF;
-  bw->data[bw->pos++] = marker;
-}
-
 void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
   jpeg_comp_master* m = cinfo->master;
   HuffmanCodeTable* coding_tables = &m->coding_tables[0];
   int next_restart_marker = 0;
   const ScanTokenInfo& sti = m->scan_token_info[scan_index];
   size_t num_token_arrays = m->cur_token_array + 1;
-  size_t total_tokens = 0;
+  size_t total_bytes = 0;
   size_t restart_idx = 0;
   size_t next_restart = sti.restarts[restart_idx];
   uint8_t* context_map = m->context_map;
   for (size_t ta = 0; ta < num_token_arrays; ++ta) {
-    Token* tokens = m->token_arrays[ta].tokens;
-    size_t num_tokens = m->token_arrays[ta].num_tokens;
-    if (sti.token_offset < total_tokens + num_tokens &&
-        total_tokens < sti.token_offset + sti.num_tokens) {
+    const uint8_t* tokens = m->token_arrays[ta].tokens;
+    size_t size = m->token_arrays[ta].size;
+    if (sti.token_offset < total_bytes + size &&
+        total_bytes < sti.token_offset + sti.tokens_size) {
       size_t start_ix =
-          total_tokens < sti.token_offset ? sti.token_offset - total_tokens : 0;
-      size_t end_ix = std::min(sti.token_offset + sti.num_tokens - total_tokens,
-                               num_tokens);
+          total_bytes < sti.token_offset ? sti.token_offset - total_bytes : 0;
+      size_t end_ix =
+          std::min(sti.token_offset + sti.tokens_size - total_bytes, size);
       size_t cycle_len = bw->len / 8;
       size_t next_cycle = cycle_len;
-      for (size_t i = start_ix; i < end_ix; ++i) {
-        if (total_tokens + i == next_restart) {
+      const uint8_t* pos = tokens + start_ix;
+      const uint8_t* end = tokens + end_ix;
+      while (pos < end) {
+        if (total_bytes + (pos - tokens) == next_restart) {
           JumpToByteBoundary(bw);
           EmitMarker(bw, 0xD0 + next_restart_marker);
           next_restart_marker += 1;
           next_restart_marker &= 0x7;
           next_restart = sti.restarts[++restart_idx];
         }
-        Token t = tokens[i];
+        Token t = ReadToken(&pos);
         const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
         WriteBits(bw, code->depth[t.symbol], code->code[t.symbol] | t.bits);
         if (--next_cycle == 0) {
@@ -357,7 +356,115 @@ void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
         }
       }
     }
-    total_tokens += num_tokens;
+    total_bytes += size;
+  }
+}
+
+// Maximum size of the packed tokens and number of restart segments that are
+// entropy coded by one batch of parallel tasks. This bounds the size of the
+// temporary output buffer, unless a single restart segment is larger than this.
+constexpr size_t kMaxTokenBytesPerBatch = 1 << 21;
+constexpr size_t kMaxSegmentsPerBatch = 1024;
+
+// Upper bound on the size of an entropy coded segment with the given size of
+// packed tokens. A token is at least 2 bytes packed and at most 32 bits coded,
+// which is at most 8 bytes after byte stuffing, and we need some extra space
+// for the bits flushed at the end.
+size_t MaxSegmentSize(size_t num_bytes) { return num_bytes * 4 + 16; }
+
+// Writes the tokens with global byte offset in [begin, end) to bw and pads the
+// output to a byte boundary. ta_start[i] is the global offset of the first
+// token of the ith token array.
+void WriteTokenSegment(const jpeg_comp_master* m, const size_t* ta_start,
+                       size_t num_token_arrays, size_t begin, size_t end,
+                       JpegBitWriter* bw) {
+  const HuffmanCodeTable* coding_tables = &m->coding_tables[0];
+  const uint8_t* context_map = m->context_map;
+  size_t ta = std::upper_bound(ta_start, ta_start + num_token_arrays, begin) -
+              ta_start - 1;
+  for (size_t offset = begin; offset < end; ++ta) {
+    const uint8_t* tokens = m->token_arrays[ta].tokens;
+    size_t ta_end = std::min(end, ta_start[ta] + m->token_arrays[ta].size);
+    const uint8_t* pos = tokens + (offset - ta_start[ta]);
+    const uint8_t* pos_end = tokens + (ta_end - ta_start[ta]);
+    while (pos < pos_end) {
+      Token t = ReadToken(&pos);
+      const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
+      WriteBits(bw, code->depth[t.symbol], code->code[t.symbol] | t.bits);
+    }
+    offset = ta_end;
+  }
+  JumpToByteBoundary(bw);
+}
+
+// Same as WriteTokens(), but the restart segments are entropy coded into
+// separate buffers on the parallel runner, and are then written to the output
+// together with the restart markers.
+void WriteTokensInParallel(j_compress_ptr cinfo, int scan_index,
+                           JpegBitWriter* bw) {
+  jpeg_comp_master* m = cinfo->master;
+  const ScanTokenInfo& sti = m->scan_token_info[scan_index];
+  size_t num_token_arrays = m->cur_token_array + 1;
+  std::vector<size_t> ta_start(num_token_arrays);
+  for (size_t ta = 0, total_bytes = 0; ta < num_token_arrays; ++ta) {
+    ta_start[ta] = total_bytes;
+    total_bytes += m->token_arrays[ta].size;
+  }
+  const auto segment_start = [&](size_t r) {
+    return r == 0 ? sti.token_offset : sti.restarts[r - 1];
+  };
+  size_t max_segment_bytes = kMaxTokenBytesPerBatch;
+  for (size_t r = 0; r < sti.num_restarts; ++r) {
+    max_segment_bytes = std::max(max_segment_bytes,
+                                 segment_start(r + 1) - segment_start(r));
+  }
+  size_t buffer_size = MaxSegmentSize(max_segment_bytes) +
+                       MaxSegmentSize(0) * kMaxSegmentsPerBatch;
+  if (buffer_size > m->segment_buffer_size) {
+    m->segment_buffer = Allocate<uint8_t>(cinfo, buffer_size, JPOOL_IMAGE);
+    m->segment_buffer_size = buffer_size;
+  }
+  if (m->segment_writers == nullptr) {
+    m->segment_writers = Allocate<JpegBitWriter>(cinfo, kMaxSegmentsPerBatch,
+                                                 JPOOL_IMAGE);
+  }
+  for (size_t r0 = 0; r0 < sti.num_restarts;) {
+    size_t r1 = r0 + 1;
+    size_t batch_bytes = segment_start(r1) - segment_start(r0);
+    while (r1 < sti.num_restarts && r1 - r0 < kMaxSegmentsPerBatch &&
+           batch_bytes + segment_start(r1 + 1) - segment_start(r1) <=
+               kMaxTokenBytesPerBatch) {
+      batch_bytes += segment_start(r1 + 1) - segment_start(r1);
+      ++r1;
+    }
+    uint8_t* data = m->segment_buffer;
+    for (size_t r = r0; r < r1; ++r) {
+      JpegBitWriter* sbw = &m->segment_writers[r - r0];
+      sbw->cinfo = cinfo;
+      sbw->data = data;
+      sbw->len = MaxSegmentSize(segment_start(r + 1) - segment_start(r));
+      sbw->pos = 0;
+      sbw->output_pos = 0;
+      sbw->put_buffer = 0;
+      sbw->free_bits = 64;
+      sbw->healthy = true;
+      data += sbw->len;
+    }
+    const auto write_segment = [&](const uint32_t task, size_t /*thread*/) {
+      size_t r = r0 + task;
+      WriteTokenSegment(m, ta_start.data(), num_token_arrays, segment_start(r),
+                        segment_start(r + 1), &m->segment_writers[task]);
+    };
+    RunParallel(cinfo, r1 - r0, write_segment, "WriteTokensInParallel");
+    for (size_t r = r0; r < r1; ++r) {
+      const JpegBitWriter* sbw = &m->segment_writers[r - r0];
+      if (r > 0) {
+        WriteOutput(cinfo, {0xFF, static_cast<uint8_t>(0xD0 + ((r - 1) & 7))});
+      }
+      WriteOutput(cinfo, sbw->data, sbw->pos);
+      bw->healthy &= sbw->healthy;
+    }
+    r0 = r1;
   }
 }
 
@@ -374,7 +481,7 @@ void WriteACRefinementTokens(j_compress_ptr cinfo, int scan_index,
   size_t restart_idx = 0;
   size_t next_restart = sti.restarts[restart_idx];
   int next_restart_marker = 0;
-  for (size_t i = 0; i < sti.num_tokens; ++i) {
+  for (size_t i = 0; i < sti.tokens_size; ++i) {
     if (i == next_restart) {
       JumpToByteBoundary(bw);
       EmitMarker(bw, 0xD0 + next_restart_marker);
@@ -416,7 +523,7 @@ void WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
   size_t cycle_len = bw->len * 4;
   size_t next_cycle = cycle_len;
   size_t refbit_idx = 0;
-  for (size_t i = 0; i < sti.num_tokens; ++i) {
+  for (size_t i = 0; i < sti.tokens_size; ++i) {
     if (i == next_restart) {
       JumpToByteBoundary(bw);
       EmitMarker(bw, 0xD0 + next_restart_marker);
@@ -439,10 +546,16 @@ void WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
 }  // namespace
 
 void WriteScanData(j_compress_ptr cinfo, int scan_index) {
+  jpeg_comp_master* m = cinfo->master;
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
-  JpegBitWriter* bw = &cinfo->master->bw;
+  JpegBitWriter* bw = &m->bw;
   if (scan_info->Ah == 0) {
-    WriteTokens(cinfo, scan_index, bw);
+    if (m->runner != nullptr &&
+        m->scan_token_info[scan_index].num_restarts > 1) {
+      WriteTokensInParallel(cinfo, scan_index, bw);
+    } else {
+      WriteTokens(cinfo, scan_index, bw);
+    }
   } else if (scan_info->Ss > 0) {
     WriteACRefinementTokens(cinfo, scan_index, bw);
   } else {
@@ -6,6 +6,7 @@
 
 #include "lib/jpegli/common.h"
 
+#include "lib/base/types.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/memory_manager.h"
@@ -49,6 +50,11 @@ JHUFF_TBL* jpegli_alloc_huff_table(j_common_ptr cinfo) {
   return table;
 }
 
+void jpegli_set_memory_arena(j_common_ptr cinfo, boolean enable) {
+  if (cinfo->mem == nullptr) return;
+  jpegli::SetMemoryArena(cinfo, FROM_JXL_BOOL(enable));
+}
+
 int jpegli_bytes_per_sample(JpegliDataType data_type) {
   switch (data_type) {
     case JPEGLI_TYPE_UINT8:
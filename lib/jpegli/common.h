@@ -37,6 +37,15 @@ JQUANT_TBL* jpegli_alloc_quant_table(j_common_ptr cinfo);
 
 JHUFF_TBL* jpegli_alloc_huff_table(j_common_ptr cinfo);
 
+// If enabled, image lifetime (JPOOL_IMAGE) memory is allocated from large
+// slabs that are not returned to the system when the image is finished, but
+// are reused for the next image that is processed with the same object. This
+// avoids repeated heap allocations and page faults when many images of
+// similar size are processed. The slabs are released by jpegli_destroy(), or
+// when the arena is disabled while no image is in progress. Disabled by
+// default.
+void jpegli_set_memory_arena(j_common_ptr cinfo, boolean enable);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -14,6 +14,9 @@
 #include <hwy/aligned_allocator.h>
 
 #include "lib/base/compiler_specific.h"  // for ssize_t
+#include "lib/base/data_parallel.h"
+#include "lib/base/status.h"
+#include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/simd.h"
 
@@ -43,6 +46,30 @@ constexpr inline T1 RoundUpTo(T1 a, T2 b) {
   return DivCeil(a, b) * b;
 }
 
+// Returns non-zero if and only if x has a zero byte, i.e. one of
+// x & 0xff, x & 0xff00, ..., x & 0xff00000000000000 is zero.
+static JXL_INLINE uint64_t HasZeroByte(uint64_t x) {
+  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
+// Runs data_func(task, thread) for every task in [0, num_tasks) on the
+// parallel runner of the (de)compressor, or on the calling thread if no runner
+// was set. The data function must not call the error handler of cinfo.
+template <typename CInfoType, typename DataFunc>
+void RunParallel(CInfoType cinfo, uint32_t num_tasks, const DataFunc& data_func,
+                 const char* caller) {
+  jxl::ThreadPool pool(cinfo->master->runner, cinfo->master->runner_opaque);
+  const auto run_task = [&](const uint32_t task,
+                            const size_t thread) -> jxl::Status {
+    data_func(task, thread);
+    return true;
+  };
+  if (!jxl::RunOnPool(&pool, 0, num_tasks, jxl::ThreadPool::NoInit, run_task,
+                      caller)) {
+    JPEGLI_ERROR("Parallel runner failed in %s", caller);
+  }
+}
+
 constexpr size_t kDCTBlockSize = 64;
 // This is set to the same value as MAX_COMPS_IN_SCAN, because that is the
 // maximum number of channels the libjpeg-turbo decoder can decode.
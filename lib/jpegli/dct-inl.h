@@ -238,21 +238,30 @@ void QuantizeBlock(const float* dct, const float* qmc, float aq_strength,
   }
 }
 
+// Computes the quantized AC coefficients of the block. The final value of the
+// DC coefficient depends on the DC coefficient of the previous block, so here
+// we only compute its unrounded value and its zero-bias threshold, which can
+// be turned into the DC coefficient later with QuantizeDC().
 template <typename T>
-void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
-                             const float* JXL_RESTRICT qmc,
-                             int16_t last_dc_coeff, float aq_strength,
-                             const float* zero_bias_offset,
-                             const float* zero_bias_mul,
-                             float* JXL_RESTRICT tmp, T* block) {
+void ComputeCoefficientBlockAC(const float* JXL_RESTRICT pixels, size_t stride,
+                               const float* JXL_RESTRICT qmc, float aq_strength,
+                               const float* zero_bias_offset,
+                               const float* zero_bias_mul,
+                               float* JXL_RESTRICT tmp, T* block, float* dc,
+                               float* dc_threshold) {
   float* JXL_RESTRICT dct = tmp;
   float* JXL_RESTRICT scratch_space = tmp + DCTSIZE2;
   TransformFromPixels(pixels, stride, dct, scratch_space);
   QuantizeBlock(dct, qmc, aq_strength, zero_bias_offset, zero_bias_mul, block);
   // Center DC values around zero.
   static constexpr float kDCBias = 128.0f;
-  const float dc = (dct[0] - kDCBias) * qmc[0];
-  float dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
+  *dc = (dct[0] - kDCBias) * qmc[0];
+  *dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
+}
+
+template <typename T>
+JXL_INLINE void QuantizeDC(float dc, float dc_threshold, int16_t last_dc_coeff,
+                           T* block) {
   if (std::abs(dc - last_dc_coeff) < dc_threshold) {
     block[0] = last_dc_coeff;
   } else {
@@ -260,6 +269,20 @@ void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
   }
 }
 
+template <typename T>
+void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
+                             const float* JXL_RESTRICT qmc,
+                             int16_t last_dc_coeff, float aq_strength,
+                             const float* zero_bias_offset,
+                             const float* zero_bias_mul,
+                             float* JXL_RESTRICT tmp, T* block) {
+  float dc;
+  float dc_threshold;
+  ComputeCoefficientBlockAC(pixels, stride, qmc, aq_strength, zero_bias_offset,
+                            zero_bias_mul, tmp, block, &dc, &dc_threshold);
+  QuantizeDC(dc, dc_threshold, last_dc_coeff, block);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace
 }  // namespace HWY_NAMESPACE
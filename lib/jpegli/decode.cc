@@ -58,6 +58,7 @@ void InitializeImage(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   m->input_buffer_.clear();
   m->input_buffer_pos_ = 0;
+  m->input_buffer_src_bytes_ = 0;
   m->codestream_bits_ahead_ = 0;
   m->is_multiscan_ = false;
   m->found_soi_ = false;
@@ -70,6 +71,7 @@ void InitializeImage(j_decompress_ptr cinfo) {
   m->icc_profile_.clear();
   memset(m->dc_huff_lut_, 0, sizeof(m->dc_huff_lut_));
   memset(m->ac_huff_lut_, 0, sizeof(m->ac_huff_lut_));
+  memset(m->ac_huff_fast_lut_, 0, sizeof(m->ac_huff_fast_lut_));
   // Initialize the values to an invalid symbol so that we can recognize it
   // when reading the bit stream using a Huffman code with space > 0.
   for (size_t i = 0; i < kAllHuffLutSize; ++i) {
@@ -248,6 +250,8 @@ void PrepareForScan(j_decompress_ptr cinfo) {
         JPEGLI_ERROR("AC Huffman table %d not found", ac_tbl_idx);
       }
       BuildHuffmanLookupTable(cinfo, table, huff_lut);
+      BuildJpegHuffmanFastTable(
+          huff_lut, &m->ac_huff_fast_lut_[ac_tbl_idx * kJpegHuffmanFastSize]);
     }
   }
   // Copy quantization tables into comp_info.
@@ -289,6 +293,13 @@ void PrepareForScan(j_decompress_ptr cinfo) {
   m->eobrun_ = -1;
   m->scan_mcu_row_ = 0;
   m->scan_mcu_col_ = 0;
+  m->mcu_retry_bytes_ = 0;
+  m->skip_scan_ = true;
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    if (cinfo->cur_comp_info[i]->component_needed) {
+      m->skip_scan_ = false;
+    }
+  }
   m->codestream_bits_ahead_ = 0;
   ++cinfo->input_scan_number;
   cinfo->input_iMCU_row = 0;
@@ -296,6 +307,29 @@ void PrepareForScan(j_decompress_ptr cinfo) {
   cinfo->global_state = kDecProcessScan;
 }
 
+// Maximum number of bytes copied from the source buffer to the staging buffer
+// at a time. Larger source buffers are consumed directly once the straddling
+// marker segment or MCU is parsed.
+constexpr size_t kInputStagingStep = 16 << 10;
+
+void ClearInputBuffer(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  m->input_buffer_.clear();
+  m->input_buffer_pos_ = 0;
+  m->input_buffer_src_bytes_ = 0;
+}
+
+// Appends the next part of the current source buffer to the staging buffer.
+void StageInput(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  jpeg_source_mgr* src = cinfo->src;
+  size_t num_bytes = std::min(kInputStagingStep,
+                              src->bytes_in_buffer - m->input_buffer_src_bytes_);
+  const uint8_t* start = src->next_input_byte + m->input_buffer_src_bytes_;
+  m->input_buffer_.insert(m->input_buffer_.end(), start, start + num_bytes);
+  m->input_buffer_src_bytes_ += num_bytes;
+}
+
 int ConsumeInput(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (cinfo->global_state == kDecProcessScan && m->streaming_mode_ &&
@@ -327,18 +361,18 @@ int ConsumeInput(j_decompress_ptr cinfo) {
     } else {
       m->input_buffer_pos_ += pos;
       size_t bytes_left = m->input_buffer_.size() - m->input_buffer_pos_;
-      if (bytes_left <= src->bytes_in_buffer) {
-        src->next_input_byte += (src->bytes_in_buffer - bytes_left);
-        src->bytes_in_buffer = bytes_left;
-        m->input_buffer_.clear();
-        m->input_buffer_pos_ = 0;
+      if (bytes_left <= m->input_buffer_src_bytes_) {
+        // Parsing got past the data copied from the previous source buffers,
+        // continue directly from the current one.
+        size_t src_consumed = m->input_buffer_src_bytes_ - bytes_left;
+        src->next_input_byte += src_consumed;
+        src->bytes_in_buffer -= src_consumed;
+        ClearInputBuffer(cinfo);
       }
     }
     if (status == kHandleRestart) {
-      JXL_DASSERT(m->input_buffer_.size() <=
-                  m->input_buffer_pos_ + src->bytes_in_buffer);
-      m->input_buffer_.clear();
-      m->input_buffer_pos_ = 0;
+      JXL_DASSERT(m->input_buffer_.empty());
+      ClearInputBuffer(cinfo);
       if (cinfo->unread_marker == 0xd0 + m->next_restart_marker_) {
         cinfo->unread_marker = 0;
       } else {
@@ -356,10 +390,8 @@ int ConsumeInput(j_decompress_ptr cinfo) {
       continue;
     }
     if (status == kHandleMarkerProcessor) {
-      JXL_DASSERT(m->input_buffer_.size() <=
-                  m->input_buffer_pos_ + src->bytes_in_buffer);
-      m->input_buffer_.clear();
-      m->input_buffer_pos_ = 0;
+      JXL_DASSERT(m->input_buffer_.empty());
+      ClearInputBuffer(cinfo);
       if (!(*GetMarkerProcessor(cinfo))(cinfo)) {
         return JPEG_SUSPENDED;
       }
@@ -373,17 +405,29 @@ int ConsumeInput(j_decompress_ptr cinfo) {
       JXL_DASSERT(m->input_buffer_pos_ == 0);
       m->input_buffer_.assign(src->next_input_byte,
                               src->next_input_byte + src->bytes_in_buffer);
+      m->input_buffer_src_bytes_ = src->bytes_in_buffer;
+    } else if (m->input_buffer_pos_ > 0) {
+      // Drop the already parsed data, so that the staging buffer only holds
+      // the unfinished marker segment or MCU.
+      m->input_buffer_.erase(m->input_buffer_.begin(),
+                             m->input_buffer_.begin() + m->input_buffer_pos_);
+      m->input_buffer_pos_ = 0;
+    }
+    if (m->input_buffer_src_bytes_ < src->bytes_in_buffer) {
+      // There is more data in the current source buffer that was not staged
+      // yet.
+      StageInput(cinfo);
+      continue;
     }
     if (!(*cinfo->src->fill_input_buffer)(cinfo)) {
-      m->input_buffer_.clear();
-      m->input_buffer_pos_ = 0;
+      ClearInputBuffer(cinfo);
       return JPEG_SUSPENDED;
     }
     if (src->bytes_in_buffer == 0) {
       JPEGLI_ERROR("Empty input.");
     }
-    m->input_buffer_.insert(m->input_buffer_.end(), src->next_input_byte,
-                            src->next_input_byte + src->bytes_in_buffer);
+    m->input_buffer_src_bytes_ = 0;
+    StageInput(cinfo);
   }
   if (status == JPEG_SCAN_COMPLETED) {
     cinfo->global_state = kDecProcessMarkers;
@@ -397,8 +441,18 @@ int ConsumeInput(j_decompress_ptr cinfo) {
   return status;
 }
 
+// Returns true if the number of scans set with jpegli_set_max_scans() was
+// decoded, in which case the output is rendered from the coefficients decoded
+// so far and the rest of the input is not read.
+bool ReachedMaxScans(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  return m->max_scans > 0 && m->is_multiscan_ && !cinfo->buffered_image &&
+         cinfo->global_state == kDecProcessMarkers &&
+         cinfo->input_scan_number >= m->max_scans;
+}
+
 bool IsInputReady(j_decompress_ptr cinfo) {
-  if (cinfo->master->found_eoi_) {
+  if (cinfo->master->found_eoi_ || ReachedMaxScans(cinfo)) {
     return true;
   }
   if (cinfo->input_scan_number > cinfo->output_scan_number) {
@@ -483,6 +537,19 @@ boolean PrepareQuantizedOutput(j_decompress_ptr cinfo) {
   return TRUE;
 }
 
+// Only the luma component of YCbCr images is needed for grayscale output. The
+// chroma components are then Huffman decoded to stay in sync with the
+// bitstream in interleaved scans, but their coefficients are not stored and
+// not transformed, and their non-interleaved scans are skipped entirely.
+void SelectNeededComponents(j_decompress_ptr cinfo) {
+  const bool luma_only = cinfo->jpeg_color_space == JCS_YCbCr &&
+                         cinfo->out_color_space == JCS_GRAYSCALE &&
+                         !cinfo->raw_data_out;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    cinfo->comp_info[c].component_needed = c == 0 || !luma_only ? TRUE : FALSE;
+  }
+}
+
 void AllocateCoefficientBuffer(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
@@ -490,8 +557,10 @@ void AllocateCoefficientBuffer(j_decompress_ptr cinfo) {
       cinfo, cinfo->num_components, JPOOL_IMAGE);
   for (int c = 0; c < cinfo->num_components; ++c) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
+    // The coefficients of components that are not needed are never accessed.
     size_t height_in_blocks =
-        m->streaming_mode_ ? comp->v_samp_factor : comp->height_in_blocks;
+        m->streaming_mode_ || !comp->component_needed ? comp->v_samp_factor
+                                                      : comp->height_in_blocks;
     coef_arrays[c] = (*cinfo->mem->request_virt_barray)(
         comptr, JPOOL_IMAGE, TRUE, comp->width_in_blocks, height_in_blocks,
         comp->v_samp_factor);
@@ -547,6 +616,19 @@ void AllocateOutputBuffers(j_decompress_ptr cinfo) {
   memset(m->dequant_, 0, coeffs_per_block * sizeof(float));
 }
 
+// Returns true if the rest of the input is in the buffer of the source manager,
+// i.e. it is a memory or memory mapped source, or its buffer already ends with
+// an EOI marker.
+bool IsWholeInputAvailable(j_decompress_ptr cinfo) {
+  const jpeg_source_mgr* src = cinfo->src;
+  if (src->fill_input_buffer == EmitFakeEoiMarker) {
+    return true;
+  }
+  const size_t len = src->bytes_in_buffer;
+  return len >= 2 && src->next_input_byte[len - 2] == 0xff &&
+         src->next_input_byte[len - 1] == 0xd9;
+}
+
 }  // namespace jpegli
 
 void jpegli_CreateDecompress(j_decompress_ptr cinfo, int version,
@@ -790,10 +872,19 @@ boolean jpegli_input_complete(j_decompress_ptr cinfo) {
 boolean jpegli_start_decompress(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (cinfo->global_state == jpegli::kDecHeaderDone) {
+    // Restart segments or speculative chunks can only be decoded in parallel
+    // if we have the whole coefficient image in memory, which is only worth it
+    // if the source can provide the whole scan at once.
+    const bool parallel_restarts =
+        m->runner != nullptr &&
+        (cinfo->restart_interval > 0 || m->speculative_decoding) &&
+        jpegli::IsWholeInputAvailable(cinfo);
     m->streaming_mode_ = !m->is_multiscan_ &&
                          !FROM_JXL_BOOL(cinfo->buffered_image) &&
                          (!FROM_JXL_BOOL(cinfo->quantize_colors) ||
-                          !FROM_JXL_BOOL(cinfo->two_pass_quantize));
+                          !FROM_JXL_BOOL(cinfo->two_pass_quantize)) &&
+                         !parallel_restarts;
+    jpegli::SelectNeededComponents(cinfo);
     jpegli::AllocateCoefficientBuffer(cinfo);
     jpegli_calc_output_dimensions(cinfo);
     jpegli::PrepareForScan(cinfo);
@@ -823,7 +914,7 @@ boolean jpegli_start_decompress(j_decompress_ptr cinfo) {
       JPEGLI_ERROR("jpegli_start_decompress: unexpected state %d",
                    cinfo->global_state);
     }
-    while (!m->found_eoi_) {
+    while (!m->found_eoi_ && !jpegli::ReachedMaxScans(cinfo)) {
       jpegli::ProgressMonitorInputPass(cinfo);
       if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
         return FALSE;
@@ -896,7 +987,8 @@ JDIMENSION jpegli_read_scanlines(j_decompress_ptr cinfo, JSAMPARRAY scanlines,
           "jpegli_read_scanlines: "
           "jpegli_start_output() was not called");
     }
-  } else if (m->is_multiscan_ && !m->found_eoi_) {
+  } else if (m->is_multiscan_ && !m->found_eoi_ &&
+             !jpegli::ReachedMaxScans(cinfo)) {
     JPEGLI_ERROR(
         "jpegli_read_scanlines: "
         "jpegli_start_decompress() did not finish");
@@ -917,8 +1009,11 @@ JDIMENSION jpegli_read_scanlines(j_decompress_ptr cinfo, JSAMPARRAY scanlines,
 }
 
 JDIMENSION jpegli_skip_scanlines(j_decompress_ptr cinfo, JDIMENSION num_lines) {
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
-  return jpegli_read_scanlines(cinfo, nullptr, num_lines);
+  jpeg_decomp_master* m = cinfo->master;
+  m->skip_scanlines_end_ = cinfo->output_scanline + num_lines;
+  JDIMENSION num_skipped = jpegli_read_scanlines(cinfo, nullptr, num_lines);
+  m->skip_scanlines_end_ = 0;
+  return num_skipped;
 }
 
 void jpegli_crop_scanline(j_decompress_ptr cinfo, JDIMENSION* xoffset,
@@ -937,7 +1032,6 @@ void jpegli_crop_scanline(j_decompress_ptr cinfo, JDIMENSION* xoffset,
       *xoffset + *width > cinfo->output_width) {
     JPEGLI_ERROR("jpegli_crop_scanline: Invalid arguments");
   }
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
   size_t xend = *xoffset + *width;
   size_t iMCU_width = m->min_scaled_dct_size * cinfo->max_h_samp_factor;
   *xoffset = (*xoffset / iMCU_width) * iMCU_width;
@@ -986,7 +1080,7 @@ jvirt_barray_ptr* jpegli_read_coefficients(j_decompress_ptr cinfo) {
                  cinfo->global_state);
   }
   if (!cinfo->buffered_image) {
-    while (!m->found_eoi_) {
+    while (!m->found_eoi_ && !jpegli::ReachedMaxScans(cinfo)) {
       jpegli::ProgressMonitorInputPass(cinfo);
       if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
         return nullptr;
@@ -1006,7 +1100,7 @@ boolean jpegli_finish_decompress(j_decompress_ptr cinfo) {
   if (!cinfo->buffered_image && cinfo->output_scanline < cinfo->output_height) {
     JPEGLI_ERROR("Incomplete output");
   }
-  while (!cinfo->master->found_eoi_) {
+  while (!cinfo->master->found_eoi_ && !jpegli::ReachedMaxScans(cinfo)) {
     if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
       return FALSE;
     }
@@ -1042,6 +1136,43 @@ void jpegli_new_colormap(j_decompress_ptr cinfo) {
   cinfo->master->regenerate_inverse_colormap_ = true;
 }
 
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void* runner_opaque) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecInHeader &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_decompress_parallel_runner: unexpected state %d",
+                 cinfo->global_state);
+  }
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
+void jpegli_enable_speculative_decoding(j_decompress_ptr cinfo,
+                                        boolean value) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecInHeader &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_enable_speculative_decoding: unexpected state %d",
+                 cinfo->global_state);
+  }
+  cinfo->master->speculative_decoding = FROM_JXL_BOOL(value);
+}
+
+void jpegli_set_max_scans(j_decompress_ptr cinfo, int max_scans) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecInHeader &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_max_scans: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (max_scans < 0) {
+    JPEGLI_ERROR("jpegli_set_max_scans: invalid value %d", max_scans);
+  }
+  cinfo->master->max_scans = max_scans;
+}
+
 void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
                               JpegliEndianness endianness) {
   switch (data_type) {
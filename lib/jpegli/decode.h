@@ -24,6 +24,7 @@
 #include <cstddef>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -43,6 +44,12 @@ void jpegli_stdio_src(j_decompress_ptr cinfo, FILE *infile);
 void jpegli_mem_src(j_decompress_ptr cinfo, const unsigned char *inbuffer,
                     unsigned long insize /* NOLINT */);
 
+// Sets up a source manager that maps the whole file at path into memory, so
+// that the compressed data is read without copying. The file is unmapped when
+// the decompress object is destroyed or another file is set with this
+// function. Only supported on POSIX systems.
+void jpegli_mmap_src(j_decompress_ptr cinfo, const char *path);
+
 int jpegli_read_header(j_decompress_ptr cinfo, boolean require_image);
 
 boolean jpegli_start_decompress(j_decompress_ptr cinfo);
@@ -104,6 +111,38 @@ void jpegli_new_colormap(j_decompress_ptr cinfo);
 void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
                               JpegliEndianness endianness);
 
+// Sets the parallel runner that the decoder uses to decode the restart
+// segments of a scan on multiple threads. This is used only if the input
+// has restart markers and the whole input is in the source buffer, i.e. with
+// jpegli_mem_src() or jpegli_mmap_src(), or if the source buffer already ends
+// with the EOI marker at jpegli_start_decompress(). In that case the decoder
+// also keeps the full coefficient image in memory, otherwise it keeps
+// decoding in streaming mode. Must be called before jpegli_start_decompress().
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void* runner_opaque);
+
+// Enables decoding of sequential scans without restart markers on the
+// parallel runner set with jpegli_set_decompress_parallel_runner(). The
+// entropy coded data is split into chunks that are decoded speculatively into
+// temporary buffers, which are copied to the coefficient image once the MCU
+// boundaries at the chunk starts are known. If the chunk decodings do not
+// synchronize, the scan is decoded serially. Like parallel decoding of restart
+// segments, this requires the whole scan in the source buffer and makes the
+// decoder keep the full coefficient image in memory. Must be called before
+// jpegli_start_decompress().
+void jpegli_enable_speculative_decoding(j_decompress_ptr cinfo, boolean value);
+
+// Limits the number of scans that are decoded from a multi-scan (e.g.
+// progressive) image in non-buffered image mode. After max_scans scans, the
+// output is rendered from the coefficients decoded so far, with block
+// smoothing for the missing AC coefficients if do_block_smoothing is set, and
+// the rest of the input is not read, not even by jpegli_finish_decompress().
+// This can be used to decode a low-quality preview from the first few scans of
+// a progressive image, e.g. max_scans = 1 for a typical DC-first scan script.
+// A value of 0 means no limit. Must be called before jpegli_start_decompress().
+void jpegli_set_max_scans(j_decompress_ptr cinfo, int max_scans);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -5,20 +5,24 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ostream>
+#include <random>
 #include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "lib/base/printf_macros.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/encode.h"
 #include "lib/jpegli/libjpeg_test_util.h"
 #include "lib/jpegli/test_params.h"
@@ -283,6 +287,13 @@ void TestAPINonBuffered(const CompressParams& jparams,
   jpegli_calc_output_dimensions(cinfo);
   SetDecompressParams(dparams, cinfo);
   jpegli_set_output_format(cinfo, dparams.data_type, dparams.endianness);
+  if (dparams.num_threads > 0) {
+    jpegli_set_decompress_parallel_runner(
+        cinfo, TestParallelRunner, ThreadsAsRunnerOpaque(dparams.num_threads));
+  }
+  if (dparams.speculative_decoding) {
+    jpegli_enable_speculative_decoding(cinfo, TRUE);
+  }
   VerifyHeader(jparams, cinfo);
   jpegli_calc_output_dimensions(cinfo);
   EXPECT_LE(expected_output.xsize, cinfo->output_width);
@@ -309,6 +320,13 @@ void TestAPIBuffered(const CompressParams& jparams,
   cinfo->buffered_image = TRUE;
   SetDecompressParams(dparams, cinfo);
   jpegli_set_output_format(cinfo, dparams.data_type, dparams.endianness);
+  if (dparams.num_threads > 0) {
+    jpegli_set_decompress_parallel_runner(
+        cinfo, TestParallelRunner, ThreadsAsRunnerOpaque(dparams.num_threads));
+  }
+  if (dparams.speculative_decoding) {
+    jpegli_enable_speculative_decoding(cinfo, TRUE);
+  }
   VerifyHeader(jparams, cinfo);
   bool has_multiple_scans = FROM_JXL_BOOL(jpegli_has_multiple_scans(cinfo));
   EXPECT_TRUE(jpegli_start_decompress(cinfo));
@@ -498,6 +516,57 @@ TEST(DecodeAPITest, ReuseCinfoSameMemSource) {
   if (buffer) free(buffer);
 }
 
+TEST(DecodeAPITest, ReuseCinfoMemoryArena) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_set_memory_arena(reinterpret_cast<j_common_ptr>(&cinfo), TRUE);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      for (const TestConfig& config : all_configs) {
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  // Decode all images twice, the second time from the recycled arena slabs.
+  size_t num_images = all_configs.size();
+  std::vector<TestImage> all_outputs(2 * num_images);
+  {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_set_memory_arena(reinterpret_cast<j_common_ptr>(&cinfo), TRUE);
+      for (size_t i = 0; i < all_outputs.size(); ++i) {
+        if (i % num_images == 0) {
+          jpegli_mem_src(&cinfo, buffer, buffer_size);
+        }
+        const TestConfig& config = all_configs[i % num_images];
+        TestAPINonBuffered(config.jparams, DecompressParams(), config.input,
+                           &cinfo, &all_outputs[i]);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  for (size_t i = 0; i < num_images; ++i) {
+    VerifyOutputImage(all_configs[i].input, all_outputs[i], 2.35f);
+    const TestImage& output = all_outputs[num_images + i];
+    ASSERT_EQ(all_outputs[i].pixels.size(), output.pixels.size());
+    EXPECT_EQ(0, memcmp(all_outputs[i].pixels.data(), output.pixels.data(),
+                        output.pixels.size()));
+  }
+  if (buffer) free(buffer);
+}
+
 TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
@@ -539,6 +608,489 @@ TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
   fclose(tmpf);
 }
 
+// Decodes the rectangle of the image at (x0, y0) of size xsize x ysize with
+// jpegli_crop_scanline() and jpegli_skip_scanlines(), the output rows are
+// stored with xsize * 3 bytes per row. The crop is not set if the rectangle
+// is as wide as the image, otherwise x0 and xsize are updated to the cropped
+// output columns.
+void DecodeCropped(const std::vector<uint8_t>& compressed, size_t* x0,
+                   size_t y0, size_t* xsize, size_t ysize,
+                   std::vector<uint8_t>* pixels) {
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+    jpegli_start_decompress(&cinfo);
+    if (*xsize < cinfo.output_width) {
+      JDIMENSION xoffset = *x0;
+      JDIMENSION width = *xsize;
+      jpegli_crop_scanline(&cinfo, &xoffset, &width);
+      *x0 = xoffset;
+      *xsize = width;
+    }
+    size_t stride = *xsize * cinfo.out_color_components;
+    pixels->resize(ysize * stride);
+    JPEGLI_TEST_ENSURE_TRUE(jpegli_skip_scanlines(&cinfo, y0) == y0);
+    for (size_t y = 0; y < ysize; ++y) {
+      JSAMPROW row = &(*pixels)[y * stride];
+      JPEGLI_TEST_ENSURE_TRUE(jpegli_read_scanlines(&cinfo, &row, 1) == 1);
+    }
+    JDIMENSION lines_left = cinfo.output_height - cinfo.output_scanline;
+    JPEGLI_TEST_ENSURE_TRUE(jpegli_skip_scanlines(&cinfo, lines_left) ==
+                            lines_left);
+    jpegli_finish_decompress(&cinfo);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+}
+
+TEST(DecodeAPITest, CropMatchesFullDecode) {
+  TestImage input;
+  input.xsize = 1531;
+  input.ysize = 1077;
+  GeneratePixels(&input);
+  for (int samp : {1, 2}) {
+    for (int progr : {0, 2}) {
+      CompressParams jparams;
+      jparams.h_sampling = {samp, 1, 1};
+      jparams.v_sampling = {samp, 1, 1};
+      jparams.progressive_mode = progr;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+      std::vector<uint8_t> expected;
+      size_t full_x0 = 0;
+      size_t full_xsize = input.xsize;
+      DecodeCropped(compressed, &full_x0, 0, &full_xsize, input.ysize,
+                    &expected);
+      ASSERT_EQ(full_xsize, input.xsize);
+      const size_t full_stride = input.xsize * 3;
+      const size_t crops[][4] = {{0, 0, 100, 50},
+                                 {600, 400, 256, 256},
+                                 {1270, 820, 261, 257},
+                                 {17, 1000, 1500, 77}};
+      for (const auto& crop : crops) {
+        size_t x0 = crop[0];
+        size_t xsize = crop[2];
+        size_t y0 = crop[1];
+        size_t ysize = crop[3];
+        printf("Decoding %dx%d samp progr %d crop %" PRIuS "x%" PRIuS
+               " at (%" PRIuS ", %" PRIuS ")\n",
+               samp, samp, progr, xsize, ysize, x0, y0);
+        size_t xend = x0 + xsize;
+        std::vector<uint8_t> cropped;
+        DecodeCropped(compressed, &x0, y0, &xsize, ysize, &cropped);
+        ASSERT_LE(x0, crop[0]);
+        ASSERT_EQ(x0 + xsize, xend);
+        for (size_t y = 0; y < ysize; ++y) {
+          const uint8_t* expected_row =
+              &expected[(y0 + y) * full_stride + x0 * 3];
+          ASSERT_EQ(0, memcmp(expected_row, &cropped[y * xsize * 3],
+                              xsize * 3));
+        }
+      }
+    }
+  }
+}
+
+// Decodes the image with the given output data type and returns the output
+// samples of the rectangle at (x0, 0) of width xsize as floats.
+void DecodeSamples(const std::vector<uint8_t>& compressed, bool fancy,
+                   JpegliDataType data_type, size_t x0, size_t xsize,
+                   std::vector<float>* samples) {
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+    cinfo.do_fancy_upsampling = fancy ? TRUE : FALSE;
+    jpegli_set_output_format(&cinfo, data_type, JPEGLI_NATIVE_ENDIAN);
+    jpegli_start_decompress(&cinfo);
+    JDIMENSION xoffset = x0;
+    JDIMENSION width = xsize;
+    jpegli_crop_scanline(&cinfo, &xoffset, &width);
+    const size_t bytes_per_sample = jpegli_bytes_per_sample(data_type);
+    const size_t num_samples = width * cinfo.out_color_components;
+    std::vector<uint8_t> row(num_samples * bytes_per_sample);
+    samples->clear();
+    for (size_t y = 0; y < cinfo.output_height; ++y) {
+      JSAMPROW rowptr = row.data();
+      JPEGLI_TEST_ENSURE_TRUE(jpegli_read_scanlines(&cinfo, &rowptr, 1) == 1);
+      for (size_t i = 0; i < num_samples; ++i) {
+        if (data_type == JPEGLI_TYPE_FLOAT) {
+          float val;
+          memcpy(&val, &row[i * sizeof(val)], sizeof(val));
+          samples->push_back(val);
+        } else {
+          samples->push_back(row[i]);
+        }
+      }
+    }
+    jpegli_finish_decompress(&cinfo);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+}
+
+TEST(DecodeAPITest, FusedOutputMatchesFloatOutput) {
+  TestImage input;
+  input.xsize = 531;
+  input.ysize = 77;
+  GeneratePixels(&input);
+  const int samplings[][2] = {{1, 1}, {2, 1}, {2, 2}, {1, 2}};
+  for (const auto& samp : samplings) {
+    CompressParams jparams;
+    jparams.h_sampling = {samp[0], 1, 1};
+    jparams.v_sampling = {samp[1], 1, 1};
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+    for (bool fancy : {true, false}) {
+      for (size_t x0 : {0, 101}) {
+        const size_t xsize = input.xsize - x0;
+        std::vector<float> expected;
+        std::vector<float> actual;
+        DecodeSamples(compressed, fancy, JPEGLI_TYPE_FLOAT, x0, xsize,
+                      &expected);
+        DecodeSamples(compressed, fancy, JPEGLI_TYPE_UINT8, x0, xsize,
+                      &actual);
+        ASSERT_EQ(expected.size(), actual.size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+          float val = std::min(255.0f, std::max(0.0f, expected[i] * 255.0f));
+          ASSERT_EQ(std::nearbyint(val), actual[i]);
+        }
+      }
+    }
+  }
+}
+
+// The grayscale output of a YCbCr image is decoded without storing or
+// transforming the chroma components, and the non-interleaved chroma scans are
+// skipped without decoding them. Verify that this does not change the output.
+TEST(DecodeAPITest, GrayscaleOutputMatchesLuma) {
+  TestImage input;
+  input.xsize = 257;
+  input.ysize = 129;
+  GeneratePixels(&input);
+  std::vector<int> progressive_modes = {0, 2};
+  for (int i = 0; i < NumTestScanScripts(); ++i) {
+    progressive_modes.push_back(3 + i);
+  }
+  for (int progr : progressive_modes) {
+    CompressParams jparams;
+    jparams.h_sampling = {2, 1, 1};
+    jparams.v_sampling = {2, 1, 1};
+    jparams.progressive_mode = progr;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+    for (size_t chunk_size : {compressed.size(), static_cast<size_t>(97)}) {
+      std::vector<uint8_t> outputs[2];
+      const J_COLOR_SPACE out_color_space[2] = {JCS_YCbCr, JCS_GRAYSCALE};
+      for (int i = 0; i < 2; ++i) {
+        SourceManager src(compressed.data(), compressed.size(), chunk_size);
+        jpeg_decompress_struct cinfo;
+        const auto try_catch_block = [&]() -> bool {
+          ERROR_HANDLER_SETUP(jpegli);
+          jpegli_create_decompress(&cinfo);
+          cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+          jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+          cinfo.out_color_space = out_color_space[i];
+          jpegli_start_decompress(&cinfo);
+          size_t stride = cinfo.output_width * cinfo.out_color_components;
+          outputs[i].resize(cinfo.output_height * stride);
+          while (cinfo.output_scanline < cinfo.output_height) {
+            JSAMPROW row = &outputs[i][cinfo.output_scanline * stride];
+            jpegli_read_scanlines(&cinfo, &row, 1);
+          }
+          jpegli_finish_decompress(&cinfo);
+          return true;
+        };
+        ASSERT_TRUE(try_catch_block());
+        jpegli_destroy_decompress(&cinfo);
+      }
+      ASSERT_EQ(outputs[0].size(), 3 * outputs[1].size());
+      for (size_t j = 0; j < outputs[1].size(); ++j) {
+        ASSERT_EQ(outputs[0][3 * j], outputs[1][j]);
+      }
+    }
+  }
+}
+
+// Fills the image with uniform random pixels.
+void GenerateNoise(TestImage* img) {
+  std::mt19937 rng(img->xsize * 65537 + img->ysize);
+  std::uniform_int_distribution<int> dist(0, 255);
+  img->AllocatePixels();
+  for (uint8_t& val : img->pixels) {
+    val = dist(rng);
+  }
+}
+
+// Decodes the image from memory to pixels of the output format, after calling
+// setup() on the decompress struct after reading the header.
+template <typename SetupFunc>
+void DecodeWithSetup(const std::vector<uint8_t>& compressed,
+                     const SetupFunc& setup, std::vector<uint8_t>* pixels) {
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+    setup(&cinfo);
+    JPEGLI_TEST_ENSURE_TRUE(jpegli_start_decompress(&cinfo));
+    size_t stride =
+        cinfo.output_width * cinfo.out_color_components *
+        jpegli_bytes_per_sample(cinfo.master->output_data_type_);
+    pixels->resize(cinfo.output_height * stride);
+    while (cinfo.output_scanline < cinfo.output_height) {
+      JSAMPROW row = &(*pixels)[cinfo.output_scanline * stride];
+      JPEGLI_TEST_ENSURE_TRUE(jpegli_read_scanlines(&cinfo, &row, 1) == 1);
+    }
+    JPEGLI_TEST_ENSURE_TRUE(jpegli_finish_decompress(&cinfo));
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+}
+
+// With noise at quality 100 and no subsampling, the MCUs are so large that the
+// first MCUs of a speculatively decoded chunk span several chunks, so the
+// chunk starts must be found from the synchronized part of the previous
+// chunk's decoding. The output must match the serial decoding.
+TEST(DecodeAPITest, SpeculativeDecodingLargeMCUs) {
+  TestImage input;
+  input.xsize = 512;
+  input.ysize = 512;
+  GenerateNoise(&input);
+  CompressParams jparams;
+  jparams.quality = 100;
+  jparams.progressive_mode = 0;
+  jparams.h_sampling = {1, 1, 1};
+  jparams.v_sampling = {1, 1, 1};
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  std::vector<uint8_t> expected;
+  DecodeWithSetup(compressed, [](j_decompress_ptr /*cinfo*/) {}, &expected);
+  for (size_t chunk_size : {1024, 4096, 16384}) {
+    std::vector<uint8_t> actual;
+    DecodeWithSetup(
+        compressed,
+        [&](j_decompress_ptr cinfo) {
+          jpegli_set_decompress_parallel_runner(cinfo, TestParallelRunner,
+                                                ThreadsAsRunnerOpaque(4));
+          jpegli_enable_speculative_decoding(cinfo, TRUE);
+          cinfo->master->speculative_chunk_size = chunk_size;
+        },
+        &actual);
+    ASSERT_EQ(expected.size(), actual.size());
+    ASSERT_EQ(0, memcmp(expected.data(), actual.data(), expected.size()));
+  }
+}
+
+// Blocks whose nonzero coefficients are all in the top-left 1x1, 2x2 or 4x4
+// corner take the sparse inverse DCT paths, which must give bit-exact the same
+// output as the full 8x8 transform.
+TEST(DecodeAPITest, SparseIDCTMatchesFullIDCT) {
+  TestImage input;
+  input.xsize = 128;
+  input.ysize = 96;
+  CompressParams jparams;
+  jparams.h_sampling = {1, 1, 1};
+  jparams.v_sampling = {1, 1, 1};
+  std::mt19937 rng(19);
+  std::uniform_int_distribution<int> dist(-60, 60);
+  for (size_t c = 0; c < input.components; ++c) {
+    size_t xsize_blocks = input.xsize / DCTSIZE;
+    size_t ysize_blocks = input.ysize / DCTSIZE;
+    std::vector<JCOEF> plane(xsize_blocks * ysize_blocks * DCTSIZE2);
+    for (size_t i = 0; i < xsize_blocks * ysize_blocks; ++i) {
+      // Cycle through the extents 1, 2, 4 and 8, with some blocks where only
+      // the last row or column of the corner is nonzero.
+      const int extent = 1 << (i % 4);
+      const int variant = (i / 4) % 3;
+      JCOEF* block = &plane[i * DCTSIZE2];
+      for (int y = 0; y < extent; ++y) {
+        for (int x = 0; x < extent; ++x) {
+          if ((variant == 1 && y != extent - 1) ||
+              (variant == 2 && x != extent - 1)) {
+            continue;
+          }
+          block[y * DCTSIZE + x] = dist(rng);
+        }
+      }
+    }
+    input.coeffs.emplace_back(std::move(plane));
+  }
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  std::vector<uint8_t> outputs[2];
+  for (int full : {0, 1}) {
+    DecodeWithSetup(
+        compressed,
+        [&](j_decompress_ptr cinfo) {
+          jpegli_set_output_format(cinfo, JPEGLI_TYPE_FLOAT,
+                                   JPEGLI_NATIVE_ENDIAN);
+          cinfo->master->disable_sparse_idct = (full == 1);
+        },
+        &outputs[full]);
+  }
+  ASSERT_EQ(outputs[0].size(), outputs[1].size());
+  EXPECT_EQ(0, memcmp(outputs[0].data(), outputs[1].data(), outputs[0].size()));
+}
+
+// The vectorized inverse transforms of the 1/8, 1/4, 1/2 and 2x scaled
+// outputs must match the scalar generic transform: bit-exactly for the box
+// averages of the 8x8 IDCT, and up to the rounding of the different operation
+// order for the 16-point IDCT.
+TEST(DecodeAPITest, ScaledIDCTMatchesGenericIDCT) {
+  TestImage input;
+  input.xsize = 253;
+  input.ysize = 187;
+  GeneratePixels(&input);
+  for (int samp : {1, 2}) {
+    CompressParams jparams;
+    jparams.h_sampling = {samp, 1, 1};
+    jparams.v_sampling = {samp, 1, 1};
+    jparams.progressive_mode = 0;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+    for (int scale_num : {1, 2, 4, 16}) {
+      std::vector<uint8_t> outputs[2];
+      for (int generic : {0, 1}) {
+        DecodeWithSetup(
+            compressed,
+            [&](j_decompress_ptr cinfo) {
+              cinfo->scale_num = scale_num;
+              cinfo->scale_denom = 8;
+              jpegli_set_output_format(cinfo, JPEGLI_TYPE_FLOAT,
+                                       JPEGLI_NATIVE_ENDIAN);
+              cinfo->master->use_generic_idct = (generic == 1);
+            },
+            &outputs[generic]);
+      }
+      ASSERT_EQ(outputs[0].size(), outputs[1].size());
+      if (scale_num < 8) {
+        EXPECT_EQ(0, memcmp(outputs[0].data(), outputs[1].data(),
+                            outputs[0].size()))
+            << "samp " << samp << " scale " << scale_num << "/8";
+        continue;
+      }
+      size_t num_values = outputs[0].size() / sizeof(float);
+      float max_diff = 0.0f;
+      for (size_t i = 0; i < num_values; ++i) {
+        float v0;
+        float v1;
+        memcpy(&v0, &outputs[0][i * sizeof(float)], sizeof(v0));
+        memcpy(&v1, &outputs[1][i * sizeof(float)], sizeof(v1));
+        max_diff = std::max(max_diff, std::abs(v0 - v1));
+      }
+      EXPECT_LE(max_diff, 1e-5f) << "samp " << samp;
+    }
+  }
+}
+
+// Decoding with a scan limit stops reading the input after the last allowed
+// scan, and gives the full quality output once all scans are allowed.
+TEST(DecodeAPITest, MaxScansPreview) {
+  TestImage input;
+  input.xsize = 257;
+  input.ysize = 129;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.progressive_mode = 2;
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  int num_scans = 0;
+  for (size_t i = 0; i + 1 < compressed.size(); ++i) {
+    if (compressed[i] == 0xff && compressed[i + 1] == 0xda) ++num_scans;
+  }
+  ASSERT_GT(num_scans, 1);
+  std::vector<uint8_t> outputs[2];
+  size_t bytes_read[2];
+  size_t prev_bytes_read = 0;
+  for (int max_scans = 1; max_scans <= num_scans + 1; ++max_scans) {
+    const int scan_limits[2] = {0, max_scans};
+    for (int i = 0; i < 2; ++i) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_set_max_scans(&cinfo, scan_limits[i]);
+        JPEGLI_TEST_ENSURE_TRUE(jpegli_start_decompress(&cinfo));
+        size_t stride = cinfo.output_width * cinfo.out_color_components;
+        outputs[i].resize(cinfo.output_height * stride);
+        while (cinfo.output_scanline < cinfo.output_height) {
+          JSAMPROW row = &outputs[i][cinfo.output_scanline * stride];
+          JPEGLI_TEST_ENSURE_TRUE(jpegli_read_scanlines(&cinfo, &row, 1) == 1);
+        }
+        JPEGLI_TEST_ENSURE_TRUE(jpegli_finish_decompress(&cinfo));
+        bytes_read[i] = compressed.size() - cinfo.src->bytes_in_buffer;
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    ASSERT_EQ(outputs[0].size(), outputs[1].size());
+    if (max_scans < num_scans) {
+      EXPECT_LT(bytes_read[1], bytes_read[0]);
+      EXPECT_NE(0, memcmp(outputs[0].data(), outputs[1].data(),
+                          outputs[0].size()));
+    } else {
+      EXPECT_EQ(0, memcmp(outputs[0].data(), outputs[1].data(),
+                          outputs[0].size()));
+    }
+    EXPECT_GT(bytes_read[1], prev_bytes_read);
+    prev_bytes_read = bytes_read[1];
+  }
+}
+
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+TEST(DecodeAPITest, MemoryLimitUsesBackingStore) {
+  TestImage input;
+  input.xsize = 1531;
+  input.ysize = 1077;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.progressive_mode = 2;
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  std::vector<uint8_t> outputs[2];
+  // The coefficient buffers need about 10 MB, which does not fit within the
+  // 2 MB limit of the second run.
+  const long max_memory[2] = {0, 2 << 20};  // NOLINT
+  for (int i = 0; i < 2; ++i) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      cinfo.mem->max_memory_to_use = max_memory[i];
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.out_color_components;
+      outputs[i].resize(cinfo.output_height * stride);
+      while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &outputs[i][cinfo.output_scanline * stride];
+        JPEGLI_TEST_ENSURE_TRUE(jpegli_read_scanlines(&cinfo, &row, 1) == 1);
+      }
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  ASSERT_EQ(outputs[0].size(), outputs[1].size());
+  EXPECT_EQ(0, memcmp(outputs[0].data(), outputs[1].data(), outputs[0].size()));
+}
+#endif
+
 TEST(DecodeAPITest, AbbreviatedStreams) {
   uint8_t* table_stream = nullptr;
   unsigned long table_stream_size = 0;  // NOLINT
@@ -969,6 +1521,31 @@ std::vector<TestConfig> GenerateTests(bool buffered) {
     config.jparams.restart_in_rows = rr;
     all_tests.push_back(config);
   }
+  // Tests for parallel decoding of RST segments.
+  for (size_t r : {1, 17, 1024}) {
+    for (size_t chunk_size : {0, 65536}) {
+      for (int progr : {0, 2}) {
+        TestConfig config;
+        config.dparams.chunk_size = chunk_size;
+        config.dparams.num_threads = 4;
+        config.jparams.progressive_mode = progr;
+        config.jparams.restart_interval = r;
+        all_tests.push_back(config);
+      }
+    }
+  }
+  // Tests for speculative parallel decoding of scans without RST markers.
+  for (int progr : {0, 2}) {
+    for (int h_samp : {1, 2}) {
+      TestConfig config;
+      config.dparams.num_threads = 4;
+      config.dparams.speculative_decoding = true;
+      config.jparams.progressive_mode = progr;
+      config.jparams.h_sampling = {h_samp, 1, 1};
+      config.jparams.v_sampling = {h_samp, 1, 1};
+      all_tests.push_back(config);
+    }
+  }
   // Tests for custom quantization tables.
   for (int type : {0, 1, 10, 100, 10000}) {
     for (int scale : {1, 50, 100, 200, 500}) {
@@ -1308,6 +1885,12 @@ std::ostream& operator<<(std::ostream& os, const DecompressParams& dparams) {
   if (dparams.skip_scans) {
     os << "SkipScans";
   }
+  if (dparams.num_threads > 0) {
+    os << "MT" << dparams.num_threads;
+  }
+  if (dparams.speculative_decoding) {
+    os << "Spec";
+  }
   return os;
 }
 
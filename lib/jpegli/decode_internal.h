@@ -13,6 +13,7 @@
 
 #include "jpeglib.h"
 #include "lib/base/compiler_specific.h"
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/huffman.h"
 #include "lib/jpegli/types.h"
@@ -35,6 +36,10 @@ struct MCUCodingState {
   coeff_t coeffs[D_MAX_BLOCKS_IN_MCU * DCTSIZE2];
 };
 
+// The fill_input_buffer callback of the memory and memory mapped source
+// managers, which have the whole input in their buffer.
+boolean EmitFakeEoiMarker(j_decompress_ptr cinfo);
+
 }  // namespace jpegli
 
 // Use this forward-declared libjpeg struct to hold all our private variables.
@@ -43,8 +48,12 @@ struct jpeg_decomp_master {
   //
   // Input handling state.
   //
+  // Staging buffer for the input data when a marker segment or MCU straddles
+  // the boundary of the source manager's buffer. Its tail holds the first
+  // input_buffer_src_bytes_ bytes of the current source buffer.
   std::vector<uint8_t> input_buffer_;
   size_t input_buffer_pos_;
+  size_t input_buffer_src_bytes_;
   // Number of bits after codestream_pos_ that were already processed.
   size_t codestream_bits_ahead_;
 
@@ -72,6 +81,8 @@ struct jpeg_decomp_master {
   std::vector<uint8_t> icc_profile_;
   jpegli::HuffmanTableEntry dc_huff_lut_[jpegli::kAllHuffLutSize];
   jpegli::HuffmanTableEntry ac_huff_lut_[jpegli::kAllHuffLutSize];
+  jpegli::HuffmanFastEntry
+      ac_huff_fast_lut_[NUM_HUFF_TBLS * jpegli::kJpegHuffmanFastSize];
   uint8_t markers_to_save_[32];
   jpeg_marker_parser_method app_marker_parsers[16];
   jpeg_marker_parser_method com_marker_parser;
@@ -96,6 +107,32 @@ struct jpeg_decomp_master {
   int next_restart_marker_;
 
   jpegli::MCUCodingState mcu_;
+  // If non-zero, decoding the current MCU ran out of input, and it is not
+  // attempted again until this many bytes are available or a marker is found.
+  size_t mcu_retry_bytes_;
+  // True if none of the components of the current scan are needed for the
+  // output, in which case its entropy coded data is skipped.
+  bool skip_scan_;
+
+  // Parallel runner used to decode the restart segments of a scan in
+  // parallel, if the whole scan is available in the input buffer.
+  JxlParallelRunner runner = nullptr;
+  void* runner_opaque = nullptr;
+  // Whether scans without restart markers are decoded in parallel by
+  // speculatively decoding chunks of the entropy coded data.
+  bool speculative_decoding = false;
+  // Minimum size of the entropy coded data decoded by one task in speculative
+  // decoding. Only changed by tests.
+  size_t speculative_chunk_size = 1 << 16;
+  // If true, the 8x8 inverse DCT does not use the fast paths for sparse
+  // blocks. Only changed by tests.
+  bool disable_sparse_idct = false;
+  // If true, the scaled inverse DCTs use the scalar generic transform for every
+  // output size. Only changed by tests.
+  bool use_generic_idct = false;
+  // If positive, the decoding of multi-scan images in non-buffered image mode
+  // stops after this many scans, see jpegli_set_max_scans().
+  int max_scans = 0;
 
   //
   // Rendering state.
@@ -103,6 +140,9 @@ struct jpeg_decomp_master {
   int output_passes_done_;
   JpegliDataType output_data_type_ = JPEGLI_TYPE_UINT8;
   size_t xoffset_;
+  // End of the output rows that are being skipped over by
+  // jpegli_skip_scanlines().
+  size_t skip_scanlines_end_ = 0;
   bool swap_endianness_ = false;
   bool need_context_rows_;
   bool regenerate_inverse_colormap_;
@@ -107,6 +107,7 @@ void ProcessSOF(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
     JPEG_VERIFY_INPUT(quant_tbl_idx, 0, NUM_QUANT_TBLS - 1);
     comp->quant_tbl_no = quant_tbl_idx;
     comp->quant_table = nullptr;  // will be allocated after SOS marker
+    comp->component_needed = TRUE;
   }
   JPEG_VERIFY_MARKER_END();
 
@@ -9,7 +9,9 @@
 #include <algorithm>
 #include <cstring>
 #include <hwy/base.h>  // HWY_ALIGN_MAX
+#include <vector>
 
+#include "lib/base/byte_order.h"
 #include "lib/base/status.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
@@ -63,6 +65,19 @@ struct BitReaderState {
 
   void FillBitWindow() {
     if (bits_left_ <= 16) {
+      // Fast path: if none of the next 8 bytes is 0xff, there are no escape
+      // sequences or markers among them and the window can be refilled with a
+      // single load.
+      if (bits_left_ > 0 && pos_ + 8 <= next_marker_pos_) {
+        uint64_t word = LoadBE64(data_ + pos_);
+        if (!HasZeroByte(~word)) {
+          int nbytes = (64 - bits_left_) >> 3;
+          val_ = (val_ << (nbytes * 8)) | (word >> (64 - nbytes * 8));
+          bits_left_ += nbytes * 8;
+          pos_ += nbytes;
+          return;
+        }
+      }
       while (bits_left_ <= 56) {
         val_ <<= 8;
         val_ |= static_cast<uint64_t>(GetNextByte());
@@ -78,23 +93,36 @@ struct BitReaderState {
     return val;
   }
 
-  // Sets *pos to the next stream position, and *bit_pos to the bit position
-  // within the next byte where parsing should continue.
-  // Returns false if the stream ended too early.
-  bool FinishStream(size_t* pos, size_t* bit_pos) {
-    *bit_pos = (8 - (bits_left_ & 7)) & 7;
+  // Returns the position of the byte that contains the next unread bit.
+  size_t NextBytePos() const {
+    size_t pos = pos_;
     // Give back some bytes that we did not use.
     int unused_bytes_left = DivCeil(bits_left_, 8);
     while (unused_bytes_left-- > 0) {
-      --pos_;
+      --pos;
       // If we give back a 0 byte, we need to check if it was a 0xff/0x00 escape
       // sequence, and if yes, we need to give back one more byte.
-      if (((pos_ == len_ && pos_ == next_marker_pos_) ||
-           (pos_ > 0 && pos_ < next_marker_pos_ && data_[pos_] == 0)) &&
-          (data_[pos_ - 1] == 0xff)) {
-        --pos_;
+      if (((pos == len_ && pos == next_marker_pos_) ||
+           (pos > 0 && pos < next_marker_pos_ && data_[pos] == 0)) &&
+          (data_[pos - 1] == 0xff)) {
+        --pos;
       }
     }
+    return pos;
+  }
+
+  // Returns the position of the next unread bit of the stream in bits, which
+  // does not depend on how far ahead the bit window was filled.
+  size_t BitPosition() const {
+    return NextBytePos() * 8 + ((8 - (bits_left_ & 7)) & 7);
+  }
+
+  // Sets *pos to the next stream position, and *bit_pos to the bit position
+  // within the next byte where parsing should continue.
+  // Returns false if the stream ended too early.
+  bool FinishStream(size_t* pos, size_t* bit_pos) {
+    *bit_pos = (8 - (bits_left_ & 7)) & 7;
+    pos_ = NextBytePos();
     if (pos_ >= next_marker_pos_) {
       *pos = next_marker_pos_;
       if (pos_ > next_marker_pos_ || *bit_pos > 0) {
@@ -175,7 +203,8 @@ int HuffExtend(int x, int s) {
 
 // Decodes one 8x8 block of DCT coefficients from the bit stream.
 bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
-                    const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
+                    const HuffmanTableEntry* ac_huff,
+                    const HuffmanFastEntry* ac_fast, int Ss, int Se, int Al,
                     int* eobrun, BitReaderState* br, coeff_t* last_dc_coeff,
                     coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
@@ -209,6 +238,24 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
     return true;
   }
   for (int k = Ss; k <= Se; k++) {
+    // Most non-zero coefficients have short codes and only a few extra bits,
+    // these are decoded with a single lookup in the fast table.
+    br->FillBitWindow();
+    const HuffmanFastEntry& fast =
+        ac_fast[(br->val_ >> (br->bits_left_ - kJpegHuffmanFastBits)) &
+                (kJpegHuffmanFastSize - 1)];
+    if (fast.bits > 0) {
+      k += fast.symbol >> 4;
+      if (k > Se) {
+        return false;
+      }
+      if ((fast.symbol & 15) + Al >= kJpegDCAlphabetSize) {
+        return false;
+      }
+      br->bits_left_ -= fast.bits;
+      coeffs[kJPEGNaturalOrder[k]] = fast.value * Am;
+      continue;
+    }
     int sr = ReadSymbol(ac_huff, br);
     if (sr >= kJpegHuffmanAlphabetSize) {
       return false;
@@ -343,6 +390,71 @@ bool RefineDCTBlock(const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
   return true;
 }
 
+// Decodes the MCU at the given MCU row and column of the current scan.
+// get_block(comp, block_y, block_x) must return the coefficients of the given
+// block, blocks outside of the image and blocks of components that are not
+// needed for the output are decoded into sink_block.
+template <typename BlockFunc>
+bool DecodeMCU(j_decompress_ptr cinfo, size_t mcu_row, size_t mcu_col,
+               const BlockFunc& get_block, coeff_t* sink_block,
+               coeff_t* last_dc_coeff, int* eobrun, BitReaderState* br) {
+  jpeg_decomp_master* m = cinfo->master;
+  bool scan_ok = true;
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    const HuffmanTableEntry* dc_lut =
+        &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
+    const HuffmanTableEntry* ac_lut =
+        &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
+    const HuffmanFastEntry* ac_fast =
+        &m->ac_huff_fast_lut_[comp->ac_tbl_no * kJpegHuffmanFastSize];
+    for (int iy = 0; iy < comp->MCU_height; ++iy) {
+      size_t block_y = mcu_row * comp->MCU_height + iy;
+      for (int ix = 0; ix < comp->MCU_width; ++ix) {
+        size_t block_x = mcu_col * comp->MCU_width + ix;
+        coeff_t* coeffs;
+        if (block_x >= comp->width_in_blocks ||
+            block_y >= comp->height_in_blocks || !comp->component_needed) {
+          // Note that it is OK that sink_block is uninitialized because
+          // it will never be used in any branches, even in the RefineDCTBlock
+          // case, because only DC scans can be interleaved and we don't use
+          // the zero-ness of the DC coeff in the DC refinement code-path.
+          coeffs = sink_block;
+        } else {
+          coeffs = get_block(comp, block_y, block_x);
+        }
+        if (cinfo->Ah == 0) {
+          if (!DecodeDCTBlock(dc_lut, ac_lut, ac_fast, cinfo->Ss, cinfo->Se,
+                              cinfo->Al, eobrun, br,
+                              &last_dc_coeff[comp->component_index], coeffs)) {
+            scan_ok = false;
+          }
+        } else {
+          if (!RefineDCTBlock(ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al, eobrun,
+                              br, coeffs)) {
+            scan_ok = false;
+          }
+        }
+      }
+    }
+  }
+  return scan_ok;
+}
+
+// Returns true if there is a marker, i.e. a 0xff byte followed by a non-zero
+// byte in the data.
+bool ContainsMarker(const uint8_t* data, size_t len) {
+  const uint8_t* end = data + len;
+  const uint8_t* p = data;
+  while (p + 1 < end) {
+    p = static_cast<const uint8_t*>(memchr(p, 0xff, end - p - 1));
+    if (p == nullptr) return false;
+    if (p[1] != 0) return true;
+    p += 2;
+  }
+  return false;
+}
+
 void SaveMCUCodingState(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   memcpy(m->mcu_.last_dc_coeff, m->last_dc_coeff_, sizeof(m->last_dc_coeff_));
@@ -418,6 +530,453 @@ bool FinishScan(j_decompress_ptr cinfo, const uint8_t* data, const size_t len,
   return true;
 }
 
+
+// Finds the restart markers of the current scan in data[pos, len) and stores
+// the start positions of the num_segments restart segments in segment_start,
+// followed by the position of the marker after the scan. Returns false if the
+// scan is not complete in the buffer or if the restart markers are missing or
+// out of order.
+bool FindRestartSegments(const uint8_t* data, size_t len, size_t pos,
+                         size_t num_segments,
+                         std::vector<size_t>* segment_start) {
+  segment_start->assign(1, pos);
+  while (pos + 1 < len) {
+    const void* next = memchr(data + pos, 0xff, len - pos - 1);
+    if (next == nullptr) return false;
+    pos = static_cast<const uint8_t*>(next) - data;
+    uint8_t marker = data[pos + 1];
+    if (marker == 0) {
+      pos += 2;
+      continue;
+    }
+    // Leave fill bytes and other unusual cases to the serial decoder.
+    if (marker == 0xff) return false;
+    size_t num_found = segment_start->size();
+    if (marker < 0xd0 || marker > 0xd7) {
+      // End of scan.
+      segment_start->push_back(pos);
+      return num_found == num_segments;
+    }
+    if (num_found == num_segments || marker != 0xd0 + ((num_found - 1) & 7)) {
+      return false;
+    }
+    pos += 2;
+    segment_start->push_back(pos);
+  }
+  return false;
+}
+
+// The worker threads can not access the virtual arrays, so we collect the
+// row pointers of all block rows of the components of the current scan.
+void GetBlockRows(j_decompress_ptr cinfo,
+                  std::vector<JBLOCKROW>* block_rows) {
+  jpeg_decomp_master* m = cinfo->master;
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    int c = comp->component_index;
+    if (!comp->component_needed) continue;
+    block_rows[c].resize(comp->height_in_blocks);
+    for (size_t by = 0; by < comp->height_in_blocks; ++by) {
+      block_rows[c][by] = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], by, 1,
+          TRUE)[0];
+    }
+  }
+}
+
+struct RestartSegment {
+  // Input position after the last MCU of the segment.
+  size_t end_pos;
+  bool decode_ok;
+  bool stream_ok;
+  bool eobrun_ok;
+};
+
+// Decodes the current scan by decoding its restart segments in parallel, if
+// the whole scan is in data[*pos, len). Returns false without decoding anything
+// if this is not possible, otherwise updates *pos to the end of the scan.
+bool ProcessScanInParallel(j_decompress_ptr cinfo, const uint8_t* const data,
+                           const size_t len, size_t* pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t restart_interval = cinfo->restart_interval;
+  const size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  const size_t num_segments = DivCeil(num_mcus, restart_interval);
+  std::vector<size_t> segment_start;
+  if (num_segments < 2 ||
+      !FindRestartSegments(data, len, *pos, num_segments, &segment_start)) {
+    return false;
+  }
+  std::vector<JBLOCKROW> block_rows[kMaxComponents];
+  GetBlockRows(cinfo, block_rows);
+  const auto get_block = [&](const jpeg_component_info* comp, size_t block_y,
+                             size_t block_x) {
+    return &block_rows[comp->component_index][block_y][block_x][0];
+  };
+  std::vector<RestartSegment> segments(num_segments);
+  const auto decode_segment = [&](const uint32_t task, size_t /*thread*/) {
+    HWY_ALIGN_MAX coeff_t sink_block[DCTSIZE2];
+    coeff_t last_dc_coeff[kMaxComponents] = {};
+    int eobrun = -1;
+    BitReaderState br(data, len, segment_start[task]);
+    RestartSegment* segment = &segments[task];
+    segment->decode_ok = true;
+    size_t mcu_end = std::min(num_mcus, (task + 1) * restart_interval);
+    for (size_t mcu = task * restart_interval; mcu < mcu_end; ++mcu) {
+      size_t mcu_row = mcu / cinfo->MCUs_per_row;
+      size_t mcu_col = mcu % cinfo->MCUs_per_row;
+      if (!DecodeMCU(cinfo, mcu_row, mcu_col, get_block, sink_block,
+                     last_dc_coeff, &eobrun, &br)) {
+        segment->decode_ok = false;
+        break;
+      }
+    }
+    size_t bit_pos;
+    segment->stream_ok = br.FinishStream(&segment->end_pos, &bit_pos);
+    if (segment->stream_ok && bit_pos > 0) {
+      // Skip the padding bits, see FinishScan().
+      segment->end_pos += data[segment->end_pos] == 0xff ? 2 : 1;
+    }
+    segment->eobrun_ok = eobrun <= 0;
+  };
+  RunParallel(cinfo, num_segments, decode_segment, "ProcessScanInParallel");
+  // Report the errors in the same order as the serial decoder would.
+  for (size_t i = 0; i < num_segments; ++i) {
+    const RestartSegment& segment = segments[i];
+    if (!segment.stream_ok) {
+      JPEGLI_WARN("Incomplete scan detected.");
+      break;
+    }
+    if (!segment.decode_ok) {
+      JPEGLI_ERROR("Failed to decode DCT block");
+    }
+    if (!segment.eobrun_ok) {
+      JPEGLI_ERROR("End-of-block run too long.");
+    }
+    if (i + 1 < num_segments) {
+      size_t num_skipped = segment_start[i + 1] - 2 - segment.end_pos;
+      if (num_skipped > 0) {
+        JPEGLI_WARN("Skipped %d bytes before restart marker",
+                    static_cast<int>(num_skipped));
+      }
+    }
+  }
+  *pos = segments[num_segments - 1].end_pos;
+  return true;
+}
+
+// Maximum number of tasks in speculative decoding, the minimum size of the
+// entropy coded data decoded by one task is speculative_chunk_size.
+constexpr size_t kMaxSpeculativeChunks = 1024;
+// Number of MCU boundaries recorded at the start and after the end of each
+// chunk, the speculative decoding of a chunk must synchronize with the
+// decoding of the previous chunk within this many MCUs.
+constexpr size_t kMaxSyncMCUs = 64;
+
+// Maximum number of times the speculative decoding of a chunk is restarted at
+// the next bit position after a decoding error before its end.
+constexpr size_t kMaxSpeculativeRestarts = 64;
+
+// MCU boundary found by the speculative decoding of a chunk.
+struct MCUBoundary {
+  size_t bit_pos;
+  // Number of MCUs decoded since the start of the chunk.
+  size_t mcu;
+  coeff_t last_dc_coeff[kMaxComponents];
+};
+
+struct SpeculativeChunk {
+  // The first kMaxSyncMCUs MCU boundaries from the start of the chunk.
+  std::vector<MCUBoundary> head;
+  // The first kMaxSyncMCUs MCU boundaries after the end of the chunk.
+  std::vector<MCUBoundary> tail;
+  // Bit positions of all MCU boundaries of the speculative decoding.
+  std::vector<size_t> bit_pos;
+  // Coefficients of the decoded MCUs, in the order of the MCU boundaries, with
+  // the DC coefficients relative to the speculative DC predictors.
+  std::vector<coeff_t> coeffs;
+};
+
+// True decoding state at the start of a chunk.
+struct ChunkStart {
+  size_t bit_pos;
+  size_t mcu;
+  // Index of the MCU boundary of the chunk's speculative decoding at bit_pos.
+  size_t spec_mcu;
+  coeff_t last_dc_coeff[kMaxComponents];
+  // Difference between the true and the speculative DC predictors.
+  int dc_offset[kMaxComponents];
+};
+
+// Decodes a sequential scan without restart markers by splitting its entropy
+// coded data into chunks at arbitrary byte positions. Each chunk is decoded on
+// the parallel runner as if an MCU started at its first byte, into a buffer of
+// the chunk, and the MCU boundaries around the start and the end of the chunk
+// are recorded. Since Huffman codes tend to self-synchronize, the decoding of a
+// chunk will soon find the same MCU boundaries as the decoding of the previous
+// chunk that ran past its end. From a common MCU boundary that is after the
+// point where the previous chunk itself was synchronized, we can derive the
+// true MCU index and DC predictors at the start of each chunk. The
+// synchronized part of each chunk's buffer is then copied to the coefficient
+// arrays on the parallel runner, with the DC coefficients corrected.
+// Returns false without decoding anything if the scan is not complete in the
+// input buffer or the chunk decodings do not synchronize, in which case the
+// scan must be decoded serially.
+bool ProcessScanSpeculatively(j_decompress_ptr cinfo,
+                              const uint8_t* const data, const size_t len,
+                              size_t* pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (!m->speculative_decoding || cinfo->Ss != 0 ||
+      cinfo->Se != DCTSIZE2 - 1 || cinfo->Ah != 0) {
+    return false;
+  }
+  // Offset of the blocks of each scan component within an MCU.
+  size_t block_offset[kMaxComponents] = {};
+  size_t blocks_per_mcu = 0;
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    if (comp->width_in_blocks < static_cast<JDIMENSION>(comp->MCU_width) ||
+        comp->height_in_blocks < static_cast<JDIMENSION>(comp->MCU_height)) {
+      return false;
+    }
+    block_offset[comp->component_index] = blocks_per_mcu;
+    blocks_per_mcu += comp->MCU_width * comp->MCU_height;
+  }
+  const size_t coeffs_per_mcu = blocks_per_mcu * DCTSIZE2;
+  std::vector<size_t> scan_bounds;
+  if (!FindRestartSegments(data, len, *pos, 1, &scan_bounds)) {
+    return false;
+  }
+  const size_t scan_start = scan_bounds[0];
+  const size_t scan_size = scan_bounds[1] - scan_start;
+  const size_t num_chunks = std::min(kMaxSpeculativeChunks,
+                                     scan_size / m->speculative_chunk_size);
+  if (num_chunks < 2) {
+    return false;
+  }
+  std::vector<size_t> chunk_start(num_chunks + 1);
+  for (size_t i = 0; i < num_chunks; ++i) {
+    chunk_start[i] = scan_start + scan_size * i / num_chunks;
+    if (i > 0 && data[chunk_start[i] - 1] == 0xff) {
+      // Do not start in the middle of a 0xff/0x00 escape sequence.
+      ++chunk_start[i];
+    }
+  }
+  chunk_start[num_chunks] = scan_bounds[1];
+  const size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+
+  // Speculative decoding of the chunks. Each chunk is decoded only once, up to
+  // kMaxSyncMCUs MCUs after its end, or up to the end of the scan for the last
+  // chunk.
+  std::vector<SpeculativeChunk> chunks(num_chunks);
+  const auto speculate_chunk = [&](const uint32_t task, size_t /*thread*/) {
+    HWY_ALIGN_MAX coeff_t sink_block[DCTSIZE2];
+    SpeculativeChunk* chunk = &chunks[task];
+    const bool last_chunk = task + 1 == num_chunks;
+    const size_t end_bit_pos = chunk_start[task + 1] * 8;
+    size_t start_bit_pos = chunk_start[task] * 8;
+    MCUBoundary boundary = {start_bit_pos, 0, {}};
+    coeff_t* mcu_coeffs = nullptr;
+    // The MCU is decoded as if it was the first one of the scan, which has all
+    // of its blocks inside the component, see the check above.
+    const auto get_block = [&](const jpeg_component_info* comp, size_t block_y,
+                               size_t block_x) {
+      size_t b = block_offset[comp->component_index] +
+                 block_y * comp->MCU_width + block_x;
+      return &mcu_coeffs[b * DCTSIZE2];
+    };
+    int eobrun = -1;
+    BitReaderState br(data, len, chunk_start[task]);
+    size_t num_restarts = 0;
+    for (;;) {
+      boundary.bit_pos = br.BitPosition();
+      chunk->bit_pos.push_back(boundary.bit_pos);
+      if (chunk->head.size() < kMaxSyncMCUs) {
+        chunk->head.push_back(boundary);
+      }
+      if (boundary.bit_pos >= end_bit_pos) {
+        if (last_chunk) break;
+        chunk->tail.push_back(boundary);
+        if (chunk->tail.size() == kMaxSyncMCUs) break;
+      }
+      if (boundary.mcu == num_mcus) break;
+      chunk->coeffs.resize(chunk->coeffs.size() + coeffs_per_mcu);
+      mcu_coeffs = &chunk->coeffs[chunk->coeffs.size() - coeffs_per_mcu];
+      if (!DecodeMCU(cinfo, 0, 0, get_block, sink_block,
+                     boundary.last_dc_coeff, &eobrun, &br)) {
+        chunk->coeffs.resize(chunk->coeffs.size() - coeffs_per_mcu);
+        if (boundary.bit_pos >= end_bit_pos ||
+            num_restarts == kMaxSpeculativeRestarts) {
+          break;
+        }
+        // Before the end of the chunk, a decoding error usually means that
+        // the speculative decoding is not yet aligned to the MCU boundaries,
+        // so we start over at the next bit position. If the error is in the
+        // true decoding, the previous chunk did not get past it either, so the
+        // chunks will not synchronize and the scan is decoded serially.
+        ++num_restarts;
+        ++start_bit_pos;
+        if (start_bit_pos % 8 == 0 && data[start_bit_pos / 8 - 1] == 0xff) {
+          // Skip the zero byte of the 0xff/0x00 escape sequence.
+          start_bit_pos += 8;
+        }
+        if (start_bit_pos >= end_bit_pos) break;
+        chunk->head.clear();
+        chunk->bit_pos.clear();
+        chunk->coeffs.clear();
+        boundary = {start_bit_pos, 0, {}};
+        eobrun = -1;
+        br.Reset(start_bit_pos / 8);
+        if (start_bit_pos % 8 > 0) {
+          br.ReadBits(start_bit_pos % 8);
+        }
+        continue;
+      }
+      ++boundary.mcu;
+    }
+  };
+  RunParallel(cinfo, num_chunks, speculate_chunk, "SpeculateChunk");
+
+  // Find the true decoding state at the start of each chunk.
+  std::vector<ChunkStart> starts(num_chunks);
+  starts[0].bit_pos = scan_start * 8;
+  starts[0].mcu = 0;
+  starts[0].spec_mcu = 0;
+  memset(starts[0].last_dc_coeff, 0, sizeof(starts[0].last_dc_coeff));
+  memset(starts[0].dc_offset, 0, sizeof(starts[0].dc_offset));
+  for (size_t i = 1; i < num_chunks; ++i) {
+    const ChunkStart& prev = starts[i - 1];
+    const std::vector<MCUBoundary>& tail = chunks[i - 1].tail;
+    const std::vector<MCUBoundary>& head = chunks[i].head;
+    // The decoding of the previous chunk is only known to be correct from its
+    // own synchronization point, the boundaries of its tail before that are
+    // not real MCU boundaries.
+    size_t a = 0;
+    while (a < tail.size() && tail[a].bit_pos < prev.bit_pos) ++a;
+    size_t h = 0;
+    while (a < tail.size() && h < head.size() &&
+           tail[a].bit_pos != head[h].bit_pos) {
+      if (tail[a].bit_pos < head[h].bit_pos) {
+        ++a;
+      } else {
+        ++h;
+      }
+    }
+    if (a == tail.size() || h == head.size() ||
+        tail[a].mcu < prev.spec_mcu) {
+      return false;
+    }
+    ChunkStart* start = &starts[i];
+    start->bit_pos = tail[a].bit_pos;
+    start->mcu = prev.mcu + (tail[a].mcu - prev.spec_mcu);
+    if (start->mcu <= prev.mcu || start->mcu >= num_mcus) {
+      return false;
+    }
+    start->spec_mcu = head[h].mcu;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      int dc = tail[a].last_dc_coeff[c] + prev.dc_offset[c];
+      if (dc != static_cast<coeff_t>(dc)) {
+        return false;
+      }
+      start->last_dc_coeff[c] = dc;
+      start->dc_offset[c] = dc - head[h].last_dc_coeff[c];
+    }
+  }
+  // The last chunk must have decoded all the remaining MCUs.
+  const ChunkStart& last_start = starts[num_chunks - 1];
+  const SpeculativeChunk& last_chunk = chunks[num_chunks - 1];
+  if (last_chunk.coeffs.size() / coeffs_per_mcu <
+      last_start.spec_mcu + num_mcus - last_start.mcu) {
+    return false;
+  }
+
+  // Copy the synchronized part of the chunks to the coefficient arrays.
+  std::vector<JBLOCKROW> block_rows[kMaxComponents];
+  GetBlockRows(cinfo, block_rows);
+  std::vector<uint8_t> copy_ok(num_chunks);
+  const auto copy_chunk = [&](const uint32_t task, size_t /*thread*/) {
+    const ChunkStart& start = starts[task];
+    const SpeculativeChunk& chunk = chunks[task];
+    const size_t mcu_end =
+        task + 1 < num_chunks ? starts[task + 1].mcu : num_mcus;
+    copy_ok[task] = 1;
+    for (size_t mcu = start.mcu; mcu < mcu_end; ++mcu) {
+      const size_t mcu_row = mcu / cinfo->MCUs_per_row;
+      const size_t mcu_col = mcu % cinfo->MCUs_per_row;
+      const coeff_t* mcu_coeffs =
+          &chunk.coeffs[(start.spec_mcu + mcu - start.mcu) * coeffs_per_mcu];
+      for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+        const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+        const int c = comp->component_index;
+        if (!comp->component_needed) continue;
+        const int dc_offset = start.dc_offset[c] * (1 << cinfo->Al);
+        for (int iy = 0; iy < comp->MCU_height; ++iy) {
+          size_t block_y = mcu_row * comp->MCU_height + iy;
+          if (block_y >= comp->height_in_blocks) continue;
+          for (int ix = 0; ix < comp->MCU_width; ++ix) {
+            size_t block_x = mcu_col * comp->MCU_width + ix;
+            if (block_x >= comp->width_in_blocks) continue;
+            const coeff_t* src =
+                &mcu_coeffs[(block_offset[c] + iy * comp->MCU_width + ix) *
+                            DCTSIZE2];
+            coeff_t* dst = &block_rows[c][block_y][block_x][0];
+            memcpy(dst, src, DCTSIZE2 * sizeof(dst[0]));
+            const int dc = src[0] + dc_offset;
+            dst[0] = dc;
+            if (dc != dst[0]) copy_ok[task] = 0;
+          }
+        }
+      }
+    }
+  };
+  RunParallel(cinfo, num_chunks, copy_chunk, "CopyChunk");
+  for (uint8_t ok : copy_ok) {
+    if (!ok) {
+      JPEGLI_ERROR("Failed to decode DCT block");
+    }
+  }
+  // Find the end of the scan after the last MCU, as FinishScan() does.
+  const size_t end_bit_pos =
+      last_chunk.bit_pos[last_start.spec_mcu + num_mcus - last_start.mcu];
+  BitReaderState br(data, len, end_bit_pos / 8);
+  if (end_bit_pos % 8 > 0) {
+    br.ReadBits(end_bit_pos % 8);
+  }
+  size_t end_pos;
+  size_t bit_pos;
+  if (!br.FinishStream(&end_pos, &bit_pos)) {
+    JPEGLI_WARN("Incomplete scan detected.");
+  } else if (bit_pos > 0) {
+    end_pos += data[end_pos] == 0xff ? 2 : 1;
+  }
+  *pos = end_pos;
+  return true;
+}
+
+// Skips over the entropy coded data of the current scan without decoding it,
+// up to the first marker that is not a restart marker.
+int SkipScan(j_decompress_ptr cinfo, const uint8_t* const data,
+             const size_t len, size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  *bit_pos = 0;
+  while (*pos + 1 < len) {
+    const void* next_ff = memchr(data + *pos, 0xff, len - 1 - *pos);
+    if (next_ff == nullptr) {
+      // Keep the last byte, it can be the first byte of a marker.
+      *pos = len - 1;
+      break;
+    }
+    *pos = static_cast<const uint8_t*>(next_ff) - data;
+    const uint8_t marker = data[*pos + 1];
+    if (marker != 0 && marker != 0xff && (marker < 0xd0 || marker > 0xd7)) {
+      m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+      m->scan_mcu_col_ = 0;
+      cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+      return JPEG_SCAN_COMPLETED;
+    }
+    ++(*pos);
+  }
+  return kNeedMoreInput;
+}
 }  // namespace
 
 void PrepareForiMCURow(j_decompress_ptr cinfo) {
@@ -425,6 +984,7 @@ void PrepareForiMCURow(j_decompress_ptr cinfo) {
   for (int i = 0; i < cinfo->comps_in_scan; ++i) {
     const jpeg_component_info* comp = cinfo->cur_comp_info[i];
     int c = comp->component_index;
+    if (!comp->component_needed) continue;
     int by0 = cinfo->input_iMCU_row * comp->v_samp_factor;
     int block_rows_left = comp->height_in_blocks - by0;
     int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
@@ -441,6 +1001,20 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
     return kNeedMoreInput;
   }
   jpeg_decomp_master* m = cinfo->master;
+  if (m->skip_scan_) {
+    return SkipScan(cinfo, data, len, pos, bit_pos);
+  }
+  if (m->runner != nullptr && !m->streaming_mode_ && m->scan_mcu_row_ == 0 &&
+      m->scan_mcu_col_ == 0 && *bit_pos == 0 &&
+      (cinfo->restart_interval > 0
+           ? ProcessScanInParallel(cinfo, data, len, pos)
+           : ProcessScanSpeculatively(cinfo, data, len, pos))) {
+    m->eobrun_ = -1;
+    memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+    m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+    cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+    return JPEG_SCAN_COMPLETED;
+  }
   for (;;) {
     // Handle the restart intervals.
     if (cinfo->restart_interval > 0 && m->restarts_to_go_ == 0) {
@@ -467,6 +1041,12 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
     }
 
     size_t start_pos = *pos;
+    if (m->mcu_retry_bytes_ > 0 && start_pos + m->mcu_retry_bytes_ > len &&
+        !ContainsMarker(data + start_pos, len - start_pos)) {
+      // The last attempt to decode this MCU ran out of input, wait for enough
+      // new input before attempting again.
+      return kNeedMoreInput;
+    }
     BitReaderState br(data, len, start_pos);
     if (*bit_pos > 0) {
       br.ReadBits(*bit_pos);
@@ -477,46 +1057,14 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
 
     // Decode one MCU.
     HWY_ALIGN_MAX static coeff_t sink_block[DCTSIZE2] = {0};
-    bool scan_ok = true;
-    for (int i = 0; i < cinfo->comps_in_scan; ++i) {
-      const jpeg_component_info* comp = cinfo->cur_comp_info[i];
-      int c = comp->component_index;
-      const HuffmanTableEntry* dc_lut =
-          &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
-      const HuffmanTableEntry* ac_lut =
-          &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
-      for (int iy = 0; iy < comp->MCU_height; ++iy) {
-        size_t block_y = m->scan_mcu_row_ * comp->MCU_height + iy;
-        int biy = block_y % comp->v_samp_factor;
-        for (int ix = 0; ix < comp->MCU_width; ++ix) {
-          size_t block_x = m->scan_mcu_col_ * comp->MCU_width + ix;
-          coeff_t* coeffs;
-          if (block_x >= comp->width_in_blocks ||
-              block_y >= comp->height_in_blocks) {
-            // Note that it is OK that sink_block is uninitialized because
-            // it will never be used in any branches, even in the RefineDCTBlock
-            // case, because only DC scans can be interleaved and we don't use
-            // the zero-ness of the DC coeff in the DC refinement code-path.
-            coeffs = sink_block;
-          } else {
-            coeffs = &m->coeff_rows[c][biy][block_x][0];
-          }
-          if (cinfo->Ah == 0) {
-            if (!DecodeDCTBlock(dc_lut, ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
-                                &m->eobrun_, &br,
-                                &m->last_dc_coeff_[comp->component_index],
-                                coeffs)) {
-              scan_ok = false;
-            }
-          } else {
-            if (!RefineDCTBlock(ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
-                                &m->eobrun_, &br, coeffs)) {
-              scan_ok = false;
-            }
-          }
-        }
-      }
-    }
+    const auto get_block = [&](const jpeg_component_info* comp,
+                               size_t block_y, size_t block_x) {
+      int biy = block_y % comp->v_samp_factor;
+      return &m->coeff_rows[comp->component_index][biy][block_x][0];
+    };
+    bool scan_ok =
+        DecodeMCU(cinfo, m->scan_mcu_row_, m->scan_mcu_col_, get_block,
+                  sink_block, m->last_dc_coeff_, &m->eobrun_, &br);
     size_t new_pos;
     size_t new_bit_pos;
     bool stream_ok = br.FinishStream(&new_pos, &new_bit_pos);
@@ -527,8 +1075,13 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
       // and thus the last prefix code length could have been wrong. We can do
       // this because a valid JPEG bit stream has two extra bytes at the end.
       RestoreMCUCodingState(cinfo);
+      // Require twice as much input for the next attempt, so that an MCU
+      // fed in small chunks is decoded only a logarithmic number of times.
+      m->mcu_retry_bytes_ =
+          std::min<size_t>(2 * (len - start_pos), kMaxMCUByteSize + 2);
       return kNeedMoreInput;
     }
+    m->mcu_retry_bytes_ = 0;
     *pos = new_pos;
     *bit_pos = new_bit_pos;
     if (!stream_ok) {
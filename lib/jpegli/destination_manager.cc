@@ -4,6 +4,8 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -13,6 +15,7 @@
 #include "lib/jpegli/encode.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/types.h"
 
 namespace jpegli {
 
@@ -53,6 +56,17 @@ struct StdioDestinationManager {
   }
 };
 
+// Returns an estimate of the compressed size of the image, which is used as
+// the initial size of the output buffers that are allocated by us.
+size_t EstimateOutputSize(j_compress_ptr cinfo) {
+  // About 1 bit per sample plus the headers and tables, which is what typical
+  // photographic images need at the default quality settings. Larger outputs
+  // go through the growing path of the destination managers.
+  size_t num_samples = static_cast<size_t>(cinfo->image_width) *
+                       cinfo->image_height * cinfo->num_components;
+  return std::max(kDestBufferSize, num_samples / 8 + (4 << 10));
+}
+
 struct MemoryDestinationManager {
   jpeg_destination_mgr pub;
   // Output buffer supplied by the application
@@ -64,23 +78,53 @@ struct MemoryDestinationManager {
   uint8_t* current_buffer;
   size_t buffer_size;
 
-  static void init_destination(j_compress_ptr cinfo) {}
-
-  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+  // Makes room for at least min_free more bytes in the output buffer. Our own
+  // buffer is grown in place if possible, the application supplied buffer is
+  // copied to a new buffer allocated by us.
+  static void Grow(j_compress_ptr cinfo, size_t min_free) {
     auto* dest = reinterpret_cast<MemoryDestinationManager*>(cinfo->dest);
-    uint8_t* next_buffer =
-        reinterpret_cast<uint8_t*>(malloc(dest->buffer_size * 2));
-    memcpy(next_buffer, dest->current_buffer, dest->buffer_size);
-    if (dest->temp_buffer != nullptr) {
-      free(dest->temp_buffer);
+    size_t used = dest->buffer_size - dest->pub.free_in_buffer;
+    size_t new_size = std::max(dest->buffer_size * 2, used + min_free);
+    uint8_t* next_buffer;
+    if (dest->temp_buffer != nullptr &&
+        dest->temp_buffer == dest->current_buffer) {
+      next_buffer =
+          reinterpret_cast<uint8_t*>(realloc(dest->temp_buffer, new_size));
+    } else {
+      next_buffer = reinterpret_cast<uint8_t*>(malloc(new_size));
+      if (next_buffer != nullptr) {
+        memcpy(next_buffer, dest->current_buffer, used);
+        if (dest->temp_buffer != nullptr) {
+          free(dest->temp_buffer);
+        }
+      }
+    }
+    if (next_buffer == nullptr) {
+      JPEGLI_ERROR("Failed to allocate output buffer.");
     }
     dest->temp_buffer = next_buffer;
     dest->current_buffer = next_buffer;
     *dest->output = next_buffer;
-    *dest->output_size = dest->buffer_size;
-    dest->pub.next_output_byte = next_buffer + dest->buffer_size;
-    dest->pub.free_in_buffer = dest->buffer_size;
-    dest->buffer_size *= 2;
+    *dest->output_size = used;
+    dest->pub.next_output_byte = next_buffer + used;
+    dest->pub.free_in_buffer = new_size - used;
+    dest->buffer_size = new_size;
+  }
+
+  static void init_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<MemoryDestinationManager*>(cinfo->dest);
+    // Size our own buffer for the whole image up front, so that it is not
+    // reallocated repeatedly while writing the output.
+    size_t estimate = EstimateOutputSize(cinfo);
+    if (dest->temp_buffer != nullptr &&
+        dest->temp_buffer == dest->current_buffer &&
+        dest->pub.free_in_buffer < estimate) {
+      Grow(cinfo, estimate);
+    }
+  }
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    Grow(cinfo, kDestBufferSize);
     return TRUE;
   }
 
@@ -90,6 +134,77 @@ struct MemoryDestinationManager {
   }
 };
 
+struct ChainDestinationManager {
+  jpeg_destination_mgr pub;
+  // Output chain of the application.
+  JpegliBuffer** output;
+  size_t* output_length;
+  // Buffers of the application that are filled before we allocate any.
+  JpegliBuffer* app_buffers;
+  size_t num_app_buffers;
+  // Buffers of the current image, the ones after the application's buffers
+  // are allocated by us.
+  JpegliBuffer* chain;
+  size_t chain_length;
+  size_t chain_capacity;
+
+  // Appends the next buffer of the application to the chain, or a new buffer
+  // of the given size if all of them are used, and continues the output there.
+  static void AddBuffer(j_compress_ptr cinfo, size_t size) {
+    auto* dest = reinterpret_cast<ChainDestinationManager*>(cinfo->dest);
+    if (dest->chain_length == dest->chain_capacity) {
+      size_t new_capacity = std::max<size_t>(8, 2 * dest->chain_capacity);
+      auto* new_chain = reinterpret_cast<JpegliBuffer*>(
+          realloc(dest->chain, new_capacity * sizeof(JpegliBuffer)));
+      if (new_chain == nullptr) {
+        JPEGLI_ERROR("Failed to allocate output buffer chain.");
+      }
+      dest->chain = new_chain;
+      dest->chain_capacity = new_capacity;
+    }
+    uint8_t* data;
+    if (dest->chain_length < dest->num_app_buffers) {
+      data = dest->app_buffers[dest->chain_length].data;
+      size = dest->app_buffers[dest->chain_length].size;
+    } else {
+      data = reinterpret_cast<uint8_t*>(malloc(size));
+      if (data == nullptr) {
+        JPEGLI_ERROR("Failed to allocate output buffer.");
+      }
+    }
+    dest->chain[dest->chain_length].data = data;
+    dest->chain[dest->chain_length].size = size;
+    ++dest->chain_length;
+    // The application owns the chain from the start, so that it can free the
+    // buffers even if compression is aborted.
+    *dest->output = dest->chain;
+    *dest->output_length = dest->chain_length;
+    dest->pub.next_output_byte = data;
+    dest->pub.free_in_buffer = size;
+  }
+
+  static void init_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChainDestinationManager*>(cinfo->dest);
+    dest->chain = nullptr;
+    dest->chain_length = 0;
+    dest->chain_capacity = 0;
+    AddBuffer(cinfo, EstimateOutputSize(cinfo));
+  }
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChainDestinationManager*>(cinfo->dest);
+    size_t last_size = dest->chain[dest->chain_length - 1].size;
+    AddBuffer(cinfo, std::max(2 * last_size, kDestBufferSize));
+    return TRUE;
+  }
+
+  static void term_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChainDestinationManager*>(cinfo->dest);
+    dest->chain[dest->chain_length - 1].size -= dest->pub.free_in_buffer;
+    dest->pub.free_in_buffer = 0;
+  }
+};
+
 }  // namespace jpegli
 
 void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile) {
@@ -151,3 +266,47 @@ void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
   dest->pub.next_output_byte = dest->current_buffer;
   dest->pub.free_in_buffer = dest->buffer_size;
 }
+
+void jpegli_chain_dest(j_compress_ptr cinfo, const JpegliBuffer* buffers,
+                       size_t num_buffers, JpegliBuffer** chain,
+                       size_t* chain_length) {
+  if (chain == nullptr || chain_length == nullptr ||
+      (buffers == nullptr && num_buffers > 0)) {
+    JPEGLI_ERROR("jpegli_chain_dest: Invalid destination.");
+  }
+  for (size_t i = 0; i < num_buffers; ++i) {
+    if (buffers[i].data == nullptr || buffers[i].size == 0) {
+      JPEGLI_ERROR("jpegli_chain_dest: Invalid buffer.");
+    }
+  }
+  if (cinfo->dest && cinfo->dest->init_destination !=
+                         jpegli::ChainDestinationManager::init_destination) {
+    JPEGLI_ERROR("jpegli_chain_dest: a different dest manager was already set");
+  }
+  if (!cinfo->dest) {
+    cinfo->dest = reinterpret_cast<jpeg_destination_mgr*>(
+        jpegli::Allocate<jpegli::ChainDestinationManager>(cinfo, 1));
+  }
+  auto* dest = reinterpret_cast<jpegli::ChainDestinationManager*>(cinfo->dest);
+  dest->pub.init_destination =
+      jpegli::ChainDestinationManager::init_destination;
+  dest->pub.empty_output_buffer =
+      jpegli::ChainDestinationManager::empty_output_buffer;
+  dest->pub.term_destination =
+      jpegli::ChainDestinationManager::term_destination;
+  dest->pub.next_output_byte = nullptr;
+  dest->pub.free_in_buffer = 0;
+  dest->output = chain;
+  dest->output_length = chain_length;
+  dest->app_buffers = nullptr;
+  if (num_buffers > 0) {
+    dest->app_buffers = jpegli::Allocate<JpegliBuffer>(cinfo, num_buffers);
+    memcpy(dest->app_buffers, buffers, num_buffers * sizeof(JpegliBuffer));
+  }
+  dest->num_app_buffers = num_buffers;
+  dest->chain = nullptr;
+  dest->chain_length = 0;
+  dest->chain_capacity = 0;
+  *chain = nullptr;
+  *chain_length = 0;
+}
@@ -36,6 +36,12 @@ namespace jpegli {
 
 constexpr size_t kMaxBytesInMarker = 65533;
 
+// Automatic restart intervals are chosen so that each scan has about this
+// many restart segments, each consisting of whole MCU rows.
+constexpr size_t kNumAutoRestartSegments = 64;
+// Scans with fewer blocks than this do not get automatic restart markers.
+constexpr size_t kMinBlocksForAutoRestarts = 1 << 12;
+
 void CheckState(j_compress_ptr cinfo, int state) {
   if (cinfo->global_state != state) {
     JPEGLI_ERROR("Unexpected global state %d [expected %d]",
@@ -82,6 +88,7 @@ void InitializeCompressParams(j_compress_ptr cinfo) {
   cinfo->min_DCT_v_scaled_size = DCTSIZE;
 #endif
   cinfo->master->psnr_target = 0.0f;
+  cinfo->master->target_size = 0;
   cinfo->master->psnr_tolerance = 0.01f;
   cinfo->master->min_distance = 0.1f;
   cinfo->master->max_distance = 25.0f;
@@ -239,6 +246,77 @@ void ValidateScanScript(j_compress_ptr cinfo) {
   }
 }
 
+// Validates the scan script and computes the per-scan entropy coding
+// parameters. This is called again from jpegli_finish_compress() if the scan
+// script is replaced by the scan script search.
+void ProcessScanScript(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->scan_info->Ss != 0 ||
+                                        cinfo->scan_info->Se != DCTSIZE2 - 1);
+  ValidateScanScript(cinfo);
+  // Automatic restart intervals are only used if the image goes through the
+  // non-streaming path anyway, where the entropy coded segments are written
+  // after all the tokens are computed.
+  const bool auto_restarts =
+      m->auto_restart_interval && cinfo->restart_interval == 0 &&
+      cinfo->restart_in_rows <= 0 &&
+      (cinfo->global_state == kEncWriteCoeffs || cinfo->num_scans > 1 ||
+       IsQuantSearchEnabled(cinfo));
+  m->scan_token_info =
+      Allocate<ScanTokenInfo>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  memset(m->scan_token_info, 0, cinfo->num_scans * sizeof(ScanTokenInfo));
+  m->ac_ctx_offset = Allocate<uint8_t>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  size_t num_ac_contexts = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
+    m->ac_ctx_offset[i] = 4 + num_ac_contexts;
+    if (scan_info->Se > 0) {
+      num_ac_contexts += scan_info->comps_in_scan;
+    }
+    if (num_ac_contexts > 252) {
+      JPEGLI_ERROR("Too many AC scans in image");
+    }
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    if (scan_info->comps_in_scan == 1) {
+      int comp_idx = scan_info->component_index[0];
+      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+      sti->MCUs_per_row = comp->width_in_blocks;
+      sti->MCU_rows_in_scan = comp->height_in_blocks;
+      sti->blocks_in_MCU = 1;
+    } else {
+      sti->MCUs_per_row =
+          DivCeil(cinfo->image_width, DCTSIZE * cinfo->max_h_samp_factor);
+      sti->MCU_rows_in_scan =
+          DivCeil(cinfo->image_height, DCTSIZE * cinfo->max_v_samp_factor);
+      sti->blocks_in_MCU = 0;
+      for (int j = 0; j < scan_info->comps_in_scan; ++j) {
+        int comp_idx = scan_info->component_index[j];
+        jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+        sti->blocks_in_MCU += comp->h_samp_factor * comp->v_samp_factor;
+      }
+    }
+    size_t num_MCUs = sti->MCU_rows_in_scan * sti->MCUs_per_row;
+    sti->num_blocks = num_MCUs * sti->blocks_in_MCU;
+    if (cinfo->restart_in_rows <= 0) {
+      sti->restart_interval = cinfo->restart_interval;
+    } else {
+      sti->restart_interval =
+          std::min<size_t>(sti->MCUs_per_row * cinfo->restart_in_rows, 65535u);
+    }
+    if (auto_restarts && sti->num_blocks >= kMinBlocksForAutoRestarts) {
+      size_t rows_per_restart = std::max<size_t>(
+          1, sti->MCU_rows_in_scan / kNumAutoRestartSegments);
+      sti->restart_interval =
+          std::min<size_t>(sti->MCUs_per_row * rows_per_restart, 65535u);
+    }
+    sti->num_restarts = sti->restart_interval > 0
+                            ? DivCeil(num_MCUs, sti->restart_interval)
+                            : 1;
+    sti->restarts = Allocate<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
+  }
+  m->num_contexts = 4 + num_ac_contexts;
+}
+
 void ProcessCompressionParams(j_compress_ptr cinfo) {
   if (cinfo->dest == nullptr) {
     JPEGLI_ERROR("Missing destination.");
@@ -331,87 +409,67 @@ void ProcessCompressionParams(j_compress_ptr cinfo) {
   if (cinfo->scan_info == nullptr) {
     SetDefaultScanScript(cinfo);
   }
-  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->scan_info->Ss != 0 ||
-                                        cinfo->scan_info->Se != DCTSIZE2 - 1);
-  ValidateScanScript(cinfo);
-  m->scan_token_info =
-      Allocate<ScanTokenInfo>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
-  memset(m->scan_token_info, 0, cinfo->num_scans * sizeof(ScanTokenInfo));
-  m->ac_ctx_offset = Allocate<uint8_t>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
-  size_t num_ac_contexts = 0;
-  for (int i = 0; i < cinfo->num_scans; ++i) {
-    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
-    m->ac_ctx_offset[i] = 4 + num_ac_contexts;
-    if (scan_info->Se > 0) {
-      num_ac_contexts += scan_info->comps_in_scan;
-    }
-    if (num_ac_contexts > 252) {
-      JPEGLI_ERROR("Too many AC scans in image");
-    }
-    ScanTokenInfo* sti = &m->scan_token_info[i];
-    if (scan_info->comps_in_scan == 1) {
-      int comp_idx = scan_info->component_index[0];
-      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-      sti->MCUs_per_row = comp->width_in_blocks;
-      sti->MCU_rows_in_scan = comp->height_in_blocks;
-      sti->blocks_in_MCU = 1;
-    } else {
-      sti->MCUs_per_row =
-          DivCeil(cinfo->image_width, DCTSIZE * cinfo->max_h_samp_factor);
-      sti->MCU_rows_in_scan =
-          DivCeil(cinfo->image_height, DCTSIZE * cinfo->max_v_samp_factor);
-      sti->blocks_in_MCU = 0;
-      for (int j = 0; j < scan_info->comps_in_scan; ++j) {
-        int comp_idx = scan_info->component_index[j];
-        jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-        sti->blocks_in_MCU += comp->h_samp_factor * comp->v_samp_factor;
-      }
-    }
-    size_t num_MCUs = sti->MCU_rows_in_scan * sti->MCUs_per_row;
-    sti->num_blocks = num_MCUs * sti->blocks_in_MCU;
-    if (cinfo->restart_in_rows <= 0) {
-      sti->restart_interval = cinfo->restart_interval;
-    } else {
-      sti->restart_interval =
-          std::min<size_t>(sti->MCUs_per_row * cinfo->restart_in_rows, 65535u);
-    }
-    sti->num_restarts = sti->restart_interval > 0
-                            ? DivCeil(num_MCUs, sti->restart_interval)
-                            : 1;
-    sti->restarts = Allocate<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
-  }
-  m->num_contexts = 4 + num_ac_contexts;
+  ProcessScanScript(cinfo);
 }
 
 bool IsStreamingSupported(j_compress_ptr cinfo) {
   if (cinfo->global_state == kEncWriteCoeffs) {
     return false;
   }
-  // TODO(szabadka) Remove this restriction.
-  if (cinfo->restart_interval > 0 || cinfo->restart_in_rows > 0) {
-    return false;
-  }
+  // The scans of a multi-scan image are coded one after the other over the
+  // whole image, so these can only be written in jpegli_finish_compress(),
+  // see also IsStreamingTokenizationSupported().
   if (cinfo->num_scans > 1) {
     return false;
   }
-  if (cinfo->master->psnr_target > 0) {
+  if (IsQuantSearchEnabled(cinfo)) {
     return false;
   }
   return true;
 }
 
+// Returns true if the scans of a multi-scan image are tokenized while the input
+// is read, in which case only the current iMCU row of the quantized
+// coefficients and the low bits of the coefficients of the AC refinement scans
+// are kept until jpegli_finish_compress().
+bool IsStreamingTokenizationSupported(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (cinfo->global_state == kEncWriteCoeffs || cinfo->num_scans <= 1) {
+    return false;
+  }
+  // The quantization search and the scan script optimization need all the
+  // coefficients of the image.
+  if (IsQuantSearchEnabled(cinfo)) {
+    return false;
+  }
+  if (m->optimize_scans && cinfo->progressive_mode &&
+      cinfo->scan_info == cinfo->script_space) {
+    return false;
+  }
+  return InitRefinementCoeffs(cinfo);
+}
+
+void AllocateTokenArrays(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  int ysize_blocks = DivCeil(cinfo->image_height, DCTSIZE);
+  int num_arrays = cinfo->num_scans * ysize_blocks;
+  m->token_arrays = Allocate<TokenArray>(cinfo, num_arrays, JPOOL_IMAGE);
+  m->cur_token_array = 0;
+  memset(m->token_arrays, 0, num_arrays * sizeof(TokenArray));
+  m->token_array_capacity = 0;
+  m->total_token_bytes = 0;
+}
+
 void AllocateBuffers(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   memset(m->last_dc_coeff, 0, sizeof(m->last_dc_coeff));
+  m->streaming_tokenization = IsStreamingTokenizationSupported(cinfo);
   if (!IsStreamingSupported(cinfo) || cinfo->optimize_coding) {
-    int ysize_blocks = DivCeil(cinfo->image_height, DCTSIZE);
-    int num_arrays = cinfo->num_scans * ysize_blocks;
-    m->token_arrays = Allocate<TokenArray>(cinfo, num_arrays, JPOOL_IMAGE);
-    m->cur_token_array = 0;
-    memset(m->token_arrays, 0, num_arrays * sizeof(TokenArray));
-    m->num_tokens = 0;
-    m->total_num_tokens = 0;
+    AllocateTokenArrays(cinfo);
   }
+  m->segment_buffer = nullptr;
+  m->segment_buffer_size = 0;
+  m->segment_writers = nullptr;
   if (cinfo->global_state == kEncWriteCoeffs) {
     return;
   }
@@ -448,18 +506,31 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   }
   m->dct_buffer = Allocate<float>(cinfo, 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
   m->block_tmp = Allocate<int32_t>(cinfo, DCTSIZE2 * 4, JPOOL_IMAGE_ALIGNED);
+  m->imcu_coeffs = nullptr;
+  m->imcu_dc = nullptr;
+  if (m->runner != nullptr) {
+    m->imcu_coeffs = Allocate<int32_t>(
+        cinfo, m->blocks_per_iMCU_row * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+    m->imcu_dc =
+        Allocate<float>(cinfo, 2 * m->blocks_per_iMCU_row, JPOOL_IMAGE_ALIGNED);
+  }
   if (!IsStreamingSupported(cinfo)) {
     m->coeff_buffers =
         Allocate<jvirt_barray_ptr>(cinfo, cinfo->num_components, JPOOL_IMAGE);
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
       const size_t xsize_blocks = comp->width_in_blocks;
-      const size_t ysize_blocks = comp->height_in_blocks;
+      const size_t ysize_blocks = m->streaming_tokenization
+                                      ? comp->v_samp_factor
+                                      : comp->height_in_blocks;
       m->coeff_buffers[c] = (*cinfo->mem->request_virt_barray)(
           reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE,
           /*pre_zero=*/FALSE, xsize_blocks, ysize_blocks, comp->v_samp_factor);
     }
   }
+  if (m->streaming_tokenization) {
+    InitStreamingTokenization(cinfo);
+  }
   if (m->use_adaptive_quantization) {
     int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
     jpeg_component_info* y_comp = &cinfo->comp_info[y_channel];
@@ -471,7 +542,7 @@ void AllocateBuffers(j_compress_ptr cinfo) {
     m->fuzzy_erosion_tmp.Allocate(cinfo, 2, xsize_padded);
     m->pre_erosion.Allocate(cinfo, 6 * cinfo->max_v_samp_factor, xsize_padded);
     size_t qf_height = cinfo->max_v_samp_factor;
-    if (m->psnr_target > 0) {
+    if (IsQuantSearchEnabled(cinfo)) {
       qf_height *= cinfo->total_iMCU_rows;
     }
     m->quant_field.Allocate(cinfo, qf_height, xsize_blocks);
@@ -516,8 +587,8 @@ void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
       ChooseColorTransform(cinfo);
       ChooseDownsampleMethods(cinfo);
     }
-    QuantPass pass = m->psnr_target > 0 ? QuantPass::SEARCH_FIRST_PASS
-                                        : QuantPass::NO_SEARCH;
+    QuantPass pass = IsQuantSearchEnabled(cinfo) ? QuantPass::SEARCH_FIRST_PASS
+                                                 : QuantPass::NO_SEARCH;
     InitQuantizer(cinfo, pass);
   }
   if (write_all_tables) {
@@ -528,6 +599,7 @@ void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
     InitEntropyCoder(cinfo);
   }
   (*cinfo->dest->init_destination)(cinfo);
+  m->output_bytes_written = 0;
   WriteFileHeader(cinfo);
   JpegBitWriterInit(cinfo);
   m->next_iMCU_row = 0;
@@ -607,6 +679,9 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
     }
   } else {
     ComputeCoefficientsForiMCURow(cinfo);
+    if (cinfo->master->streaming_tokenization) {
+      TokenizeiMCURow(cinfo);
+    }
   }
   ++cinfo->master->next_iMCU_row;
 }
@@ -693,6 +768,14 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
   cinfo->master->data_type = JPEGLI_TYPE_UINT8;
   cinfo->master->endianness = JPEGLI_NATIVE_ENDIAN;
   cinfo->master->coeff_buffers = nullptr;
+  cinfo->master->output_bytes_written = 0;
+  cinfo->master->runner = nullptr;
+  cinfo->master->runner_opaque = nullptr;
+  cinfo->master->auto_restart_interval = false;
+  cinfo->master->optimize_scans = false;
+  cinfo->master->greedy_histogram_clustering = false;
+  cinfo->master->streaming_tokenization = false;
+  cinfo->master->scan_tokenizer_state = nullptr;
 }
 
 void jpegli_set_xyb_mode(j_compress_ptr cinfo) {
@@ -852,11 +935,18 @@ void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
                      float min_distance, float max_distance) {
   CheckState(cinfo, jpegli::kEncStart);
   cinfo->master->psnr_target = psnr;
+  cinfo->master->target_size = 0;
   cinfo->master->psnr_tolerance = tolerance;
   cinfo->master->min_distance = min_distance;
   cinfo->master->max_distance = max_distance;
 }
 
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->target_size = target_size;
+  cinfo->master->psnr_target = 0.0f;
+}
+
 void jpegli_set_quality(j_compress_ptr cinfo, int quality,
                         boolean force_baseline) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -936,6 +1026,24 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level) {
   cinfo->master->progressive_level = level;
 }
 
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
+void jpegli_enable_auto_restart_interval(j_compress_ptr cinfo,
+                                         boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->auto_restart_interval = FROM_JXL_BOOL(value);
+}
+
+void jpegli_enable_optimize_scans(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->optimize_scans = FROM_JXL_BOOL(value);
+}
+
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -1236,6 +1344,16 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
 
   if (m->psnr_target > 0) {
     jpegli::QuantizetoPSNR(cinfo);
+  } else if (m->target_size > 0) {
+    jpegli::QuantizeToTargetSize(cinfo);
+  }
+
+  if (m->optimize_scans && cinfo->progressive_mode &&
+      cinfo->scan_info == cinfo->script_space) {
+    jpegli::OptimizeScanScript(cinfo);
+    jpegli::ProcessScanScript(cinfo);
+    jpegli::InitProgressMonitor(cinfo);
+    jpegli::AllocateTokenArrays(cinfo);
   }
 
   const bool tokens_done = jpegli::IsStreamingSupported(cinfo);
@@ -24,6 +24,7 @@
 #include <cstddef>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -42,6 +43,21 @@ void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile);
 void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
                      unsigned long* outsize /* NOLINT */);
 
+// Sets up a destination manager that writes the compressed data into a chain
+// of buffers without ever copying it, e.g. for passing it to writev(). The
+// num_buffers buffers of the application, if any, are filled first in order,
+// further buffers are added when these are full, the first of them sized from
+// the image dimensions if the application provided no buffers. Each image
+// started after this call produces a new chain, which starts again with the
+// application's buffers: *chain is set to a malloc()-ed array of
+// *chain_length buffers, all of which the application must free, except the
+// data of the first min(num_buffers, *chain_length) buffers, which is the
+// application's. After jpegli_finish_compress() the size of each buffer is the
+// number of bytes that were written to it.
+void jpegli_chain_dest(j_compress_ptr cinfo, const JpegliBuffer* buffers,
+                       size_t num_buffers, JpegliBuffer** chain,
+                       size_t* chain_length);
+
 void jpegli_set_defaults(j_compress_ptr cinfo);
 
 void jpegli_default_colorspace(j_compress_ptr cinfo);
@@ -126,6 +142,12 @@ float jpegli_quality_to_distance(int quality);
 void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
                      float min_distance, float max_distance);
 
+// Enables distance parameter search to meet the given target size in bytes of
+// the output. The size of the entropy coded data is estimated from the DCT
+// coefficients for each candidate distance, and the bitstream is written only
+// once, so the actual size may slightly differ from the target.
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size);
+
 // Changes the default behaviour of the encoder in the selection of quantization
 // matrices and chroma subsampling. Must be called before jpegli_set_defaults()
 // because some default setting depend on the XYB mode.
@@ -147,6 +169,11 @@ void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value);
 
 // Sets the default progression parameters, where level 0 is sequential, and
 // greater level value means more progression steps. Default is 2.
+// Multi-scan output is tokenized while the scanlines are processed and only
+// the low bits of the coefficients of the refinement scans are kept until
+// jpegli_finish_compress(), unless a quantization search or scan optimization
+// needs the quantized DCT coefficients of the whole image. Single-scan output
+// is written while the scanlines are processed.
 void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 
 // If this function is called before starting compression, the quality and
@@ -156,6 +183,27 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 // AC coefficients. Must be called before jpegli_set_defaults().
 void jpegli_use_standard_quant_tables(j_compress_ptr cinfo);
 
+// Sets the parallel runner that the encoder uses to compute the DCT
+// coefficients of the blocks of an iMCU row on multiple threads. The output is
+// identical to the output of the single-threaded encoder. Passing a NULL
+// runner disables multi-threading, which is the default.
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque);
+
+// Lets the encoder choose a restart interval if neither restart_interval nor
+// restart_in_rows is set and the image is encoded in more than one pass (e.g.
+// progressive mode). The restart segments are then entropy coded in parallel
+// on the parallel runner. Disabled by default.
+void jpegli_enable_auto_restart_interval(j_compress_ptr cinfo, boolean value);
+
+// Lets the encoder replace the default progressive scan script with the one
+// that gives the smallest estimated output size, chosen separately for each
+// component from a set of spectral selection and successive approximation
+// splits. The candidate scans are evaluated on the quantized coefficients on
+// the parallel runner. Has no effect in sequential mode or if scan_info is set
+// by the application. Disabled by default.
+void jpegli_enable_optimize_scans(j_compress_ptr cinfo, boolean value);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -5,18 +5,22 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ostream>
+#include <random>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include "lib/base/printf_macros.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/libjpeg_test_util.h"
 #include "lib/jpegli/test_params.h"
 #include "lib/jpegli/test_utils.h"
@@ -102,6 +106,89 @@ TEST(EncodeAPITest, ReuseCinfoSameImageTwice) {
             memcmp(compressed0.data(), compressed1.data(), compressed0.size()));
 }
 
+// Encodes the image to memory with or without the agglomerative clustering of
+// the Huffman histograms.
+void EncodeWithClustering(const TestImage& input, const CompressParams& jparams,
+                          bool greedy_only, std::vector<uint8_t>* compressed) {
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    cinfo.master->greedy_histogram_clustering = greedy_only;
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(input, jparams, &cinfo);
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  compressed->assign(buffer, buffer + buffer_size);
+  if (buffer) free(buffer);
+}
+
+// With more than four single-component AC scans, the AC Huffman tables have
+// to reuse the four slots. The merged clustering must still produce a valid
+// DHT order and must not be larger than the greedy clustering.
+TEST(EncodeAPITest, HistogramClusteringReusesSlots) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  GeneratePixels(&input);
+  // Progressive modes 12 and 13 are the test scan scripts with 18 AC scans.
+  for (int progr : {12, 13}) {
+    CompressParams jparams;
+    jparams.progressive_mode = progr;
+    std::vector<uint8_t> greedy;
+    std::vector<uint8_t> merged;
+    EncodeWithClustering(input, jparams, /*greedy_only=*/true, &greedy);
+    EncodeWithClustering(input, jparams, /*greedy_only=*/false, &merged);
+    printf("progr %d greedy %" PRIuS " bytes merged %" PRIuS " bytes\n", progr,
+           greedy.size(), merged.size());
+    EXPECT_LE(merged.size(), greedy.size());
+    DecompressParams dparams;
+    TestImage output0;
+    TestImage output1;
+    DecodeWithLibjpeg(jparams, dparams, greedy, &output0);
+    DecodeWithLibjpeg(jparams, dparams, merged, &output1);
+    ASSERT_EQ(output0.pixels.size(), output1.pixels.size());
+    EXPECT_EQ(0, memcmp(output0.pixels.data(), output1.pixels.data(),
+                        output0.pixels.size()));
+    VerifyOutputImage(input, output1, 2.4f);
+  }
+}
+
+// The optimized scan script has to decode to the same pixels as the default
+// progressive script and must not make the output larger.
+TEST(EncodeAPITest, OptimizeScansNoLargerThanDefaultScript) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  GeneratePixels(&input);
+  for (int num_threads : {0, 4}) {
+    CompressParams jparams;
+    jparams.progressive_mode = 2;
+    jparams.num_threads = num_threads;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+    jparams.optimize_scans = true;
+    std::vector<uint8_t> optimized;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &optimized));
+    printf("num_threads %d default %" PRIuS " bytes optimized %" PRIuS
+           " bytes\n",
+           num_threads, compressed.size(), optimized.size());
+    EXPECT_LE(optimized.size(), compressed.size());
+    DecompressParams dparams;
+    TestImage output0;
+    TestImage output1;
+    DecodeWithLibjpeg(jparams, dparams, compressed, &output0);
+    DecodeWithLibjpeg(jparams, dparams, optimized, &output1);
+    ASSERT_EQ(output0.pixels.size(), output1.pixels.size());
+    EXPECT_EQ(0, memcmp(output0.pixels.data(), output1.pixels.data(),
+                        output0.pixels.size()));
+  }
+}
+
 std::vector<TestConfig> GenerateBasicConfigs() {
   std::vector<TestConfig> all_configs;
   for (int samp : {1, 2}) {
@@ -124,6 +211,99 @@ std::vector<TestConfig> GenerateBasicConfigs() {
   return all_configs;
 }
 
+TEST(EncodeAPITest, ParallelRunnerBitExact) {
+  for (TestConfig config : GenerateBasicConfigs()) {
+    for (int r : {0, 1, 17}) {
+      config.jparams.use_adaptive_quantization = r != 1;
+      config.jparams.restart_interval = r;
+      config.jparams.num_threads = 0;
+      std::vector<uint8_t> compressed0;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+      config.jparams.num_threads = 4;
+      std::vector<uint8_t> compressed1;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed1));
+      ASSERT_EQ(compressed0.size(), compressed1.size());
+      EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                          compressed0.size()));
+    }
+  }
+}
+
+TEST(EncodeAPITest, ParallelTokenizationBitExact) {
+  TestImage input;
+  input.xsize = 263;
+  input.ysize = 145;
+  GeneratePixels(&input);
+  for (int progr = 1; progr < 3 + NumTestScanScripts(); ++progr) {
+    for (int r : {0, 7}) {
+      CompressParams jparams;
+      jparams.h_sampling = {2, 1, 1};
+      jparams.v_sampling = {2, 1, 1};
+      jparams.progressive_mode = progr;
+      jparams.restart_interval = r;
+      jparams.num_threads = 0;
+      std::vector<uint8_t> compressed0;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed0));
+      jparams.num_threads = 4;
+      std::vector<uint8_t> compressed1;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed1));
+      ASSERT_EQ(compressed0.size(), compressed1.size());
+      EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                          compressed0.size()));
+    }
+  }
+}
+
+TEST(EncodeAPITest, PSNRTarget) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  input.color_space = JCS_GRAYSCALE;
+  input.components = 1;
+  GeneratePixels(&input);
+  for (bool aq : {false, true}) {
+    for (float psnr_target : {32.0f, 38.0f, 44.0f}) {
+      CompressParams jparams;
+      jparams.use_adaptive_quantization = aq;
+      jparams.psnr_target = psnr_target;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+      DecompressParams dparams;
+      TestImage output;
+      DecodeWithLibjpeg(jparams, dparams, compressed, &output);
+      const double rms = DistanceRms(input, output);
+      const double psnr = 20.0 * std::log10(255.0 / rms);
+      printf("aq %d psnr target %.1f actual %.2f\n", aq, psnr_target, psnr);
+      EXPECT_NEAR(psnr, psnr_target, 1.0);
+    }
+  }
+}
+
+TEST(EncodeAPITest, TargetSize) {
+  TestImage input;
+  input.xsize = 512;
+  input.ysize = 512;
+  GeneratePixels(&input);
+  for (int progr : {0, 2}) {
+    for (size_t icc_size : {0, 5000}) {
+      for (size_t target_size : {10000, 30000, 60000}) {
+        CompressParams jparams;
+        jparams.progressive_mode = progr;
+        jparams.target_size = target_size;
+        jparams.icc.resize(icc_size, 0x55);
+        jparams.add_marker = icc_size > 0;
+        std::vector<uint8_t> compressed;
+        ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+        printf("progr %d icc size %" PRIuS " target size %" PRIuS
+               " actual %" PRIuS "\n",
+               progr, icc_size, target_size, compressed.size());
+        EXPECT_LE(compressed.size(), target_size);
+        EXPECT_GE(compressed.size(), target_size * 0.8);
+      }
+    }
+  }
+}
+
 TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   uint8_t* buffer = nullptr;
@@ -152,6 +332,75 @@ TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
   if (buffer) free(buffer);
 }
 
+TEST(EncodeAPITest, ChainDestMatchesMemDest) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  // Noise at maximum quality without chroma subsampling does not fit into the
+  // first buffer of the chain.
+  TestConfig noise_config;
+  noise_config.input.xsize = 256;
+  noise_config.input.ysize = 256;
+  noise_config.input.AllocatePixels();
+  std::mt19937 rng(17);
+  std::uniform_int_distribution<int> dist(0, 255);
+  for (uint8_t& v : noise_config.input.pixels) v = dist(rng);
+  noise_config.jparams.quality = 100;
+  noise_config.jparams.h_sampling = {1, 1, 1};
+  noise_config.jparams.v_sampling = {1, 1, 1};
+  for (int progr : {0, 2}) {
+    noise_config.jparams.progressive_mode = progr;
+    all_configs.push_back(noise_config);
+  }
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    const TestConfig& config = all_configs[i];
+    const bool is_noise = i + 2 >= all_configs.size();
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &expected));
+    // Without buffers of the application, and with two small ones that are
+    // filled before any buffer is allocated.
+    for (size_t num_app_buffers : {0, 2}) {
+      std::vector<std::vector<uint8_t>> app_data(num_app_buffers,
+                                                 std::vector<uint8_t>(1000));
+      std::vector<JpegliBuffer> app_buffers;
+      for (auto& data : app_data) {
+        app_buffers.push_back({data.data(), data.size()});
+      }
+      JpegliBuffer* chain = nullptr;
+      size_t chain_length = 0;
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_chain_dest(&cinfo, app_buffers.data(), app_buffers.size(),
+                          &chain, &chain_length);
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      if (is_noise) {
+        EXPECT_GT(chain_length, num_app_buffers + 1);
+      }
+      std::vector<uint8_t> compressed;
+      for (size_t j = 0; j < chain_length; ++j) {
+        compressed.insert(compressed.end(), chain[j].data,
+                          chain[j].data + chain[j].size);
+        if (j < num_app_buffers) {
+          EXPECT_EQ(app_data[j].data(), chain[j].data);
+          if (j + 1 < chain_length) {
+            EXPECT_EQ(app_data[j].size(), chain[j].size);
+          }
+        } else {
+          free(chain[j].data);
+        }
+      }
+      free(chain);
+      ASSERT_EQ(expected.size(), compressed.size());
+      EXPECT_EQ(0,
+                memcmp(expected.data(), compressed.data(), expected.size()));
+    }
+  }
+}
+
 TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
@@ -603,6 +852,28 @@ std::vector<TestConfig> GenerateTests() {
     config.max_dist = 2.2;
     all_tests.push_back(config);
   }
+  for (int num_threads : {0, 4}) {
+    for (int progr : {0, 2}) {
+      TestConfig config;
+      config.jparams.auto_restart_interval = true;
+      config.jparams.progressive_mode = progr;
+      config.jparams.num_threads = num_threads;
+      config.max_bpp = 1.6;
+      config.max_dist = 2.2;
+      all_tests.push_back(config);
+    }
+  }
+  for (int num_threads : {0, 4}) {
+    for (int progr : {1, 2}) {
+      TestConfig config;
+      config.jparams.optimize_scans = true;
+      config.jparams.progressive_mode = progr;
+      config.jparams.num_threads = num_threads;
+      config.max_bpp = 1.5;
+      config.max_dist = 2.2;
+      all_tests.push_back(config);
+    }
+  }
   for (int type : {0, 1, 10, 100, 10000}) {
     for (int scale : {1, 50, 100, 200, 500}) {
       for (bool add_raw : {false, true}) {
@@ -11,10 +11,19 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <vector>
 
+#include "lib/base/bits.h"
+#include "lib/base/printf_macros.h"
+#include "lib/base/types.h"
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
+#include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/quant.h"
 
@@ -138,6 +147,91 @@ void ReQuantizeCoeffs(j_compress_ptr cinfo) {
   }
 }
 
+// Returns the index of the first scan that codes the DC coefficients of
+// component c, or -1 if there is none.
+int FindDCScan(j_compress_ptr cinfo, int c) {
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
+    if (scan_info->Ss != 0 || scan_info->Ah != 0) continue;
+    for (int j = 0; j < scan_info->comps_in_scan; ++j) {
+      if (scan_info->component_index[j] == c) return i;
+    }
+  }
+  return -1;
+}
+
+// Requantizes all blocks with the current quantization matrices without
+// storing the result, and adds the DC symbols of the blocks to the
+// per-component DC histograms and their AC symbols to the AC scans of their
+// component. Returns the number of extra bits of the DC symbols.
+size_t ComputeSymbolHistograms(j_compress_ptr cinfo, Histogram* dc_histo,
+                               std::vector<ACScanSymbols>* ac_scans) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  HWY_ALIGN int16_t block[DCTSIZE2];
+  size_t extra_bits = 0;
+  std::vector<ACScanSymbols*> comp_scans;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const float* qmc = m->quant_mul[c];
+    const int h_factor = m->h_factor[c];
+    const int v_factor = m->v_factor[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    int* dc_count = dc_histo[c].count;
+    comp_scans.clear();
+    for (ACScanSymbols& scan : *ac_scans) {
+      if (scan.comp == c) comp_scans.push_back(&scan);
+    }
+    // The DC predictor is reset at the restart markers of the DC scan of the
+    // component.
+    size_t restart_interval = 0;
+    size_t MCUs_per_row = 0;
+    int mcu_width = 1;
+    int mcu_height = 1;
+    const int dc_scan = FindDCScan(cinfo, c);
+    if (dc_scan >= 0) {
+      const ScanTokenInfo& sti = m->scan_token_info[dc_scan];
+      restart_interval = sti.restart_interval;
+      MCUs_per_row = sti.MCUs_per_row;
+      if (cinfo->scan_info[dc_scan].comps_in_scan > 1) {
+        mcu_width = comp->h_samp_factor;
+        mcu_height = comp->v_samp_factor;
+      }
+    }
+    int last_dc = 0;
+    size_t last_restart_idx = 0;
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+      JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+        if (restart_interval > 0) {
+          const size_t mcu = (by / mcu_height) * MCUs_per_row + bx / mcu_width;
+          const size_t restart_idx = mcu / restart_interval;
+          if (restart_idx != last_restart_idx) {
+            last_dc = 0;
+            last_restart_idx = restart_idx;
+          }
+        }
+        memcpy(block, &blocks[0][bx][0], sizeof(block));
+        ReQuantizeBlock(block, qmc, qf[bx * h_factor], zero_bias_offset,
+                        zero_bias_mul);
+        const int diff = block[0] - last_dc;
+        last_dc = block[0];
+        int nbits = diff == 0 ? 0
+                              : jxl::FloorLog2Nonzero<uint32_t>(std::abs(diff)) +
+                                    1;
+        ++dc_count[nbits];
+        extra_bits += nbits;
+        for (ACScanSymbols* scan : comp_scans) {
+          scan->AddBlock(block);
+        }
+      }
+    }
+  }
+  return extra_bits;
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -148,6 +242,7 @@ namespace jpegli {
 namespace {
 HWY_EXPORT(ComputePSNR);
 HWY_EXPORT(ReQuantizeCoeffs);
+HWY_EXPORT(ComputeSymbolHistograms);
 
 void ReQuantizeCoeffs(j_compress_ptr cinfo) {
   HWY_DYNAMIC_DISPATCH(ReQuantizeCoeffs)(cinfo);
@@ -166,68 +261,504 @@ float Clamp(float val, float minval, float maxval) {
   return std::max(minval, std::min(maxval, val));
 }
 
+// Number of histogram bins for the absolute values of the coefficients. Small
+// values have their own bins, larger values are binned logarithmically with
+// 2^kLogBinBits bins per octave.
+constexpr uint32_t kNumExactBins = 1024;
+constexpr uint32_t kLogBinBits = 5;
+constexpr uint32_t kNumBins = kNumExactBins + (16 - 10) * (1 << kLogBinBits);
+// Number of adaptive quantization strength buckets per component.
+constexpr int kNumAQBuckets = 4;
+
+uint32_t HistogramBin(uint32_t v) {
+  if (v < kNumExactBins) return v;
+  const uint32_t log2 = jxl::FloorLog2Nonzero(v);
+  const uint32_t sub = (v >> (log2 - kLogBinBits)) & ((1 << kLogBinBits) - 1);
+  return kNumExactBins + ((log2 - 10) << kLogBinBits) + sub;
+}
+
+struct HistogramEntry {
+  float value;
+  uint32_t count;
+};
+
+// Histograms of the absolute values of the (first pass) coefficients for each
+// component, adaptive quantization bucket and coefficient index. From these we
+// can estimate the PSNR for any set of quantization matrices without
+// iterating over the coefficient image.
+struct CoeffHistograms {
+  // Non-empty bins, where the bins of histogram i are the entries in
+  // [begin[i], begin[i + 1]), and i = (c * kNumAQBuckets + b) * DCTSIZE2 + k.
+  std::vector<HistogramEntry> entries;
+  std::vector<size_t> begin;
+  // Average adaptive quantization strength of the blocks of each bucket.
+  float aq_strength[kMaxComponents][kNumAQBuckets];
+  size_t num_coeffs;
+};
+
+void ComputeCoeffHistograms(j_compress_ptr cinfo, CoeffHistograms* hist) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<uint32_t> counts(kNumAQBuckets * DCTSIZE2 * kNumBins);
+  std::vector<uint64_t> sums(counts.size());
+  hist->entries.clear();
+  hist->begin.assign(1, 0);
+  hist->num_coeffs = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const int h_factor = m->h_factor[c];
+    const int v_factor = m->v_factor[c];
+    float aq_min = std::numeric_limits<float>::max();
+    float aq_max = std::numeric_limits<float>::lowest();
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+        aq_min = std::min(aq_min, qf[bx * h_factor]);
+        aq_max = std::max(aq_max, qf[bx * h_factor]);
+      }
+    }
+    const float aq_scale =
+        aq_max > aq_min ? kNumAQBuckets / (aq_max - aq_min) : 0.0f;
+    double aq_sum[kNumAQBuckets] = {};
+    size_t aq_count[kNumAQBuckets] = {};
+    std::fill(counts.begin(), counts.end(), 0);
+    std::fill(sums.begin(), sums.end(), 0);
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+      JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+        const float aq = qf[bx * h_factor];
+        const int b = std::min<int>(kNumAQBuckets - 1, (aq - aq_min) * aq_scale);
+        aq_sum[b] += aq;
+        ++aq_count[b];
+        const JCOEF* block = &blocks[0][bx][0];
+        uint32_t* hcounts = &counts[b * DCTSIZE2 * kNumBins];
+        uint64_t* hsums = &sums[b * DCTSIZE2 * kNumBins];
+        for (int k = 0; k < DCTSIZE2; ++k) {
+          const uint32_t v = std::abs(static_cast<int32_t>(block[k]));
+          const uint32_t bin = k * kNumBins + HistogramBin(v);
+          ++hcounts[bin];
+          hsums[bin] += v;
+        }
+      }
+    }
+    hist->num_coeffs += comp->height_in_blocks * comp->width_in_blocks *
+                        static_cast<size_t>(DCTSIZE2);
+    for (int b = 0; b < kNumAQBuckets; ++b) {
+      hist->aq_strength[c][b] = aq_count[b] > 0 ? aq_sum[b] / aq_count[b] : 0;
+      for (int k = 0; k < DCTSIZE2; ++k) {
+        const size_t offset = (b * DCTSIZE2 + k) * kNumBins;
+        for (uint32_t bin = 0; bin < kNumBins; ++bin) {
+          const uint32_t count = counts[offset + bin];
+          if (count == 0) continue;
+          const float value =
+              bin < kNumExactBins
+                  ? bin
+                  : static_cast<float>(static_cast<double>(sums[offset + bin]) /
+                                       count);
+          hist->entries.push_back({value, count});
+        }
+        hist->begin.push_back(hist->entries.size());
+      }
+    }
+  }
+}
+
+// Returns the PSNR estimated from the coefficient histograms for the current
+// quantization tables.
+float HistogramPSNR(j_compress_ptr cinfo, const CoeffHistograms& hist) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  double error = 0.0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const float* qmc = m->quant_mul[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    for (int b = 0; b < kNumAQBuckets; ++b) {
+      const float aq_strength = hist.aq_strength[c][b];
+      for (int k = 0; k < DCTSIZE2; ++k) {
+        const size_t i = (c * kNumAQBuckets + b) * DCTSIZE2 + k;
+        const float q = qmc[k];
+        const float invq = 1.0f / q;
+        const float threshold =
+            zero_bias_offset[k] + zero_bias_mul[k] * aq_strength;
+        double err = 0.0;
+        for (size_t j = hist.begin[i]; j < hist.begin[i + 1]; ++j) {
+          const HistogramEntry& e = hist.entries[j];
+          const float qval = e.value * q;
+          const float iqval = qval >= threshold ? std::round(qval) : 0.0f;
+          const float diff = (e.value - iqval * invq) * (1.0f / 16);
+          err += e.count * static_cast<double>(diff * diff);
+        }
+        error += err;
+      }
+    }
+  }
+  return 4.3429448f * log(hist.num_coeffs / (error / 255. / 255.));
+}
+
 #define PSNR_SEARCH_DBG 0
 
-float FindDistanceForPSNR(j_compress_ptr cinfo) {
+// Searches for the distance whose PSNR, as computed by compute_psnr(), is
+// closest to psnr_target, starting from distance d.
+template <typename PSNRFunc>
+float SearchDistance(j_compress_ptr cinfo, float d, float psnr_target,
+                     const PSNRFunc& compute_psnr) {
   constexpr int kMaxIters = 20;
+  // The tolerance is relative to the requested PSNR, also when searching for
+  // a corrected target of the histogram estimate.
+  const float tolerance =
+      cinfo->master->psnr_tolerance * cinfo->master->psnr_target;
+  const float min_dist = cinfo->master->min_distance;
+  const float max_dist = cinfo->master->max_distance;
+  float best_diff = std::numeric_limits<float>::max();
+  float best_distance = 0.0f;
+  float best_psnr = 0.0;
+  float dmin = min_dist;
+  float dmax = max_dist;
+  bool found_lower_bound = false;
+  bool found_upper_bound = false;
+  for (int i = 0; i < kMaxIters; ++i) {
+    UpdateDistance(cinfo, d);
+    float psnr = compute_psnr();
+    if (psnr > psnr_target) {
+      dmin = d;
+      found_lower_bound = true;
+    } else {
+      dmax = d;
+      found_upper_bound = true;
+    }
+#if (PSNR_SEARCH_DBG > 1)
+    printf("iter %2d d %7.4f psnr %.2f", i, d, psnr);
+    if (found_upper_bound && found_lower_bound) {
+      printf("    d-interval: [ %7.4f .. %7.4f ]", dmin, dmax);
+    }
+    printf("\n");
+#endif
+    float diff = std::abs(psnr - psnr_target);
+    if (diff < best_diff) {
+      best_diff = diff;
+      best_distance = d;
+      best_psnr = psnr;
+    }
+    if (diff < tolerance || dmin == dmax) {
+      break;
+    }
+    if (!found_lower_bound || !found_upper_bound) {
+      d *= std::exp(0.15f * (psnr - psnr_target));
+    } else {
+      d = 0.5f * (dmin + dmax);
+    }
+    d = Clamp(d, min_dist, max_dist);
+  }
+  if (PSNR_SEARCH_DBG) {
+    printf("Final PSNR %.2f at distance %.4f\n", best_psnr, best_distance);
+  } else {
+    (void)best_psnr;
+  }
+  return best_distance;
+}
+
+float FindDistanceForPSNR(j_compress_ptr cinfo) {
+  // Maximum number of passes over the coefficient image to compute the exact
+  // PSNR.
+  constexpr int kMaxExactPasses = 3;
   const float psnr_target = cinfo->master->psnr_target;
-  const float tolerance = cinfo->master->psnr_tolerance;
+  const float tolerance = cinfo->master->psnr_tolerance * psnr_target;
   const float min_dist = cinfo->master->min_distance;
   const float max_dist = cinfo->master->max_distance;
   float d = Clamp(1.0f, min_dist, max_dist);
-  for (int sampling : {4, 1}) {
-    float best_diff = std::numeric_limits<float>::max();
-    float best_distance = 0.0f;
-    float best_psnr = 0.0;
-    float dmin = min_dist;
-    float dmax = max_dist;
-    bool found_lower_bound = false;
-    bool found_upper_bound = false;
-    for (int i = 0; i < kMaxIters; ++i) {
-      UpdateDistance(cinfo, d);
-      float psnr = ComputePSNR(cinfo, sampling);
-      if (psnr > psnr_target) {
-        dmin = d;
-        found_lower_bound = true;
-      } else {
-        dmax = d;
-        found_upper_bound = true;
-      }
+  // The search is done on the estimate from the histograms, and the exact PSNR
+  // is only computed for its result. If that is not within tolerance, the
+  // target of the histogram search is corrected by the error of the estimate
+  // at that distance.
+  CoeffHistograms hist;
+  ComputeCoeffHistograms(cinfo, &hist);
+  const auto histogram_psnr = [&]() { return HistogramPSNR(cinfo, hist); };
+  float hist_target = psnr_target;
+  float best_diff = std::numeric_limits<float>::max();
+  float best_distance = d;
+  for (int i = 0; i < kMaxExactPasses; ++i) {
+    d = SearchDistance(cinfo, d, hist_target, histogram_psnr);
+    UpdateDistance(cinfo, d);
+    const float psnr = ComputePSNR(cinfo, 1);
+    const float diff = std::abs(psnr - psnr_target);
+    if (PSNR_SEARCH_DBG) {
+      printf("exact pass %d d %7.4f psnr %.2f\n", i, d, psnr);
+    }
+    if (diff < best_diff) {
+      best_diff = diff;
+      best_distance = d;
+    }
+    if (diff < tolerance) break;
+    hist_target = psnr_target - (psnr - histogram_psnr());
+  }
+  return best_distance;
+}
+
+// Returns the estimated size in bytes of the JPEG file with the current
+// quantization matrices.
+size_t EstimateJpegSize(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t nc = cinfo->num_components;
+  // The AC symbols are collected separately for each AC scan of the scan
+  // script, so that the EOB runs, the successive approximation and the
+  // Huffman code of each progressive scan are accounted for.
+  std::vector<ACScanSymbols> ac_scans;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
+    if (scan_info->Se == 0) continue;
+    for (int j = 0; j < scan_info->comps_in_scan; ++j) {
+      ac_scans.emplace_back(scan_info->component_index[j],
+                            std::max(scan_info->Ss, 1), scan_info->Se,
+                            scan_info->Ah, scan_info->Al,
+                            FROM_JXL_BOOL(cinfo->progressive_mode));
+    }
+  }
+  Histogram dc_histo[kMaxComponents];
+  size_t bits =
+      HWY_DYNAMIC_DISPATCH(ComputeSymbolHistograms)(cinfo, dc_histo, &ac_scans);
+  for (size_t c = 0; c < nc; ++c) {
+    bits += static_cast<size_t>(HistogramCost(dc_histo[c]));
+  }
+  for (ACScanSymbols& scan : ac_scans) {
+    bits += static_cast<size_t>(scan.Cost());
+  }
+  // Add an estimate of the byte stuffing after 0xff bytes.
+  size_t num_bytes = DivCeil(bits, 8);
+  num_bytes += num_bytes / 256;
+  // The SOI and APPn markers and any marker written by the application before
+  // jpegli_finish_compress() are already in the output.
+  num_bytes += m->output_bytes_written;
+  // DQT, SOF and EOI marker segments.
+  bool send_table[NUM_QUANT_TBLS] = {};
+  for (size_t c = 0; c < nc; ++c) {
+    send_table[cinfo->comp_info[c].quant_tbl_no] = true;
+  }
+  num_bytes += 4;
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    const JQUANT_TBL* table = cinfo->quant_tbl_ptrs[i];
+    if (!send_table[i] || table == nullptr || table->sent_table) continue;
+    size_t precision = 0;
+    for (UINT16 q : table->quantval) {
+      if (q > 255) precision = 1;
+    }
+    num_bytes += 1 + (1 + precision) * DCTSIZE2;
+  }
+  num_bytes += 10 + 3 * nc + 2;
+  // SOS, DRI, DHT headers and restart markers of each scan. The DHT segment
+  // data is already included in the histogram costs.
+  size_t last_restart_interval = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    num_bytes += 8 + 2 * scan_info->comps_in_scan + 4;
+    if (sti.restart_interval != last_restart_interval) {
+      num_bytes += 6;
+      last_restart_interval = sti.restart_interval;
+    }
+    if (sti.num_restarts > 1) {
+      // Restart marker and padding bits of the previous segment.
+      num_bytes += 3 * (sti.num_restarts - 1);
+    }
+  }
+  return num_bytes;
+}
+
+float FindDistanceForTargetSize(j_compress_ptr cinfo) {
+  constexpr int kMaxIters = 20;
+  const size_t target_size = cinfo->master->target_size;
+  const float min_dist = cinfo->master->min_distance;
+  const float max_dist = cinfo->master->max_distance;
+  float d = Clamp(1.0f, min_dist, max_dist);
+  float dmin = min_dist;
+  float dmax = max_dist;
+  bool found_lower_bound = false;
+  bool found_upper_bound = false;
+  // Smallest distance found so far where the output is not larger than the
+  // target size.
+  float best_distance = max_dist;
+  for (int i = 0; i < kMaxIters; ++i) {
+    UpdateDistance(cinfo, d);
+    size_t size = EstimateJpegSize(cinfo);
+    float rel_error = size * 1.0f / target_size;
 #if (PSNR_SEARCH_DBG > 1)
-      printf("sampling %d iter %2d d %7.4f psnr %.2f", sampling, i, d, psnr);
-      if (found_upper_bound && found_lower_bound) {
-        printf("    d-interval: [ %7.4f .. %7.4f ]", dmin, dmax);
-      }
-      printf("\n");
+    printf("iter %2d d %7.4f size %" PRIuS "\n", i, d, size);
 #endif
-      float diff = std::abs(psnr - psnr_target);
-      if (diff < best_diff) {
-        best_diff = diff;
-        best_distance = d;
-        best_psnr = psnr;
-      }
-      if (diff < tolerance * psnr_target || dmin == dmax) {
-        break;
-      }
-      if (!found_lower_bound || !found_upper_bound) {
-        d *= std::exp(0.15f * (psnr - psnr_target));
-      } else {
-        d = 0.5f * (dmin + dmax);
-      }
-      d = Clamp(d, min_dist, max_dist);
+    if (size <= target_size) {
+      best_distance = std::min(best_distance, d);
+      dmax = d;
+      found_upper_bound = true;
+      if (rel_error > 0.998f) break;
+    } else {
+      dmin = d;
+      found_lower_bound = true;
     }
-    d = best_distance;
-    if (sampling == 1 && PSNR_SEARCH_DBG) {
-      printf("Final PSNR %.2f at distance %.4f\n", best_psnr, d);
+    if (dmin == dmax) {
+      break;
+    }
+    if (!found_lower_bound || !found_upper_bound) {
+      d *= std::pow(rel_error, 1.5f);
     } else {
-      (void)best_psnr;
+      d = 0.5f * (dmin + dmax);
+    }
+    d = Clamp(d, min_dist, max_dist);
+  }
+  return best_distance;
+}
+
+// Parameters of one AC scan of a single component that is evaluated by the
+// scan script search. Refinement scans have Ah = Al + 1.
+struct ScanCandidate {
+  int comp;
+  int Ss;
+  int Se;
+  int Ah;
+  int Al;
+};
+
+// The low frequency band of the candidate scan scripts is 1..split, where
+// split = 0 means that there is no separate low frequency band.
+constexpr int kScanSplits[] = {0, 2, 5, 8};
+// The high frequency band of the candidate scan scripts is first coded with
+// Al = 0..kMaxScanAl, followed by refinement scans down to Al = 0.
+constexpr int kMaxScanAl = 2;
+// Size of the SOS marker segment of a single component scan and of the header
+// of the DHT marker segment that usually precedes it.
+constexpr float kScanOverheadBits = 8 * (10 + 4);
+
+// Returns the estimated number of bits of the AC scan, computed from the
+// histogram of the symbols of the scan without emitting any tokens.
+float EstimateScanBits(j_compress_ptr cinfo, const ScanCandidate& scan) {
+  const jpeg_component_info* comp = &cinfo->comp_info[scan.comp];
+  ACScanSymbols symbols(scan.comp, scan.Ss, scan.Se, scan.Ah, scan.Al,
+                        /*eob_runs=*/true);
+  for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+    JBLOCKARRAY blocks = GetBlockRow(cinfo, scan.comp, by);
+    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+      symbols.AddBlock(&blocks[0][bx][0]);
+    }
+  }
+  return symbols.Cost() + kScanOverheadBits;
+}
+
+// Returns the candidate scans of the component, the low frequency bands first,
+// then for each split the first and refinement scans of the high frequency
+// band, in the order that is used by CandidateScanIndex().
+std::vector<ScanCandidate> CandidateScans(int comp) {
+  std::vector<ScanCandidate> scans;
+  for (int split : kScanSplits) {
+    if (split > 0) scans.push_back({comp, 1, split, 0, 0});
+  }
+  for (int split : kScanSplits) {
+    for (int Al = 0; Al <= kMaxScanAl; ++Al) {
+      scans.push_back({comp, split + 1, DCTSIZE2 - 1, 0, Al});
+    }
+    for (int Al = 0; Al < kMaxScanAl; ++Al) {
+      scans.push_back({comp, split + 1, DCTSIZE2 - 1, Al + 1, Al});
     }
   }
-  return d;
+  return scans;
+}
+
+constexpr size_t kNumSplits = sizeof(kScanSplits) / sizeof(kScanSplits[0]);
+constexpr size_t kNumLowBands = kNumSplits - 1;
+constexpr size_t kScansPerHighBand = 2 * kMaxScanAl + 1;
+constexpr size_t kCandidateScansPerComponent =
+    kNumLowBands + kNumSplits * kScansPerHighBand;
+
+// Index of the first (Ah = 0) or refinement (Ah = Al + 1) scan of the high
+// frequency band for the split_idx-th split among the candidate scans of a
+// component.
+size_t CandidateScanIndex(size_t split_idx, int Ah, int Al) {
+  size_t offset = kNumLowBands + split_idx * kScansPerHighBand;
+  return offset + (Ah == 0 ? Al : kMaxScanAl + 1 + Al);
 }
 
 }  // namespace
 
+void OptimizeScanScript(j_compress_ptr cinfo) {
+  const int num_comps = cinfo->num_components;
+  std::vector<ScanCandidate> scans;
+  for (int c = 0; c < num_comps; ++c) {
+    std::vector<ScanCandidate> comp_scans = CandidateScans(c);
+    JPEGLI_CHECK(comp_scans.size() == kCandidateScansPerComponent);
+    scans.insert(scans.end(), comp_scans.begin(), comp_scans.end());
+  }
+  std::vector<float> bits(scans.size());
+  const auto estimate_scan = [&](uint32_t task, size_t /* thread */) {
+    bits[task] = EstimateScanBits(cinfo, scans[task]);
+  };
+  RunParallel(cinfo, scans.size(), estimate_scan, "EstimateScanBits");
+
+  // Choose the split and the successive approximation of each component
+  // independently, since the AC scans are not interleaved.
+  int best_split[kMaxComponents];
+  int best_Al[kMaxComponents];
+  for (int c = 0; c < num_comps; ++c) {
+    const float* comp_bits = &bits[c * kCandidateScansPerComponent];
+    float best_bits = std::numeric_limits<float>::max();
+    for (size_t i = 0; i < kNumSplits; ++i) {
+      const float low_bits = i > 0 ? comp_bits[i - 1] : 0.0f;
+      for (int Al = 0; Al <= kMaxScanAl; ++Al) {
+        float total = low_bits + comp_bits[CandidateScanIndex(i, 0, Al)];
+        for (int al = 0; al < Al; ++al) {
+          total += comp_bits[CandidateScanIndex(i, al + 1, al)];
+        }
+        if (total < best_bits) {
+          best_bits = total;
+          best_split[c] = kScanSplits[i];
+          best_Al[c] = Al;
+        }
+      }
+    }
+  }
+
+  // The DC scans of the current script are kept, followed by the low frequency
+  // bands, the first scans of the high frequency bands and the refinement
+  // scans of each successive approximation bit.
+  std::vector<jpeg_scan_info> script;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    if (cinfo->scan_info[i].Ss == 0) script.push_back(cinfo->scan_info[i]);
+  }
+  const auto add_scan = [&](int c, int Ss, int Se, int Ah, int Al) {
+    jpeg_scan_info si = {};
+    si.comps_in_scan = 1;
+    si.component_index[0] = c;
+    si.Ss = Ss;
+    si.Se = Se;
+    si.Ah = Ah;
+    si.Al = Al;
+    script.push_back(si);
+  };
+  for (int c = 0; c < num_comps; ++c) {
+    if (best_split[c] > 0) add_scan(c, 1, best_split[c], 0, 0);
+  }
+  for (int c = 0; c < num_comps; ++c) {
+    add_scan(c, best_split[c] + 1, DCTSIZE2 - 1, 0, best_Al[c]);
+  }
+  for (int Al = kMaxScanAl - 1; Al >= 0; --Al) {
+    for (int c = 0; c < num_comps; ++c) {
+      if (best_Al[c] > Al) {
+        add_scan(c, best_split[c] + 1, DCTSIZE2 - 1, Al + 1, Al);
+      }
+    }
+  }
+
+  cinfo->script_space_size = script.size();
+  cinfo->script_space =
+      Allocate<jpeg_scan_info>(cinfo, cinfo->script_space_size);
+  memcpy(cinfo->script_space, script.data(),
+         script.size() * sizeof(jpeg_scan_info));
+  cinfo->scan_info = cinfo->script_space;
+  cinfo->num_scans = cinfo->script_space_size;
+}
+
+void QuantizeToTargetSize(j_compress_ptr cinfo) {
+  float distance = FindDistanceForTargetSize(cinfo);
+  UpdateDistance(cinfo, distance);
+  ReQuantizeCoeffs(cinfo);
+}
+
 void QuantizetoPSNR(j_compress_ptr cinfo) {
   float distance = FindDistanceForPSNR(cinfo);
   UpdateDistance(cinfo, distance);
@@ -13,6 +13,12 @@ namespace jpegli {
 
 void QuantizetoPSNR(j_compress_ptr cinfo);
 
+void QuantizeToTargetSize(j_compress_ptr cinfo);
+
+// Replaces the default progressive scan script with the one that has the
+// smallest estimated coded size for the current quantized coefficients.
+void OptimizeScanScript(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_ENCODE_FINISH_H_
@@ -10,6 +10,8 @@
 #include <cstddef>
 #include <cstdint>
 
+#include "lib/base/compiler_specific.h"
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/bit_writer.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
@@ -30,16 +32,75 @@ struct HuffmanCodeTable {
   int code[256];
 };
 
+// Number of extra bits after the Huffman code of each symbol. This is the low
+// 4 bits of the symbol, except for the EOBn symbols of progressive AC scans.
+constexpr uint8_t kNumExtraBits[256] = {
+    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    1,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    2,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    3,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    4,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    5,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    6,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    7,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    8,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    9,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    10, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    11, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    12, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    13, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    14, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+};
+
+// Tokens are stored in a packed byte stream: the context and the symbol of
+// each token are followed by its extra bits in 0, 1 or 2 bytes, depending on
+// the number of extra bits of the symbol.
+constexpr size_t kMaxTokenSize = 4;
+
 struct Token {
   uint8_t context;
   uint8_t symbol;
   uint16_t bits;
-  Token(int c, int s, int b) : context(c), symbol(s), bits(b) {}
 };
 
+// Appends a token to the token stream at *pos. Always writes kMaxTokenSize
+// bytes, so the caller must make sure that there is space for a full-size
+// token.
+static JXL_INLINE void EmitToken(int context, int symbol, int bits,
+                                 uint8_t** pos) {
+  uint8_t* p = *pos;
+  p[0] = static_cast<uint8_t>(context);
+  p[1] = static_cast<uint8_t>(symbol);
+  p[2] = static_cast<uint8_t>(bits & 0xFF);
+  p[3] = static_cast<uint8_t>((bits >> 8) & 0xFF);
+  *pos = p + 2 + ((kNumExtraBits[symbol] + 7) >> 3);
+}
+
+// Reads the token at *pos and advances *pos to the next token.
+static JXL_INLINE Token ReadToken(const uint8_t** pos) {
+  const uint8_t* p = *pos;
+  Token t;
+  t.context = p[0];
+  t.symbol = p[1];
+  int nbits = kNumExtraBits[t.symbol];
+  if (nbits == 0) {
+    t.bits = 0;
+    *pos = p + 2;
+  } else if (nbits <= 8) {
+    t.bits = p[2];
+    *pos = p + 3;
+  } else {
+    t.bits = static_cast<uint16_t>(p[2] | (p[3] << 8));
+    *pos = p + 4;
+  }
+  return t;
+}
+
 struct TokenArray {
-  Token* tokens;
-  size_t num_tokens;
+  uint8_t* tokens;
+  // Size of the packed token stream in bytes.
+  size_t size;
 };
 
 struct RefToken {
@@ -47,9 +108,13 @@ struct RefToken {
   uint8_t refbits;
 };
 
+// For AC refinement scans, token_offset, tokens_size and restarts are indexes
+// into the RefToken array, for DC refinement scans they are block indexes,
+// otherwise they are byte offsets into the concatenated packed token stream of
+// the token arrays.
 struct ScanTokenInfo {
   RefToken* tokens;
-  size_t num_tokens;
+  size_t tokens_size;
   uint8_t* refbits;
   uint16_t* eobruns;
   size_t* restarts;
@@ -64,6 +129,46 @@ struct ScanTokenInfo {
   size_t num_blocks;
 };
 
+// State of the tokenization of a scan between block rows or MCU rows.
+struct ScanTokenizerState {
+  int restarts_to_go;
+  size_t restart_idx;
+  size_t block_idx;
+  int eob_run;
+  coeff_t last_dc_coeff[MAX_COMPS_IN_SCAN];
+  // The following fields are only used when the scan is tokenized while the
+  // input is read. The tokens of the scan are then in its own range of token
+  // arrays, starting at first_token_array, and the offsets of the scan are
+  // relative to the start of its tokens until jpegli_finish_compress().
+  size_t first_token_array;
+  size_t cur_token_array;
+  uint8_t* next_token;
+  size_t token_array_capacity;
+  size_t total_token_bytes;
+  // Number of nonzero coefficients of the scan for each coefficient index.
+  size_t coeff_nonzeros[DCTSIZE2];
+};
+
+// The coefficients Ss..Se of the blocks of a component that are needed by its
+// AC refinement scans when the other scans are tokenized while the input is
+// read. Each coefficient is stored in one signed byte, with the bits above the
+// refinement bits replaced by a single bit that tells if the coefficient was
+// nonzero in its first scan, which is all the refinement scans need.
+struct RefinementCoeffs {
+  // One row per block row, nullptr if the component has no AC refinement
+  // scans.
+  jvirt_sarray_ptr buffer;
+  int Ss;
+  int Se;
+  // The Al of the first scan of each coefficient, 0 for coefficients without
+  // refinement scans.
+  int Al[DCTSIZE2];
+};
+
+// Maximum Al of the first scan of a coefficient with refinement scans for
+// which the refinement bits fit into a RefinementCoeffs byte.
+constexpr int kMaxRefinementCoeffsAl = 6;
+
 }  // namespace jpegli
 
 struct jpeg_comp_master {
@@ -123,21 +228,53 @@ struct jpeg_comp_master {
   size_t next_iMCU_row;
   size_t next_dht_index;
   size_t last_restart_interval;
+  // Number of bytes written with WriteOutput() since jpegli_start_compress().
+  size_t output_bytes_written;
   JCOEF last_dc_coeff[MAX_COMPS_IN_SCAN];
   jpegli::JpegBitWriter bw;
   float* dct_buffer;
   int32_t* block_tmp;
   jpegli::TokenArray* token_arrays;
   size_t cur_token_array;
-  jpegli::Token* next_token;
-  size_t num_tokens;
-  size_t total_num_tokens;
+  uint8_t* next_token;
+  // Capacity of the current token array and total size of the previous token
+  // arrays, in bytes.
+  size_t token_array_capacity;
+  size_t total_token_bytes;
   jpegli::RefToken* next_refinement_token;
   uint8_t* next_refinement_bit;
   float psnr_target;
   float psnr_tolerance;
+  size_t target_size;
   float min_distance;
   float max_distance;
+  JxlParallelRunner runner;
+  void* runner_opaque;
+  // Quantized coefficients of the blocks of the current iMCU row, ordered by
+  // component, block row and block column, computed on the parallel runner.
+  // The DC coefficients are not final yet, imcu_dc contains the unrounded DC
+  // value and its zero-bias threshold for each block.
+  int32_t* imcu_coeffs;
+  float* imcu_dc;
+  bool auto_restart_interval;
+  // Output buffer and bit writers of the restart segments that are entropy
+  // coded in parallel, allocated on first use.
+  uint8_t* segment_buffer;
+  size_t segment_buffer_size;
+  jpegli::JpegBitWriter* segment_writers;
+  // Whether the default progressive scan script is replaced by the one with
+  // the smallest estimated size before the coefficients are tokenized.
+  bool optimize_scans;
+  // If true, the Huffman histograms are only clustered greedily. Only changed
+  // by tests.
+  bool greedy_histogram_clustering;
+  // If true, the coefficients of a multi-scan image are only buffered for one
+  // iMCU row, and all scans other than the AC refinement scans are tokenized
+  // while the input is read.
+  bool streaming_tokenization;
+  // Array of cinfo->num_scans tokenizer states for streaming tokenization.
+  jpegli::ScanTokenizerState* scan_tokenizer_state;
+  jpegli::RefinementCoeffs refinement_coeffs[jpegli::kMaxComponents];
 };
 
 #endif  // LIB_JPEGLI_ENCODE_INTERNAL_H_
@@ -19,6 +19,7 @@
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/quant.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/encode_streaming.cc"
@@ -106,6 +107,66 @@ void ZigZagShuffle(int32_t* JXL_RESTRICT block) {
   tmp[63] = block[63];
   memcpy(block, tmp, DCTSIZE2 * sizeof(tmp[0]));
 }
+
+// Number of consecutive blocks of a block row that are transformed in one task
+// of the parallel runner.
+constexpr size_t kBlocksPerTask = 64;
+
+// Computes the DCT and quantizes the blocks of the current iMCU row on the
+// parallel runner and stores the results in m->imcu_coeffs and m->imcu_dc.
+// Block (bx, iy) of component c is stored at index
+// block_offset[c] + iy * xsize_mcus * h_samp_factor + bx.
+void ComputeiMCURowInParallel(j_compress_ptr cinfo, const size_t* block_offset,
+                              int xsize_mcus) {
+  jpeg_comp_master* m = cinfo->master;
+  const int mcu_y = m->next_iMCU_row;
+  const bool adaptive_quant =
+      m->use_adaptive_quantization && !IsQuantSearchEnabled(cinfo);
+  size_t num_tasks = 0;
+  size_t tasks_per_row[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    tasks_per_row[c] = DivCeil(comp->width_in_blocks, kBlocksPerTask);
+    num_tasks += tasks_per_row[c] * comp->v_samp_factor;
+  }
+  const auto process_task = [&](const uint32_t task, size_t /*thread*/) {
+    int c = 0;
+    size_t task_idx = task;
+    while (task_idx >= tasks_per_row[c] * cinfo->comp_info[c].v_samp_factor) {
+      task_idx -= tasks_per_row[c] * cinfo->comp_info[c].v_samp_factor;
+      ++c;
+    }
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const int iy = task_idx / tasks_per_row[c];
+    const size_t by = mcu_y * comp->v_samp_factor + iy;
+    if (by >= comp->height_in_blocks) return;
+    const size_t bx0 = (task_idx % tasks_per_row[c]) * kBlocksPerTask;
+    const size_t bx1 = std::min<size_t>(bx0 + kBlocksPerTask,
+                                        comp->width_in_blocks);
+    const float* qmc = m->quant_mul[c];
+    const size_t stride = m->raw_data[c]->stride();
+    const float* imcu_start =
+        m->raw_data[c]->Row(mcu_y * comp->v_samp_factor * DCTSIZE);
+    const float* qf = adaptive_quant ? m->quant_field.Row(0) : nullptr;
+    const size_t qf_stride = m->quant_field.stride();
+    const size_t row_offset =
+        block_offset[c] + iy * xsize_mcus * comp->h_samp_factor;
+    HWY_ALIGN float dct_buffer[2 * DCTSIZE2];
+    float aq_strength = 0.0f;
+    for (size_t bx = bx0; bx < bx1; ++bx) {
+      if (adaptive_quant) {
+        aq_strength = qf[iy * qf_stride + bx * m->h_factor[c]];
+      }
+      const size_t idx = row_offset + bx;
+      const float* pixels = imcu_start + (iy * stride + bx) * DCTSIZE;
+      ComputeCoefficientBlockAC(pixels, stride, qmc, aq_strength,
+                                m->zero_bias_offset[c], m->zero_bias_mul[c],
+                                dct_buffer, &m->imcu_coeffs[idx * DCTSIZE2],
+                                &m->imcu_dc[2 * idx], &m->imcu_dc[2 * idx + 1]);
+    }
+  };
+  RunParallel(cinfo, num_tasks, process_task, "ComputeiMCURowInParallel");
+}
 }  // namespace
 
 template <int kMode>
@@ -119,7 +180,8 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   int32_t* symbols = m->block_tmp + DCTSIZE2;
   int32_t* nonzero_idx = m->block_tmp + 3 * DCTSIZE2;
   coeff_t* JXL_RESTRICT last_dc_coeff = m->last_dc_coeff;
-  bool adaptive_quant = m->use_adaptive_quantization && m->psnr_target == 0;
+  bool adaptive_quant =
+      m->use_adaptive_quantization && !IsQuantSearchEnabled(cinfo);
   JBLOCKARRAY blocks[kMaxComponents];
   if (kMode == kStreamingModeCoefficients) {
     for (int c = 0; c < cinfo->num_components; ++c) {
@@ -127,31 +189,44 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
       int by0 = mcu_y * comp->v_samp_factor;
       int block_rows_left = comp->height_in_blocks - by0;
       int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
+      // With streaming tokenization the coefficient buffers only hold the
+      // current iMCU row.
+      int start_row = m->streaming_tokenization ? 0 : by0;
       blocks[c] = (*cinfo->mem->access_virt_barray)(
-          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c], by0,
-          max_block_rows, true);
+          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c],
+          start_row, max_block_rows, true);
     }
   }
   if (kMode == kStreamingModeTokens) {
     TokenArray* ta = &m->token_arrays[m->cur_token_array];
-    int max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
-    if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
+    size_t max_bytes_per_mcu_row = kMaxTokenSize * MaxNumTokensPerMCURow(cinfo);
+    if (ta->size + max_bytes_per_mcu_row > m->token_array_capacity) {
       if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
+        m->total_token_bytes += ta->size;
         ++m->cur_token_array;
         ta = &m->token_arrays[m->cur_token_array];
       }
-      m->num_tokens =
-          EstimateNumTokens(cinfo, mcu_y, ysize_mcus, m->total_num_tokens,
-                            max_tokens_per_mcu_row);
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
+      m->token_array_capacity =
+          EstimateNumTokens(cinfo, mcu_y, ysize_mcus, m->total_token_bytes,
+                            max_bytes_per_mcu_row);
+      ta->tokens =
+          Allocate<uint8_t>(cinfo, m->token_array_capacity, JPOOL_IMAGE);
       m->next_token = ta->tokens;
     }
   }
   const float* imcu_start[kMaxComponents];
+  size_t block_offset[kMaxComponents];
+  size_t next_block_offset = 0;
   for (int c = 0; c < cinfo->num_components; ++c) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
     imcu_start[c] = m->raw_data[c]->Row(mcu_y * comp->v_samp_factor * DCTSIZE);
+    block_offset[c] = next_block_offset;
+    next_block_offset +=
+        xsize_mcus * comp->h_samp_factor * comp->v_samp_factor;
+  }
+  const bool parallel = m->imcu_coeffs != nullptr;
+  if (parallel) {
+    ComputeiMCURowInParallel(cinfo, block_offset, xsize_mcus);
   }
   const float* qf = nullptr;
   if (adaptive_quant) {
@@ -160,7 +235,24 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   HuffmanCodeTable* dc_code = nullptr;
   HuffmanCodeTable* ac_code = nullptr;
   const size_t qf_stride = m->quant_field.stride();
+  ScanTokenInfo* sti = &m->scan_token_info[0];
+  const size_t restart_interval = sti->restart_interval;
   for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
+    size_t mcu_idx = static_cast<size_t>(mcu_y) * xsize_mcus + mcu_x;
+    if (kMode != kStreamingModeCoefficients && restart_interval > 0 &&
+        mcu_idx > 0 && mcu_idx % restart_interval == 0) {
+      // Start of a new restart segment, the DC predictions are reset.
+      size_t restart_idx = mcu_idx / restart_interval;
+      if (kMode == kStreamingModeTokens) {
+        TokenArray* ta = &m->token_arrays[m->cur_token_array];
+        sti->restarts[restart_idx - 1] =
+            m->total_token_bytes + (m->next_token - ta->tokens);
+      } else if (kMode == kStreamingModeBits) {
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + ((restart_idx - 1) & 7));
+      }
+      memset(last_dc_coeff, 0, sizeof(m->last_dc_coeff));
+    }
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
       if (kMode == kStreamingModeBits) {
@@ -179,8 +271,8 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
           size_t bx = mcu_x * comp->h_samp_factor + ix;
           if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
             if (kMode == kStreamingModeTokens) {
-              *m->next_token++ = Token(c, 0, 0);
-              *m->next_token++ = Token(c + 4, 0, 0);
+              EmitToken(c, 0, 0, &m->next_token);
+              EmitToken(c + 4, 0, 0, &m->next_token);
             } else if (kMode == kStreamingModeBits) {
               WriteBits(bw, dc_code->depth[0], dc_code->code[0]);
               WriteBits(bw, ac_code->depth[0], ac_code->code[0]);
@@ -190,10 +282,20 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
           if (adaptive_quant) {
             aq_strength = qf[iy * qf_stride + bx * h_factor];
           }
-          const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
-          ComputeCoefficientBlock(pixels, stride, qmc, last_dc_coeff[c],
-                                  aq_strength, zero_bias_offset, zero_bias_mul,
-                                  m->dct_buffer, block);
+          if (parallel) {
+            size_t idx =
+                block_offset[c] + iy * xsize_mcus * comp->h_samp_factor + bx;
+            memcpy(block, &m->imcu_coeffs[idx * DCTSIZE2],
+                   DCTSIZE2 * sizeof(block[0]));
+            QuantizeDC(m->imcu_dc[2 * idx], m->imcu_dc[2 * idx + 1],
+                       last_dc_coeff[c], block);
+          } else {
+            const float* pixels =
+                imcu_start[c] + (iy * stride + bx) * DCTSIZE;
+            ComputeCoefficientBlock(pixels, stride, qmc, last_dc_coeff[c],
+                                    aq_strength, zero_bias_offset,
+                                    zero_bias_mul, m->dct_buffer, block);
+          }
           if (kMode == kStreamingModeCoefficients) {
             JCOEF* cblock = &blocks[c][iy][bx][0];
             for (int k = 0; k < DCTSIZE2; ++k) {
@@ -219,10 +321,9 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   }
   if (kMode == kStreamingModeTokens) {
     TokenArray* ta = &m->token_arrays[m->cur_token_array];
-    ta->num_tokens = m->next_token - ta->tokens;
-    ScanTokenInfo* sti = &m->scan_token_info[0];
-    sti->num_tokens = m->total_num_tokens + ta->num_tokens;
-    sti->restarts[0] = sti->num_tokens;
+    ta->size = m->next_token - ta->tokens;
+    sti->tokens_size = m->total_token_bytes + ta->size;
+    sti->restarts[sti->num_restarts - 1] = sti->tokens_size;
   }
 }
 
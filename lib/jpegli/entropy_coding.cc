@@ -9,11 +9,15 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "lib/base/bits.h"
+#include "lib/base/printf_macros.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
@@ -35,7 +39,7 @@ namespace jpegli {
 namespace HWY_NAMESPACE {
 
 void ComputeTokensSequential(const coeff_t* block, int last_dc, int dc_ctx,
-                             int ac_ctx, Token** tokens_ptr) {
+                             int ac_ctx, uint8_t** tokens_ptr) {
   ComputeTokensForBlock<coeff_t, true>(block, last_dc, dc_ctx, ac_ctx,
                                        tokens_ptr);
 }
@@ -59,23 +63,23 @@ size_t MaxNumTokensPerMCURow(j_compress_ptr cinfo) {
 }
 
 size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
-                         size_t num_tokens, size_t max_per_row) {
+                         size_t num_token_bytes, size_t max_per_row) {
   size_t estimate;
   if (mcu_y == 0) {
     estimate = 16 * max_per_row;
   } else {
-    estimate = (4 * ysize_mcus * num_tokens) / (3 * mcu_y);
+    estimate = (4 * ysize_mcus * num_token_bytes) / (3 * mcu_y);
   }
   size_t mcus_left = ysize_mcus - mcu_y;
   return std::min(mcus_left * max_per_row,
-                  std::max(max_per_row, estimate - num_tokens));
+                  std::max(max_per_row, estimate - num_token_bytes));
 }
 
 namespace {
 HWY_EXPORT(ComputeTokensSequential);
 
 void TokenizeProgressiveDC(const coeff_t* coeffs, int context, int Al,
-                           coeff_t* last_dc_coeff, Token** next_token) {
+                           coeff_t* last_dc_coeff, uint8_t** next_token) {
   coeff_t temp2;
   coeff_t temp;
   temp2 = coeffs[0] >> Al;
@@ -88,12 +92,230 @@ void TokenizeProgressiveDC(const coeff_t* coeffs, int context, int Al,
   }
   int nbits = (temp == 0) ? 0 : (jxl::FloorLog2Nonzero<uint32_t>(temp) + 1);
   int bits = temp2 & ((1 << nbits) - 1);
-  *(*next_token)++ = Token(context, nbits, bits);
+  EmitToken(context, nbits, bits, next_token);
 }
 
-void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
-                               int context, ScanTokenInfo* sti) {
+// Appends the packed token stream to the token arrays of the compressor,
+// allocating a new token array from the image pool when the current one is
+// full. Offsets are global byte offsets into the concatenated token arrays.
+class TokenArrayWriter {
+ public:
+  explicit TokenArrayWriter(j_compress_ptr cinfo)
+      : cinfo_(cinfo), m_(cinfo->master) {}
+
+  uint8_t** next_token() { return &m_->next_token; }
+
+  // Updates the size of the current token array after emitting tokens.
+  void Sync() { ta()->size = m_->next_token - ta()->tokens; }
+
+  size_t Offset() const { return m_->total_token_bytes + ta()->size; }
+
+  bool HasSpace(size_t max_bytes) const {
+    return ta()->size + max_bytes <= m_->token_array_capacity;
+  }
+
+  // Starts a new token array with the given capacity.
+  void Grow(size_t capacity) {
+    if (ta()->tokens) {
+      m_->total_token_bytes += ta()->size;
+      ++m_->cur_token_array;
+    }
+    m_->token_array_capacity = capacity;
+    ta()->tokens = Allocate<uint8_t>(cinfo_, capacity, JPOOL_IMAGE);
+    m_->next_token = ta()->tokens;
+  }
+
+ private:
+  TokenArray* ta() const { return &m_->token_arrays[m_->cur_token_array]; }
+
+  j_compress_ptr cinfo_;
+  jpeg_comp_master* m_;
+};
+
+// Collects the packed token stream of one scan into a heap buffer that is
+// owned by the writer, so that scans can be tokenized on the parallel runner
+// without allocating from the memory pools. Offsets are relative to the start
+// of the scan's tokens.
+class ScanTokenWriter {
+ public:
+  uint8_t** next_token() { return &next_token_; }
+
+  void Sync() { size_ = next_token_ - data_.get(); }
+
+  size_t Offset() const { return size_; }
+
+  bool HasSpace(size_t max_bytes) const {
+    return size_ + max_bytes <= capacity_;
+  }
+
+  // Makes room for at least num_bytes more bytes.
+  void Grow(size_t num_bytes) {
+    size_t capacity = std::max(2 * capacity_, size_ + num_bytes);
+    std::unique_ptr<uint8_t[]> data(new uint8_t[capacity]);
+    if (size_ > 0) memcpy(data.get(), data_.get(), size_);
+    data_ = std::move(data);
+    capacity_ = capacity;
+    next_token_ = data_.get() + size_;
+  }
+
+  const uint8_t* data() const { return data_.get(); }
+  size_t size() const { return size_; }
+
+ private:
+  std::unique_ptr<uint8_t[]> data_;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  uint8_t* next_token_ = nullptr;
+};
+
+// Appends the packed token stream of one scan to its own range of token arrays
+// when the scan is tokenized while the input is read, see ScanTokenizerState.
+// Offsets are relative to the start of the scan's tokens.
+class ScanTokenArrayWriter {
+ public:
+  ScanTokenArrayWriter(j_compress_ptr cinfo, ScanTokenizerState* st)
+      : cinfo_(cinfo), m_(cinfo->master), st_(st) {}
+
+  uint8_t** next_token() { return &st_->next_token; }
+
+  void Sync() { ta()->size = st_->next_token - ta()->tokens; }
+
+  size_t Offset() const { return st_->total_token_bytes + ta()->size; }
+
+  bool HasSpace(size_t max_bytes) const {
+    return ta()->size + max_bytes <= st_->token_array_capacity;
+  }
+
+  // Starts a new token array with the given capacity.
+  void Grow(size_t capacity) {
+    if (ta()->tokens) {
+      st_->total_token_bytes += ta()->size;
+      ++st_->cur_token_array;
+    }
+    st_->token_array_capacity = capacity;
+    ta()->tokens = Allocate<uint8_t>(cinfo_, capacity, JPOOL_IMAGE);
+    st_->next_token = ta()->tokens;
+  }
+
+ private:
+  TokenArray* ta() const { return &m_->token_arrays[st_->cur_token_array]; }
+
+  j_compress_ptr cinfo_;
+  jpeg_comp_master* m_;
+  ScanTokenizerState* st_;
+};
+
+// Returns num_rows block rows of component c starting at block row by. With
+// streaming tokenization, the coefficient buffers only hold the current iMCU
+// row.
+JBLOCKARRAY GetCoeffRows(j_compress_ptr cinfo, int c, size_t by,
+                         size_t num_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  if (m->streaming_tokenization) {
+    by -= m->next_iMCU_row * cinfo->comp_info[c].v_samp_factor;
+  }
+  return (*cinfo->mem->access_virt_barray)(
+      reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c], by, num_rows,
+      FALSE);
+}
+
+// Returns the coefficients of block row by of component c for the AC
+// refinement scans. With streaming tokenization, the coefficients are expanded
+// from the refinement coefficients of the component into *row_buffer.
+const coeff_t* GetRefinementRow(j_compress_ptr cinfo, int c, size_t by,
+                                std::vector<coeff_t>* row_buffer) {
   jpeg_comp_master* m = cinfo->master;
+  if (!m->streaming_tokenization) {
+    return &GetCoeffRows(cinfo, c, by, 1)[0][0][0];
+  }
+  const RefinementCoeffs& rc = m->refinement_coeffs[c];
+  const jpeg_component_info* comp = &cinfo->comp_info[c];
+  const size_t num_coeffs = rc.Se - rc.Ss + 1;
+  row_buffer->resize(comp->width_in_blocks * DCTSIZE2);
+  JSAMPARRAY rows = (*cinfo->mem->access_virt_sarray)(
+      reinterpret_cast<j_common_ptr>(cinfo), rc.buffer, by, 1, FALSE);
+  const JSAMPLE* src = rows[0];
+  for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+    coeff_t* block = &(*row_buffer)[bx * DCTSIZE2];
+    for (int k = rc.Ss; k <= rc.Se; ++k) {
+      block[k] = static_cast<int8_t>(src[k - rc.Ss]);
+    }
+    src += num_coeffs;
+  }
+  return row_buffer->data();
+}
+
+// Stores the coefficients of the current iMCU row of component c that are
+// needed by its AC refinement scans.
+void StoreRefinementCoeffs(j_compress_ptr cinfo, int c) {
+  jpeg_comp_master* m = cinfo->master;
+  const RefinementCoeffs& rc = m->refinement_coeffs[c];
+  const jpeg_component_info* comp = &cinfo->comp_info[c];
+  const size_t by0 = m->next_iMCU_row * comp->v_samp_factor;
+  const size_t by1 =
+      std::min<size_t>(by0 + comp->v_samp_factor, comp->height_in_blocks);
+  for (size_t by = by0; by < by1; ++by) {
+    JBLOCKARRAY blocks = GetCoeffRows(cinfo, c, by, 1);
+    JSAMPARRAY rows = (*cinfo->mem->access_virt_sarray)(
+        reinterpret_cast<j_common_ptr>(cinfo), rc.buffer, by, 1, TRUE);
+    JSAMPLE* dst = rows[0];
+    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+      const coeff_t* block = &blocks[0][bx][0];
+      for (int k = rc.Ss; k <= rc.Se; ++k) {
+        const int Al = rc.Al[k];
+        int value = 0;
+        if (Al > 0) {
+          const int absval = std::abs(static_cast<int>(block[k]));
+          const int low_bits = absval & ((1 << Al) - 1);
+          value = (absval >> Al) != 0 ? (1 << Al) | low_bits : low_bits;
+          if (block[k] < 0) value = -value;
+        }
+        *dst++ = static_cast<JSAMPLE>(static_cast<int8_t>(value));
+      }
+    }
+  }
+}
+
+// Returns the maximum size of the packed tokens of one block row of an AC
+// scan, or one MCU row of any other scan.
+size_t MaxTokenBytesPerRow(j_compress_ptr cinfo, int scan_index) {
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  const ScanTokenInfo* sti = &cinfo->master->scan_token_info[scan_index];
+  if (scan_info->Ss > 0) {
+    const jpeg_component_info* comp =
+        &cinfo->comp_info[scan_info->component_index[0]];
+    // Each coefficient can appear in at most one token, but we have to reserve
+    // one extra EOBrun token that was rolled over from the previous block-row
+    // and has to be flushed at the end.
+    return kMaxTokenSize *
+           (1 + comp->width_in_blocks * (scan_info->Se - scan_info->Ss + 1));
+  }
+  if (!cinfo->progressive_mode) {
+    return kMaxTokenSize * MaxNumTokensPerMCURow(cinfo);
+  }
+  return kMaxTokenSize * sti->MCUs_per_row * sti->blocks_in_MCU;
+}
+
+void InitScanTokenizerState(const ScanTokenInfo* sti, ScanTokenizerState* st) {
+  memset(st, 0, sizeof(*st));
+  st->restarts_to_go = sti->restart_interval;
+}
+
+void EmitEOBRun(int context, int* eob_run, uint8_t** next_token) {
+  int nbits = jxl::FloorLog2Nonzero<uint32_t>(*eob_run);
+  int symbol = nbits << 4u;
+  EmitToken(context, symbol, *eob_run & ((1 << nbits) - 1), next_token);
+  *eob_run = 0;
+}
+
+// Tokenizes the block rows [by0, by1) of an AC scan that is not a refinement
+// scan. If coeff_nonzeros is not null, the number of nonzero coefficients for
+// each coefficient index of the scan is added to it.
+template <typename TokenWriter>
+void TokenizeACProgressiveRows(j_compress_ptr cinfo, int scan_index,
+                               int context, ScanTokenInfo* sti,
+                               ScanTokenizerState* st, size_t by0, size_t by1,
+                               TokenWriter* tw, size_t* coeff_nonzeros) {
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   const int comp_idx = scan_info->component_index[0];
   const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
@@ -101,47 +323,21 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
   const int Ss = scan_info->Ss;
   const int Se = scan_info->Se;
   const size_t restart_interval = sti->restart_interval;
-  int restarts_to_go = restart_interval;
-  size_t num_blocks = comp->height_in_blocks * comp->width_in_blocks;
-  size_t num_restarts =
-      restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
-  size_t restart_idx = 0;
-  int eob_run = 0;
-  TokenArray* ta = &m->token_arrays[m->cur_token_array];
-  sti->token_offset = m->total_num_tokens + ta->num_tokens;
-  sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
-  const auto emit_eob_run = [&]() {
-    int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run);
-    int symbol = nbits << 4u;
-    *m->next_token++ = Token(context, symbol, eob_run & ((1 << nbits) - 1));
-    eob_run = 0;
-  };
-  for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
-        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
-        1, FALSE);
-    // Each coefficient can appear in at most one token, but we have to reserve
-    // one extra EOBrun token that was rolled over from the previous block-row
-    // and has to be flushed at the end.
-    int max_tokens_per_row = 1 + comp->width_in_blocks * (Se - Ss + 1);
-    if (ta->num_tokens + max_tokens_per_row > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens =
-          EstimateNumTokens(cinfo, by, comp->height_in_blocks,
-                            m->total_num_tokens, max_tokens_per_row);
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
+  const size_t max_bytes_per_row = MaxTokenBytesPerRow(cinfo, scan_index);
+  for (size_t by = by0; by < by1; ++by) {
+    JBLOCKARRAY blocks = GetCoeffRows(cinfo, comp_idx, by, 1);
+    if (!tw->HasSpace(max_bytes_per_row)) {
+      tw->Grow(EstimateNumTokens(cinfo, by, comp->height_in_blocks,
+                                 tw->Offset(), max_bytes_per_row));
     }
     for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
-      if (restart_interval > 0 && restarts_to_go == 0) {
-        if (eob_run > 0) emit_eob_run();
-        ta->num_tokens = m->next_token - ta->tokens;
-        sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
-        restarts_to_go = restart_interval;
+      if (restart_interval > 0 && st->restarts_to_go == 0) {
+        if (st->eob_run > 0) {
+          EmitEOBRun(context, &st->eob_run, tw->next_token());
+        }
+        tw->Sync();
+        sti->restarts[st->restart_idx++] = tw->Offset();
+        st->restarts_to_go = restart_interval;
       }
       const coeff_t* block = &blocks[0][bx][0];
       coeff_t temp2;
@@ -155,6 +351,7 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
           r++;
           continue;
         }
+        if (coeff_nonzeros) ++coeff_nonzeros[k];
         if (temp < 0) {
           temp = -temp;
           temp >>= Al;
@@ -168,38 +365,67 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
           num_future_nzeros++;
           continue;
         }
-        if (eob_run > 0) emit_eob_run();
+        if (st->eob_run > 0) {
+          EmitEOBRun(context, &st->eob_run, tw->next_token());
+        }
         while (r > 15) {
-          *m->next_token++ = Token(context, 0xf0, 0);
+          EmitToken(context, 0xf0, 0, tw->next_token());
           r -= 16;
         }
         int nbits = jxl::FloorLog2Nonzero<uint32_t>(temp) + 1;
         int symbol = (r << 4u) + nbits;
-        *m->next_token++ = Token(context, symbol, temp2 & ((1 << nbits) - 1));
+        EmitToken(context, symbol, temp2 & ((1 << nbits) - 1),
+                  tw->next_token());
         ++num_nzeros;
         r = 0;
       }
       if (r > 0) {
-        ++eob_run;
-        if (eob_run == 0x7FFF) emit_eob_run();
+        ++st->eob_run;
+        if (st->eob_run == 0x7FFF) {
+          EmitEOBRun(context, &st->eob_run, tw->next_token());
+        }
       }
       sti->num_nonzeros += num_nzeros;
       sti->num_future_nonzeros += num_future_nzeros;
-      --restarts_to_go;
+      --st->restarts_to_go;
     }
-    ta->num_tokens = m->next_token - ta->tokens;
+    tw->Sync();
   }
-  if (eob_run > 0) {
-    emit_eob_run();
-    ++ta->num_tokens;
+}
+
+// Flushes the EOB run at the end of an AC scan that is not a refinement scan.
+template <typename TokenWriter>
+void FinishACProgressiveScan(int context, ScanTokenInfo* sti,
+                             ScanTokenizerState* st, TokenWriter* tw) {
+  if (st->eob_run > 0) {
+    EmitEOBRun(context, &st->eob_run, tw->next_token());
+    tw->Sync();
   }
-  sti->num_tokens = m->total_num_tokens + ta->num_tokens - sti->token_offset;
-  sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
+  sti->tokens_size = tw->Offset() - sti->token_offset;
+  sti->restarts[st->restart_idx++] = tw->Offset();
 }
 
+template <typename TokenWriter>
+void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
+                               int context, ScanTokenInfo* sti,
+                               TokenWriter* tw, size_t* coeff_nonzeros) {
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  const jpeg_component_info* comp =
+      &cinfo->comp_info[scan_info->component_index[0]];
+  ScanTokenizerState st;
+  InitScanTokenizerState(sti, &st);
+  sti->token_offset = tw->Offset();
+  TokenizeACProgressiveRows(cinfo, scan_index, context, sti, &st, 0,
+                            comp->height_in_blocks, tw, coeff_nonzeros);
+  FinishACProgressiveScan(context, sti, &st, tw);
+}
+
+// Writes the refinement tokens and bits of the scan starting at *next_token
+// and *next_ref_bit, and advances these pointers past them. The eobruns array
+// of sti must already be allocated.
 void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
-                              ScanTokenInfo* sti) {
-  jpeg_comp_master* m = cinfo->master;
+                              ScanTokenInfo* sti, RefToken** next_token_ptr,
+                              uint8_t** next_ref_bit_ptr) {
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   const int comp_idx = scan_info->component_index[0];
   const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
@@ -211,22 +437,16 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
   RefToken token;
   int eob_run = 0;
   int eob_refbits = 0;
-  size_t num_blocks = comp->height_in_blocks * comp->width_in_blocks;
-  size_t num_restarts =
-      restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
-  sti->tokens = m->next_refinement_token;
-  sti->refbits = m->next_refinement_bit;
-  sti->eobruns = Allocate<uint16_t>(cinfo, num_blocks / 2, JPOOL_IMAGE);
-  sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
+  sti->tokens = *next_token_ptr;
+  sti->refbits = *next_ref_bit_ptr;
   RefToken* next_token = sti->tokens;
   RefToken* next_eob_token = next_token;
   uint8_t* next_ref_bit = sti->refbits;
   uint16_t* next_eobrun = sti->eobruns;
   size_t restart_idx = 0;
+  std::vector<coeff_t> row_buffer;
   for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
-        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
-        1, FALSE);
+    const coeff_t* row = GetRefinementRow(cinfo, comp_idx, by, &row_buffer);
     for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
       if (restart_interval > 0 && restarts_to_go == 0) {
         sti->restarts[restart_idx++] = next_token - sti->tokens;
@@ -234,7 +454,7 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
         next_eob_token = next_token;
         eob_run = eob_refbits = 0;
       }
-      const coeff_t* block = &blocks[0][bx][0];
+      const coeff_t* block = &row[bx * DCTSIZE2];
       int num_eob_refinement_bits = 0;
       int num_refinement_bits = 0;
       int num_nzeros = 0;
@@ -308,28 +528,21 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
       --restarts_to_go;
     }
   }
-  sti->num_tokens = next_token - sti->tokens;
-  sti->restarts[restart_idx++] = sti->num_tokens;
-  m->next_refinement_token = next_token;
-  m->next_refinement_bit = next_ref_bit;
+  sti->tokens_size = next_token - sti->tokens;
+  sti->restarts[restart_idx++] = sti->tokens_size;
+  *next_token_ptr = next_token;
+  *next_ref_bit_ptr = next_ref_bit;
 }
 
-void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
-                  ScanTokenInfo* sti) {
+// Tokenizes the MCU rows [mcu_y0, mcu_y1) of a scan that is not an AC scan.
+template <typename TokenWriter>
+void TokenizeScanRows(j_compress_ptr cinfo, size_t scan_index,
+                      int ac_ctx_offset, ScanTokenInfo* sti,
+                      ScanTokenizerState* st, size_t mcu_y0, size_t mcu_y1,
+                      TokenWriter* tw) {
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
-  if (scan_info->Ss > 0) {
-    if (scan_info->Ah == 0) {
-      TokenizeACProgressiveScan(cinfo, scan_index, ac_ctx_offset, sti);
-    } else {
-      TokenizeACRefinementScan(cinfo, scan_index, sti);
-    }
-    return;
-  }
-
-  jpeg_comp_master* m = cinfo->master;
   size_t restart_interval = sti->restart_interval;
-  int restarts_to_go = restart_interval;
-  coeff_t last_dc_coeff[MAX_COMPS_IN_SCAN] = {0};
+  coeff_t* last_dc_coeff = st->last_dc_coeff;
 
   // "Non-interleaved" means color data comes in separate scans, in other words
   // each scan can contain only one color component.
@@ -339,28 +552,8 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
   const int Al = scan_info->Al;
   HWY_ALIGN constexpr coeff_t kSinkBlock[DCTSIZE2] = {0};
 
-  size_t restart_idx = 0;
-  TokenArray* ta = &m->token_arrays[m->cur_token_array];
-  sti->token_offset = Ah > 0 ? 0 : m->total_num_tokens + ta->num_tokens;
-
-  if (Ah > 0) {
-    sti->refbits = Allocate<uint8_t>(cinfo, sti->num_blocks, JPOOL_IMAGE);
-  } else if (cinfo->progressive_mode) {
-    if (ta->num_tokens + sti->num_blocks > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens = sti->num_blocks;
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
-    }
-  }
-
   JBLOCKARRAY blocks[MAX_COMPS_IN_SCAN];
-  size_t block_idx = 0;
-  for (size_t mcu_y = 0; mcu_y < sti->MCU_rows_in_scan; ++mcu_y) {
+  for (size_t mcu_y = mcu_y0; mcu_y < mcu_y1; ++mcu_y) {
     for (int i = 0; i < scan_info->comps_in_scan; ++i) {
       int comp_idx = scan_info->component_index[i];
       jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
@@ -368,33 +561,23 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
       int by0 = mcu_y * n_blocks_y;
       int block_rows_left = comp->height_in_blocks - by0;
       int max_block_rows = std::min(n_blocks_y, block_rows_left);
-      blocks[i] = (*cinfo->mem->access_virt_barray)(
-          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx],
-          by0, max_block_rows, FALSE);
+      blocks[i] = GetCoeffRows(cinfo, comp_idx, by0, max_block_rows);
     }
     if (!cinfo->progressive_mode) {
-      int max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
-      if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
-        if (ta->tokens) {
-          m->total_num_tokens += ta->num_tokens;
-          ++m->cur_token_array;
-          ta = &m->token_arrays[m->cur_token_array];
-        }
-        m->num_tokens =
-            EstimateNumTokens(cinfo, mcu_y, sti->MCU_rows_in_scan,
-                              m->total_num_tokens, max_tokens_per_mcu_row);
-        ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-        m->next_token = ta->tokens;
+      size_t max_bytes_per_mcu_row = MaxTokenBytesPerRow(cinfo, scan_index);
+      if (!tw->HasSpace(max_bytes_per_mcu_row)) {
+        tw->Grow(EstimateNumTokens(cinfo, mcu_y, sti->MCU_rows_in_scan,
+                                   tw->Offset(), max_bytes_per_mcu_row));
       }
     }
     for (size_t mcu_x = 0; mcu_x < sti->MCUs_per_row; ++mcu_x) {
       // Possibly emit a restart marker.
-      if (restart_interval > 0 && restarts_to_go == 0) {
-        restarts_to_go = restart_interval;
-        memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
-        ta->num_tokens = m->next_token - ta->tokens;
-        sti->restarts[restart_idx++] =
-            Ah > 0 ? block_idx : m->total_num_tokens + ta->num_tokens;
+      if (restart_interval > 0 && st->restarts_to_go == 0) {
+        st->restarts_to_go = restart_interval;
+        memset(last_dc_coeff, 0, sizeof(st->last_dc_coeff));
+        tw->Sync();
+        sti->restarts[st->restart_idx++] =
+            Ah > 0 ? st->block_idx : tw->Offset();
       }
       // Encode one MCU
       for (int i = 0; i < scan_info->comps_in_scan; ++i) {
@@ -416,52 +599,103 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
             if (!is_progressive) {
               HWY_DYNAMIC_DISPATCH(ComputeTokensSequential)
               (block, last_dc_coeff[i], comp_idx, ac_ctx_offset + i,
-               &m->next_token);
+               tw->next_token());
               last_dc_coeff[i] = block[0];
             } else {
               if (Ah == 0) {
                 TokenizeProgressiveDC(block, comp_idx, Al, last_dc_coeff + i,
-                                      &m->next_token);
+                                      tw->next_token());
               } else {
-                sti->refbits[block_idx] = (block[0] >> Al) & 1;
+                sti->refbits[st->block_idx] = (block[0] >> Al) & 1;
               }
             }
-            ++block_idx;
+            ++st->block_idx;
           }
         }
       }
-      --restarts_to_go;
+      --st->restarts_to_go;
     }
-    ta->num_tokens = m->next_token - ta->tokens;
+    tw->Sync();
   }
-  JXL_DASSERT(block_idx == sti->num_blocks);
-  sti->num_tokens =
-      Ah > 0 ? sti->num_blocks
-             : m->total_num_tokens + ta->num_tokens - sti->token_offset;
-  sti->restarts[restart_idx++] =
-      Ah > 0 ? sti->num_blocks : m->total_num_tokens + ta->num_tokens;
+}
+
+// Sets the size and the end of the last restart segment of a scan that is not
+// an AC scan.
+template <typename TokenWriter>
+void FinishScanTokens(const jpeg_scan_info* scan_info, ScanTokenInfo* sti,
+                      ScanTokenizerState* st, TokenWriter* tw) {
+  const int Ah = scan_info->Ah;
+  JXL_DASSERT(st->block_idx == sti->num_blocks);
+  sti->tokens_size =
+      Ah > 0 ? sti->num_blocks : tw->Offset() - sti->token_offset;
+  sti->restarts[st->restart_idx++] = Ah > 0 ? sti->num_blocks : tw->Offset();
+}
+
+template <typename TokenWriter>
+void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
+                  ScanTokenInfo* sti, TokenWriter* tw,
+                  size_t* coeff_nonzeros) {
+  jpeg_comp_master* m = cinfo->master;
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  if (scan_info->Ss > 0) {
+    if (scan_info->Ah == 0) {
+      TokenizeACProgressiveScan(cinfo, scan_index, ac_ctx_offset, sti, tw,
+                                coeff_nonzeros);
+    } else {
+      TokenizeACRefinementScan(cinfo, scan_index, sti,
+                               &m->next_refinement_token,
+                               &m->next_refinement_bit);
+    }
+    return;
+  }
+
+  const int Ah = scan_info->Ah;
+  ScanTokenizerState st;
+  InitScanTokenizerState(sti, &st);
+  sti->token_offset = Ah > 0 ? 0 : tw->Offset();
+
   if (Ah == 0 && cinfo->progressive_mode) {
-    JXL_DASSERT(sti->num_blocks == sti->num_tokens);
+    size_t max_bytes = kMaxTokenSize * sti->num_blocks;
+    if (!tw->HasSpace(max_bytes)) {
+      tw->Grow(max_bytes);
+    }
   }
+
+  TokenizeScanRows(cinfo, scan_index, ac_ctx_offset, sti, &st, 0,
+                   sti->MCU_rows_in_scan, tw);
+  FinishScanTokens(scan_info, sti, &st, tw);
 }
 
-}  // namespace
+// Allocates the buffers of the refinement scans that have a size that is
+// known before tokenization.
+void AllocateRefinementBuffers(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    if (si->Ah == 0) continue;
+    if (si->Ss == 0) {
+      sti->refbits = Allocate<uint8_t>(cinfo, sti->num_blocks, JPOOL_IMAGE);
+    } else {
+      sti->eobruns =
+          Allocate<uint16_t>(cinfo, sti->num_blocks / 2, JPOOL_IMAGE);
+    }
+  }
+}
 
-void TokenizeJpeg(j_compress_ptr cinfo) {
+// Tokenizes the AC refinement scans into shared refinement token and bit
+// buffers, after the AC scans with successive approximation were tokenized.
+void TokenizeACRefinementScans(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
-  std::vector<int> processed(cinfo->num_scans);
   size_t max_refinement_tokens = 0;
   size_t num_refinement_bits = 0;
   int num_refinement_scans[kMaxComponents][DCTSIZE2] = {};
   int max_num_refinement_scans = 0;
   for (int i = 0; i < cinfo->num_scans; ++i) {
     const jpeg_scan_info* si = &cinfo->scan_info[i];
-    ScanTokenInfo* sti = &m->scan_token_info[i];
+    const ScanTokenInfo* sti = &m->scan_token_info[i];
     if (si->Ss > 0 && si->Ah == 0 && si->Al > 0) {
-      int offset = m->ac_ctx_offset[i];
       int comp_idx = si->component_index[0];
-      TokenizeScan(cinfo, i, offset, sti);
-      processed[i] = 1;
       max_refinement_tokens += sti->num_future_nonzeros;
       for (int k = si->Ss; k <= si->Se; ++k) {
         num_refinement_scans[comp_idx][k] = si->Al;
@@ -491,9 +725,8 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
       ScanTokenInfo* sti = &m->scan_token_info[i];
       if (si->Ss > 0 && si->Ah > 0 &&
           si->Ah == num_refinement_scans[comp_idx][si->Ss] - j) {
-        int offset = m->ac_ctx_offset[i];
-        TokenizeScan(cinfo, i, offset, sti);
-        processed[i] = 1;
+        TokenizeACRefinementScan(cinfo, i, sti, &m->next_refinement_token,
+                                 &m->next_refinement_bit);
         new_refinement_bits += sti->num_nonzeros;
       }
     }
@@ -501,52 +734,327 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
                 refinement_bits + num_refinement_bits);
     num_refinement_bits += new_refinement_bits;
   }
+}
+
+void TokenizeJpegSequential(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  TokenArrayWriter tw(cinfo);
+  std::vector<int> processed(cinfo->num_scans);
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Ss > 0 && si->Ah == 0 && si->Al > 0) {
+      int offset = m->ac_ctx_offset[i];
+      TokenizeScan(cinfo, i, offset, &m->scan_token_info[i], &tw, nullptr);
+      processed[i] = 1;
+    }
+    if (si->Ss > 0 && si->Ah > 0) {
+      processed[i] = 1;
+    }
+  }
+  TokenizeACRefinementScans(cinfo);
   for (int i = 0; i < cinfo->num_scans; ++i) {
     if (processed[i]) {
       continue;
     }
     int offset = m->ac_ctx_offset[i];
-    TokenizeScan(cinfo, i, offset, &m->scan_token_info[i]);
+    TokenizeScan(cinfo, i, offset, &m->scan_token_info[i], &tw, nullptr);
     processed[i] = 1;
   }
 }
 
-namespace {
+// Tokenizes the AC refinement scans on the parallel runner into separate
+// preallocated buffers. coeff_nonzeros contains the number of nonzero
+// coefficients of each scan and coefficient index, which bounds the number of
+// refinement tokens and bits of each AC refinement scan.
+void TokenizeACRefinementScansInParallel(
+    j_compress_ptr cinfo, const std::vector<size_t>& coeff_nonzeros) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<uint32_t> refinement_scans;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Ss > 0 && si->Ah > 0) {
+      refinement_scans.push_back(i);
+    }
+  }
+  if (refinement_scans.empty()) {
+    return;
+  }
+  size_t num_nonzeros[kMaxComponents][DCTSIZE2] = {};
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Ss == 0 || si->Ah > 0) continue;
+    int comp_idx = si->component_index[0];
+    for (int k = si->Ss; k <= si->Se; ++k) {
+      num_nonzeros[comp_idx][k] += coeff_nonzeros[i * DCTSIZE2 + k];
+    }
+  }
+  std::vector<RefToken*> ref_tokens(cinfo->num_scans);
+  std::vector<uint8_t*> ref_bits(cinfo->num_scans);
+  for (uint32_t i : refinement_scans) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    const ScanTokenInfo* sti = &m->scan_token_info[i];
+    int comp_idx = si->component_index[0];
+    size_t max_refinement_bits = 0;
+    for (int k = si->Ss; k <= si->Se; ++k) {
+      max_refinement_bits += num_nonzeros[comp_idx][k];
+    }
+    size_t max_refinement_tokens =
+        max_refinement_bits + (1 + (si->Se - si->Ss) / 16) * sti->num_blocks;
+    ref_tokens[i] =
+        Allocate<RefToken>(cinfo, max_refinement_tokens, JPOOL_IMAGE);
+    ref_bits[i] = Allocate<uint8_t>(cinfo, max_refinement_bits, JPOOL_IMAGE);
+  }
+  const auto tokenize_refinement_scan = [&](const uint32_t task,
+                                            size_t /*thread*/) {
+    const uint32_t i = refinement_scans[task];
+    TokenizeACRefinementScan(cinfo, i, &m->scan_token_info[i], &ref_tokens[i],
+                             &ref_bits[i]);
+  };
+  RunParallel(cinfo, refinement_scans.size(), tokenize_refinement_scan,
+              "TokenizeRefinementScans");
+}
 
-struct Histogram {
-  int count[kJpegHuffmanAlphabetSize];
-  Histogram() { memset(count, 0, sizeof(count)); }
-};
+// Tokenizes the scans on the parallel runner in two stages. First all scans
+// except the AC refinement scans are tokenized into separate buffers, which are
+// then appended to the token arrays in scan order. The first stage also counts
+// the nonzero coefficients of each component and coefficient index, so that
+// the AC refinement scans can be tokenized in parallel into preallocated
+// buffers in the second stage. The token streams are the same as with
+// TokenizeJpegSequential().
+void TokenizeJpegInParallel(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<uint32_t> scans;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Ss == 0 || si->Ah == 0) {
+      scans.push_back(i);
+    }
+  }
+  std::vector<ScanTokenWriter> writers(cinfo->num_scans);
+  std::vector<size_t> coeff_nonzeros(cinfo->num_scans * DCTSIZE2);
+  const auto tokenize_scan = [&](const uint32_t task, size_t /*thread*/) {
+    const uint32_t i = scans[task];
+    TokenizeScan(cinfo, i, m->ac_ctx_offset[i], &m->scan_token_info[i],
+                 &writers[i], &coeff_nonzeros[i * DCTSIZE2]);
+  };
+  RunParallel(cinfo, scans.size(), tokenize_scan, "TokenizeScans");
 
-void BuildHistograms(j_compress_ptr cinfo, Histogram* histograms) {
+  size_t total_bytes = 0;
+  size_t num_token_arrays = 0;
+  for (uint32_t i : scans) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    if (si->Ah > 0) {
+      // DC refinement scans have only refinement bits.
+      continue;
+    }
+    sti->token_offset += total_bytes;
+    for (size_t r = 0; r < sti->num_restarts; ++r) {
+      sti->restarts[r] += total_bytes;
+    }
+    const size_t size = writers[i].size();
+    if (size == 0) continue;
+    TokenArray* ta = &m->token_arrays[num_token_arrays++];
+    ta->tokens = Allocate<uint8_t>(cinfo, size, JPOOL_IMAGE);
+    ta->size = size;
+    memcpy(ta->tokens, writers[i].data(), size);
+    writers[i] = ScanTokenWriter();
+    total_bytes += size;
+  }
+  if (num_token_arrays > 0) {
+    m->cur_token_array = num_token_arrays - 1;
+    TokenArray* ta = &m->token_arrays[m->cur_token_array];
+    m->total_token_bytes = total_bytes - ta->size;
+    m->token_array_capacity = ta->size;
+    m->next_token = ta->tokens + ta->size;
+  }
+
+  TokenizeACRefinementScansInParallel(cinfo, coeff_nonzeros);
+}
+
+// Moves the token arrays of the scans that were tokenized while the input was
+// read next to each other in scan order, converts the offsets of the scans to
+// global offsets, and tokenizes the AC refinement scans from the refinement
+// coefficients.
+void FinishStreamingTokenization(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
-  size_t num_token_arrays = m->cur_token_array + 1;
-  for (size_t i = 0; i < num_token_arrays; ++i) {
-    Token* tokens = m->token_arrays[i].tokens;
-    size_t num_tokens = m->token_arrays[i].num_tokens;
-    for (size_t j = 0; j < num_tokens; ++j) {
-      Token t = tokens[j];
-      ++histograms[t.context].count[t.symbol];
+  size_t total_bytes = 0;
+  size_t num_token_arrays = 0;
+  std::vector<size_t> coeff_nonzeros(cinfo->num_scans * DCTSIZE2);
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    const ScanTokenizerState* st = &m->scan_tokenizer_state[i];
+    if (si->Ah > 0) {
+      // Refinement scans have no packed tokens.
+      continue;
+    }
+    memcpy(&coeff_nonzeros[i * DCTSIZE2], st->coeff_nonzeros,
+           sizeof(st->coeff_nonzeros));
+    sti->token_offset += total_bytes;
+    for (size_t r = 0; r < sti->num_restarts; ++r) {
+      sti->restarts[r] += total_bytes;
+    }
+    // The tokens of the scan are in its token arrays in order, and the token
+    // arrays of the previous scans were only moved to lower indexes.
+    for (size_t ta = st->first_token_array; ta <= st->cur_token_array; ++ta) {
+      if (m->token_arrays[ta].size == 0) continue;
+      m->token_arrays[num_token_arrays++] = m->token_arrays[ta];
+      total_bytes += m->token_arrays[ta].size;
     }
   }
+  if (num_token_arrays > 0) {
+    m->cur_token_array = num_token_arrays - 1;
+    TokenArray* ta = &m->token_arrays[m->cur_token_array];
+    m->total_token_bytes = total_bytes - ta->size;
+    m->token_array_capacity = ta->size;
+    m->next_token = ta->tokens + ta->size;
+  } else {
+    m->cur_token_array = 0;
+    m->token_arrays[0] = {nullptr, 0};
+    m->total_token_bytes = 0;
+    m->token_array_capacity = 0;
+    m->next_token = nullptr;
+  }
+  if (m->runner != nullptr) {
+    TokenizeACRefinementScansInParallel(cinfo, coeff_nonzeros);
+  } else {
+    TokenizeACRefinementScans(cinfo);
+  }
+}
+
+}  // namespace
+
+bool InitRefinementCoeffs(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  bool fits = true;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    RefinementCoeffs* rc = &m->refinement_coeffs[c];
+    rc->buffer = nullptr;
+    rc->Ss = DCTSIZE2;
+    rc->Se = 0;
+    memset(rc->Al, 0, sizeof(rc->Al));
+  }
   for (int i = 0; i < cinfo->num_scans; ++i) {
-    const jpeg_scan_info& si = cinfo->scan_info[i];
-    const ScanTokenInfo& sti = m->scan_token_info[i];
-    if (si.Ss > 0 && si.Ah > 0) {
-      int context = m->ac_ctx_offset[i];
-      int* ac_histo = &histograms[context].count[0];
-      for (size_t j = 0; j < sti.num_tokens; ++j) {
-        ++ac_histo[sti.tokens[j].symbol & 253];
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Ss == 0 || si->Ah == 0) continue;
+    RefinementCoeffs* rc = &m->refinement_coeffs[si->component_index[0]];
+    rc->Ss = std::min(rc->Ss, si->Ss);
+    rc->Se = std::max(rc->Se, si->Se);
+  }
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Ss == 0 || si->Ah > 0) continue;
+    RefinementCoeffs* rc = &m->refinement_coeffs[si->component_index[0]];
+    for (int k = std::max(si->Ss, rc->Ss); k <= std::min(si->Se, rc->Se);
+         ++k) {
+      rc->Al[k] = si->Al;
+      if (si->Al > kMaxRefinementCoeffsAl) fits = false;
+    }
+  }
+  return fits;
+}
+
+void InitStreamingTokenization(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t ysize_blocks = DivCeil(cinfo->image_height, DCTSIZE);
+  m->scan_tokenizer_state =
+      Allocate<ScanTokenizerState>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    ScanTokenizerState* st = &m->scan_tokenizer_state[i];
+    InitScanTokenizerState(sti, st);
+    // Each scan gets a new token array at most once per iMCU row.
+    st->first_token_array = i * ysize_blocks;
+    st->cur_token_array = st->first_token_array;
+    sti->token_offset = 0;
+  }
+  AllocateRefinementBuffers(cinfo);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    RefinementCoeffs* rc = &m->refinement_coeffs[c];
+    if (rc->Se == 0) continue;
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    rc->buffer = (*cinfo->mem->request_virt_sarray)(
+        reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE, /*pre_zero=*/FALSE,
+        comp->width_in_blocks * (rc->Se - rc->Ss + 1), comp->height_in_blocks,
+        comp->v_samp_factor);
+  }
+}
+
+void TokenizeiMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t imcu_y = m->next_iMCU_row;
+  const bool last_row = imcu_y + 1 == cinfo->total_iMCU_rows;
+  // MCU rows of each scan in the current iMCU row, these are block rows for
+  // scans with one component.
+  std::vector<uint32_t> scans;
+  std::vector<size_t> mcu_y0(cinfo->num_scans);
+  std::vector<size_t> mcu_y1(cinfo->num_scans);
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Ss > 0 && si->Ah > 0) continue;
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    size_t rows_per_imcu = 1;
+    if (si->comps_in_scan == 1) {
+      rows_per_imcu = cinfo->comp_info[si->component_index[0]].v_samp_factor;
+    }
+    mcu_y0[i] = std::min(imcu_y * rows_per_imcu, sti->MCU_rows_in_scan);
+    mcu_y1[i] = std::min(mcu_y0[i] + rows_per_imcu, sti->MCU_rows_in_scan);
+    if (si->Ah == 0 && mcu_y1[i] > mcu_y0[i]) {
+      // The token arrays are allocated here, since the memory pools can not be
+      // used on the parallel runner.
+      ScanTokenArrayWriter tw(cinfo, &m->scan_tokenizer_state[i]);
+      const size_t max_bytes =
+          (mcu_y1[i] - mcu_y0[i]) * MaxTokenBytesPerRow(cinfo, i);
+      if (!tw.HasSpace(max_bytes)) {
+        tw.Grow(EstimateNumTokens(cinfo, mcu_y0[i], sti->MCU_rows_in_scan,
+                                  tw.Offset(), max_bytes));
       }
     }
+    scans.push_back(i);
   }
+  std::vector<int> refined_comps;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (m->refinement_coeffs[c].buffer != nullptr) {
+      refined_comps.push_back(c);
+    }
+  }
+  const auto tokenize = [&](const uint32_t task, size_t /*thread*/) {
+    if (task >= scans.size()) {
+      StoreRefinementCoeffs(cinfo, refined_comps[task - scans.size()]);
+      return;
+    }
+    const uint32_t i = scans[task];
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    ScanTokenizerState* st = &m->scan_tokenizer_state[i];
+    const int context = m->ac_ctx_offset[i];
+    ScanTokenArrayWriter tw(cinfo, st);
+    if (si->Ss > 0) {
+      TokenizeACProgressiveRows(cinfo, i, context, sti, st, mcu_y0[i],
+                                mcu_y1[i], &tw, st->coeff_nonzeros);
+      if (last_row) FinishACProgressiveScan(context, sti, st, &tw);
+    } else {
+      TokenizeScanRows(cinfo, i, context, sti, st, mcu_y0[i], mcu_y1[i], &tw);
+      if (last_row) FinishScanTokens(si, sti, st, &tw);
+    }
+  };
+  RunParallel(cinfo, scans.size() + refined_comps.size(), tokenize,
+              "TokenizeiMCURow");
 }
 
-struct JpegClusteredHistograms {
-  std::vector<Histogram> histograms;
-  std::vector<uint32_t> histogram_indexes;
-  std::vector<uint32_t> slot_ids;
-};
+void TokenizeJpeg(j_compress_ptr cinfo) {
+  if (cinfo->master->streaming_tokenization) {
+    FinishStreamingTokenization(cinfo);
+    return;
+  }
+  AllocateRefinementBuffers(cinfo);
+  if (cinfo->master->runner != nullptr && cinfo->num_scans > 1) {
+    TokenizeJpegInParallel(cinfo);
+  } else {
+    TokenizeJpegSequential(cinfo);
+  }
+}
 
 float HistogramCost(const Histogram& histo) {
   std::vector<uint32_t> counts(kJpegHuffmanAlphabetSize + 1);
@@ -568,6 +1076,87 @@ float HistogramCost(const Histogram& histo) {
   return header_bits + data_bits;
 }
 
+void ACScanSymbols::FlushEOBRun() {
+  int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run);
+  ++histo.count[nbits << 4];
+  extra_bits += nbits;
+  eob_run = 0;
+}
+
+void ACScanSymbols::AddBlock(const JCOEF* block) {
+  const bool refinement = Ah > 0;
+  int r = 0;
+  bool pending_refbits = false;
+  for (int k = Ss; k <= Se; ++k) {
+    const int absval = std::abs(static_cast<int>(block[k])) >> Al;
+    if (absval == 0) {
+      ++r;
+      continue;
+    }
+    if (refinement && absval > 1) {
+      // Correction bit of a coefficient that was already nonzero.
+      ++extra_bits;
+      pending_refbits = true;
+      continue;
+    }
+    if (eob_run > 0) FlushEOBRun();
+    for (; r > 15; r -= 16) ++histo.count[0xf0];
+    const int nbits =
+        refinement ? 1 : jxl::FloorLog2Nonzero<uint32_t>(absval) + 1;
+    ++histo.count[(r << 4) + nbits];
+    extra_bits += nbits;
+    r = 0;
+    pending_refbits = false;
+  }
+  if (r > 0 || pending_refbits) {
+    if (++eob_run == 0x7FFF || !eob_runs) FlushEOBRun();
+  }
+}
+
+float ACScanSymbols::Cost() {
+  if (eob_run > 0) FlushEOBRun();
+  return HistogramCost(histo) + extra_bits;
+}
+
+namespace {
+
+void BuildHistograms(j_compress_ptr cinfo, Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  size_t num_token_arrays = m->cur_token_array + 1;
+  size_t num_tokens = 0;
+  size_t num_bytes = 0;
+  for (size_t i = 0; i < num_token_arrays; ++i) {
+    const uint8_t* pos = m->token_arrays[i].tokens;
+    const uint8_t* end = pos + m->token_arrays[i].size;
+    while (pos < end) {
+      Token t = ReadToken(&pos);
+      ++histograms[t.context].count[t.symbol];
+      ++num_tokens;
+    }
+    num_bytes += m->token_arrays[i].size;
+  }
+  JPEGLI_TRACE(1, "%" PRIuS " tokens in %" PRIuS " bytes, %.3f bytes/token",
+               num_tokens, num_bytes,
+               num_bytes / std::max<double>(1.0, num_tokens));
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info& si = cinfo->scan_info[i];
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    if (si.Ss > 0 && si.Ah > 0) {
+      int context = m->ac_ctx_offset[i];
+      int* ac_histo = &histograms[context].count[0];
+      for (size_t j = 0; j < sti.tokens_size; ++j) {
+        ++ac_histo[sti.tokens[j].symbol & 253];
+      }
+    }
+  }
+}
+
+struct JpegClusteredHistograms {
+  std::vector<Histogram> histograms;
+  std::vector<uint32_t> histogram_indexes;
+  std::vector<uint32_t> slot_ids;
+};
+
 void AddHistograms(const Histogram& a, const Histogram& b, Histogram* c) {
   for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
     c->count[i] = a.count[i] + b.count[i];
@@ -581,8 +1170,12 @@ bool IsEmptyHistogram(const Histogram& histo) {
   return true;
 }
 
-void ClusterJpegHistograms(j_compress_ptr cinfo, const Histogram* histograms,
-                           size_t num, JpegClusteredHistograms* clusters) {
+// Assigns each histogram in order to the live Huffman table slot where it adds
+// the fewest bits, or to a new table if that is cheaper. If all four slots are
+// taken, the new table replaces the slots in round-robin order.
+void GreedyClusterJpegHistograms(j_compress_ptr cinfo,
+                                 const Histogram* histograms, size_t num,
+                                 JpegClusteredHistograms* clusters) {
   clusters->histogram_indexes.resize(num);
   std::vector<uint32_t> slot_histograms;
   std::vector<float> slot_costs;
@@ -624,7 +1217,6 @@ void ClusterJpegHistograms(j_compress_ptr cinfo, const Histogram* histograms,
         slot_histograms.push_back(histogram_index);
         slot_costs.push_back(best_cost);
       } else {
-        // TODO(szabadka) Find the best histogram to replce.
         best_slot = (clusters->slot_ids.back() + 1) % 4;
       }
       slot_histograms[best_slot] = histogram_index;
@@ -642,6 +1234,166 @@ void ClusterJpegHistograms(j_compress_ptr cinfo, const Histogram* histograms,
   }
 }
 
+// Size of the DHT marker header that precedes each Huffman table that is
+// emitted after the first scan.
+constexpr float kDHTMarkerBits = 32;
+
+// Clusters of histograms are only optimized beyond the greedy clustering if
+// there are at most this many non-empty histograms, which keeps the number of
+// HistogramCost() evaluations small.
+constexpr size_t kMaxHistogramsToOptimize = 32;
+
+// Returns the total number of bits of the Huffman coded symbols, the Huffman
+// tables and the DHT markers of the Huffman tables that are emitted after the
+// first scan. Only the first four tables are emitted before the first scan.
+float ClusteringCost(const JpegClusteredHistograms& clusters) {
+  float cost = 0;
+  for (const Histogram& histo : clusters.histograms) {
+    cost += HistogramCost(histo);
+  }
+  if (clusters.histograms.size() > 4) {
+    cost += kDHTMarkerBits * (clusters.histograms.size() - 4);
+  }
+  return cost;
+}
+
+// Computes the slot ids of the clusters, which must be ordered by their first
+// histogram index. The first four clusters are emitted before the first scan,
+// every later cluster is emitted right before its first use and must replace a
+// slot whose cluster is no longer used. Returns false if there is no such slot
+// for one of the clusters.
+bool AssignHuffmanSlots(const std::vector<size_t>& first,
+                        const std::vector<size_t>& last,
+                        std::vector<uint32_t>* slot_ids) {
+  size_t slot_last[4];
+  slot_ids->resize(first.size());
+  for (size_t k = 0; k < first.size(); ++k) {
+    size_t slot = k;
+    if (k >= 4) {
+      slot = 4;
+      for (size_t j = 0; j < 4; ++j) {
+        if (slot_last[j] < first[k]) {
+          slot = j;
+          break;
+        }
+      }
+      if (slot == 4) return false;
+    }
+    slot_last[slot] = last[k];
+    (*slot_ids)[k] = slot;
+  }
+  return true;
+}
+
+// Agglomerative clustering: starting with one cluster per non-empty histogram,
+// repeatedly merges the pair of clusters with the largest decrease of the
+// total cost, until no merge decreases it. Further merges with the smallest
+// cost increase are made while the clusters can not be assigned to Huffman
+// table slots, or there are more than two of them in baseline mode. Returns
+// false if there are too many histograms to optimize.
+bool MergeJpegHistograms(j_compress_ptr cinfo, const Histogram* histograms,
+                         size_t num, JpegClusteredHistograms* clusters) {
+  const bool force_baseline =
+      !cinfo->progressive_mode && cinfo->master->force_baseline;
+  std::vector<Histogram> histos;
+  std::vector<float> costs;
+  std::vector<size_t> first;
+  std::vector<size_t> last;
+  std::vector<std::vector<size_t>> members;
+  for (size_t i = 0; i < num; ++i) {
+    if (IsEmptyHistogram(histograms[i])) continue;
+    if (histos.size() == kMaxHistogramsToOptimize) return false;
+    histos.push_back(histograms[i]);
+    costs.push_back(HistogramCost(histograms[i]));
+    first.push_back(i);
+    last.push_back(i);
+    members.push_back({i});
+  }
+  const size_t n = histos.size();
+  // Cost of the merged histograms of each pair of clusters, or -1 if it is not
+  // computed yet.
+  std::vector<float> merged_costs(n * n, -1.0f);
+  std::vector<bool> alive(n, true);
+  size_t num_alive = n;
+  const auto feasible = [&]() {
+    std::vector<size_t> alive_first;
+    std::vector<size_t> alive_last;
+    for (size_t a = 0; a < n; ++a) {
+      if (!alive[a]) continue;
+      alive_first.push_back(first[a]);
+      alive_last.push_back(last[a]);
+    }
+    // The clusters are ordered by their first histogram index, since merging
+    // always keeps the cluster with the smaller index.
+    std::vector<uint32_t> slot_ids;
+    return AssignHuffmanSlots(alive_first, alive_last, &slot_ids);
+  };
+  while (num_alive > 1) {
+    size_t best_a = 0;
+    size_t best_b = 0;
+    float best_gain = std::numeric_limits<float>::lowest();
+    for (size_t a = 0; a < n; ++a) {
+      if (!alive[a]) continue;
+      for (size_t b = a + 1; b < n; ++b) {
+        if (!alive[b]) continue;
+        float& merged_cost = merged_costs[a * n + b];
+        if (merged_cost < 0) {
+          Histogram combined;
+          AddHistograms(histos[a], histos[b], &combined);
+          merged_cost = HistogramCost(combined);
+        }
+        float gain = costs[a] + costs[b] - merged_cost;
+        if (num_alive > 4) gain += kDHTMarkerBits;
+        if (gain > best_gain) {
+          best_gain = gain;
+          best_a = a;
+          best_b = b;
+        }
+      }
+    }
+    if (best_gain <= 0 && !(force_baseline && num_alive > 2) && feasible()) {
+      break;
+    }
+    AddHistograms(histos[best_a], histos[best_b], &histos[best_a]);
+    costs[best_a] = merged_costs[best_a * n + best_b];
+    last[best_a] = std::max(last[best_a], last[best_b]);
+    members[best_a].insert(members[best_a].end(), members[best_b].begin(),
+                           members[best_b].end());
+    alive[best_b] = false;
+    --num_alive;
+    for (size_t c = 0; c < n; ++c) {
+      merged_costs[std::min(c, best_a) * n + std::max(c, best_a)] = -1.0f;
+    }
+  }
+  clusters->histograms.clear();
+  clusters->histogram_indexes.assign(num, 0);
+  std::vector<size_t> cluster_first;
+  std::vector<size_t> cluster_last;
+  for (size_t a = 0; a < n; ++a) {
+    if (!alive[a]) continue;
+    for (size_t i : members[a]) {
+      clusters->histogram_indexes[i] = clusters->histograms.size();
+    }
+    clusters->histograms.push_back(histos[a]);
+    cluster_first.push_back(first[a]);
+    cluster_last.push_back(last[a]);
+  }
+  return AssignHuffmanSlots(cluster_first, cluster_last, &clusters->slot_ids);
+}
+
+// Clusters the histograms into Huffman tables, using the cheaper of the greedy
+// and the agglomerative clustering.
+void ClusterJpegHistograms(j_compress_ptr cinfo, const Histogram* histograms,
+                           size_t num, JpegClusteredHistograms* clusters) {
+  GreedyClusterJpegHistograms(cinfo, histograms, num, clusters);
+  if (cinfo->master->greedy_histogram_clustering) return;
+  JpegClusteredHistograms merged;
+  if (MergeJpegHistograms(cinfo, histograms, num, &merged) &&
+      ClusteringCost(merged) < ClusteringCost(*clusters)) {
+    *clusters = std::move(merged);
+  }
+}
+
 void CopyHuffmanTable(j_compress_ptr cinfo, int index, bool is_dc,
                       int* inv_slot_map, uint8_t* slot_id_map,
                       JHUFF_TBL* huffman_tables, size_t* num_huffman_tables) {
@@ -779,25 +1531,6 @@ void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
 
 namespace {
 
-constexpr uint8_t kNumExtraBits[256] = {
-    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    1,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    2,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    3,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    4,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    5,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    6,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    7,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    8,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    9,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    10, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    11, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    12, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    13, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    14, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-};
-
 void BuildHuffmanCodeTable(const JHUFF_TBL& table, HuffmanCodeTable* code) {
   int huff_code[kJpegHuffmanAlphabetSize];
   // +1 for a sentinel element.
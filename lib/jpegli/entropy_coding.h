@@ -8,18 +8,73 @@
 #define LIB_JPEGLI_ENTROPY_CODING_H_
 
 #include <cstddef>
+#include <cstring>
 
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 
 namespace jpegli {
 
+struct Histogram {
+  int count[kJpegHuffmanAlphabetSize];
+  Histogram() { memset(count, 0, sizeof(count)); }
+};
+
 size_t MaxNumTokensPerMCURow(j_compress_ptr cinfo);
 
+// Returns the capacity of the next token array, given the size of the tokens
+// of the first mcu_y MCU rows and the maximum token size of one MCU row.
 size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
-                         size_t num_tokens, size_t max_per_row);
+                         size_t num_token_bytes, size_t max_per_row);
+
+// Computes the coefficient range and the point transform of the AC
+// refinement scans of each component, and returns false if the refinement
+// coefficients do not fit into 8 bits, see RefinementCoeffs.
+bool InitRefinementCoeffs(j_compress_ptr cinfo);
+
+// Sets up the tokenization of the scans while the input is read. Must be
+// called after InitRefinementCoeffs() and AllocateTokenArrays().
+void InitStreamingTokenization(j_compress_ptr cinfo);
+
+// Tokenizes the current iMCU row of the coefficient buffers for all scans
+// except the AC refinement scans, and stores the coefficients needed by the
+// AC refinement scans.
+void TokenizeiMCURow(j_compress_ptr cinfo);
 
 void TokenizeJpeg(j_compress_ptr cinfo);
 
+// Returns the number of bits needed to encode the symbols of the histogram
+// with an optimal Huffman code, including the size of the DHT segment data.
+float HistogramCost(const Histogram& histo);
+
+// Collects the Huffman symbols and the extra bits of the AC coefficients
+// Ss..Se of the blocks of one component in a scan with successive
+// approximation parameters Ah and Al, without emitting any tokens. If
+// eob_runs is false, every block ends with its own EOB symbol, as in
+// sequential scans.
+struct ACScanSymbols {
+  ACScanSymbols(int comp, int Ss, int Se, int Ah, int Al, bool eob_runs)
+      : comp(comp), Ss(Ss), Se(Se), Ah(Ah), Al(Al), eob_runs(eob_runs) {}
+
+  void AddBlock(const JCOEF* block);
+  // Returns the number of bits of the scan data and of the DHT segment data of
+  // its optimal Huffman code. Must be called after the last AddBlock().
+  float Cost();
+
+  int comp;
+  int Ss;
+  int Se;
+  int Ah;
+  int Al;
+  bool eob_runs;
+  Histogram histo;
+  size_t extra_bits = 0;
+  int eob_run = 0;
+
+ private:
+  void FlushEOBRun();
+};
+
 void CopyHuffmanTables(j_compress_ptr cinfo);
 
 void OptimizeHuffmanCodes(j_compress_ptr cinfo);
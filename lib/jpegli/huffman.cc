@@ -110,6 +110,38 @@ void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
   }
 }
 
+void BuildJpegHuffmanFastTable(const HuffmanTableEntry* lut,
+                               HuffmanFastEntry* fast_lut) {
+  constexpr int kRootShift = kJpegHuffmanFastBits - kJpegHuffmanRootTableBits;
+  for (int key = 0; key < kJpegHuffmanFastSize; ++key) {
+    HuffmanFastEntry& entry = fast_lut[key];
+    entry.bits = 0;
+    entry.symbol = 0;
+    entry.value = 0;
+    const HuffmanTableEntry* table = &lut[key >> kRootShift];
+    int len = table->bits;
+    if (len > kJpegHuffmanRootTableBits) {
+      if (len > kJpegHuffmanFastBits) continue;
+      int nbits = len - kJpegHuffmanRootTableBits;
+      table += table->value;
+      table += (key >> (kJpegHuffmanFastBits - len)) & ((1 << nbits) - 1);
+      len = kJpegHuffmanRootTableBits + table->bits;
+    }
+    int symbol = table->value;
+    int s = symbol & 15;
+    if (len == 0 || symbol >= kJpegHuffmanAlphabetSize || s == 0 ||
+        len + s > kJpegHuffmanFastBits) {
+      continue;
+    }
+    int extra = (key >> (kJpegHuffmanFastBits - len - s)) & ((1 << s) - 1);
+    // Sign extension as in Table F.1 of the JPEG specification.
+    int value = extra >= (1 << (s - 1)) ? extra : extra - (1 << s) + 1;
+    entry.bits = len + s;
+    entry.symbol = symbol;
+    entry.value = value;
+  }
+}
+
 // A node of a Huffman tree.
 struct HuffmanTree {
   HuffmanTree(uint32_t count, int16_t left, int16_t right)
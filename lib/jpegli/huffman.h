@@ -37,6 +37,25 @@ struct HuffmanTableEntry {
 void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
                            HuffmanTableEntry* lut);
 
+// Number of bits looked at by the fast AC decoding table.
+constexpr int kJpegHuffmanFastBits = 10;
+constexpr int kJpegHuffmanFastSize = 1 << kJpegHuffmanFastBits;
+
+// Entry of the fast AC decoding table, which resolves the Huffman code of a
+// non-zero AC symbol together with its extra bits in a single lookup.
+struct HuffmanFastEntry {
+  uint8_t bits;    // code length plus extra bits, or 0 if not resolvable
+  uint8_t symbol;  // run length and size category of the coefficient
+  int16_t value;   // sign-extended coefficient value
+};
+
+// Builds the fast AC decoding table from the Huffman lookup table lut, which
+// was built by BuildJpegHuffmanTable(). Entries where the code is an EOB, ZRL,
+// invalid symbol, or where code length plus extra bits exceed
+// kJpegHuffmanFastBits, are marked with bits = 0.
+void BuildJpegHuffmanFastTable(const HuffmanTableEntry* lut,
+                               HuffmanFastEntry* fast_lut);
+
 // This function will create a Huffman tree.
 //
 // The (data,length) contains the population counts.
@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include "lib/base/compiler_specific.h"
 #include "lib/base/status.h"
@@ -190,18 +191,306 @@ void ComputeScaledIDCT(float* JXL_RESTRICT block0, float* JXL_RESTRICT block1,
   IDCT1D<8>(block1, output, output_stride);
 }
 
+// Computes the 8-point IDCT of from[], where only the first kNumIn (2 or 4)
+// input rows can be nonzero. This performs the same arithmetic as
+// IDCT1DImpl<8> with the operations on known zero values left out, so the
+// result is identical.
+template <size_t kNumIn>
+void IDCT1DSparse(const float* JXL_RESTRICT from, size_t from_stride,
+                  float* JXL_RESTRICT to, size_t to_stride) {
+  static_assert(kNumIn == 2 || kNumIn == 4, "kNumIn must be 2 or 4");
+  constexpr float kSqrt2 = 1.41421356237f;
+  const auto sqrt2 = Set(d8, kSqrt2);
+  const auto w40 = Set(d8, WcMultipliers<4>::kMultipliers[0]);
+  const auto w41 = Set(d8, WcMultipliers<4>::kMultipliers[1]);
+  const auto x0 = LoadU(d8, from);
+  const auto x1 = LoadU(d8, from + from_stride);
+  // Even part, the 4-point IDCT of (x0, x2, 0, 0).
+  auto e0 = x0;
+  auto e1 = x0;
+  auto e2 = x0;
+  auto e3 = x0;
+  // Odd part, the 4-point IDCT of (sqrt2 * x1, x1 + x3, x3, 0).
+  const auto p0 = Mul(x1, sqrt2);
+  auto p1 = x1;
+  auto p02_sum = p0;
+  auto p02_diff = p0;
+  if (kNumIn == 4) {
+    const auto x2 = LoadU(d8, from + 2 * from_stride);
+    const auto x3 = LoadU(d8, from + 3 * from_stride);
+    const auto x2s = Mul(x2, sqrt2);
+    const auto s = Add(x2s, x2);
+    const auto t = Sub(x2s, x2);
+    e0 = MulAdd(w40, s, x0);
+    e3 = NegMulAdd(w40, s, x0);
+    e1 = MulAdd(w41, t, x0);
+    e2 = NegMulAdd(w41, t, x0);
+    p1 = Add(x3, x1);
+    p02_sum = Add(p0, x3);
+    p02_diff = Sub(p0, x3);
+  }
+  const auto p1s = Mul(p1, sqrt2);
+  const auto ps = Add(p1s, p1);
+  const auto pt = Sub(p1s, p1);
+  const auto q0 = MulAdd(w40, ps, p02_sum);
+  const auto q3 = NegMulAdd(w40, ps, p02_sum);
+  const auto q1 = MulAdd(w41, pt, p02_diff);
+  const auto q2 = NegMulAdd(w41, pt, p02_diff);
+  const auto w80 = Set(d8, WcMultipliers<8>::kMultipliers[0]);
+  const auto w81 = Set(d8, WcMultipliers<8>::kMultipliers[1]);
+  const auto w82 = Set(d8, WcMultipliers<8>::kMultipliers[2]);
+  const auto w83 = Set(d8, WcMultipliers<8>::kMultipliers[3]);
+  StoreU(MulAdd(w80, q0, e0), d8, to);
+  StoreU(MulAdd(w81, q1, e1), d8, to + to_stride);
+  StoreU(MulAdd(w82, q2, e2), d8, to + 2 * to_stride);
+  StoreU(MulAdd(w83, q3, e3), d8, to + 3 * to_stride);
+  StoreU(NegMulAdd(w83, q3, e3), d8, to + 4 * to_stride);
+  StoreU(NegMulAdd(w82, q2, e2), d8, to + 5 * to_stride);
+  StoreU(NegMulAdd(w81, q1, e1), d8, to + 6 * to_stride);
+  StoreU(NegMulAdd(w80, q0, e0), d8, to + 7 * to_stride);
+}
+
+// Returns the side length (1, 2, 4 or 8) of the smallest top-left square of
+// the quantized block that contains all of its nonzero coefficients.
+size_t NonzeroExtent(const int16_t* JXL_RESTRICT qblock) {
+  // Each row of 8 coefficients is looked at as two 64-bit words, the first
+  // one holding columns 0..3 and the second one columns 4..7.
+  uint64_t left[DCTSIZE];
+  uint64_t right[DCTSIZE];
+  for (size_t k = 0; k < DCTSIZE; ++k) {
+    memcpy(&left[k], qblock + k * DCTSIZE, sizeof(left[k]));
+    memcpy(&right[k], qblock + k * DCTSIZE + 4, sizeof(right[k]));
+  }
+  uint64_t outside4 = 0;
+  for (size_t k = 0; k < DCTSIZE; ++k) {
+    outside4 |= right[k];
+  }
+  for (size_t k = 4; k < DCTSIZE; ++k) {
+    outside4 |= left[k];
+  }
+  if (outside4 != 0) return 8;
+  uint32_t cols23[2];
+  memcpy(&cols23[0], qblock + 2, sizeof(cols23[0]));
+  memcpy(&cols23[1], qblock + DCTSIZE + 2, sizeof(cols23[1]));
+  if ((left[2] | left[3]) != 0 || (cols23[0] | cols23[1]) != 0) return 4;
+  if ((qblock[1] | qblock[DCTSIZE] | qblock[DCTSIZE + 1]) != 0) return 2;
+  return 1;
+}
+
+// Dequantizes the block and computes its 8x8 IDCT, with fast paths for blocks
+// where only the DC or only the top-left 2x2 or 4x4 coefficients are nonzero,
+// which are common among the chroma blocks of typical images. The output is
+// the same as that of DequantBlock() followed by ComputeScaledIDCT().
+void DequantAndComputeIDCT(const int16_t* JXL_RESTRICT qblock,
+                           const float* JXL_RESTRICT dequant,
+                           const float* JXL_RESTRICT biases,
+                           float* JXL_RESTRICT scratch_space,
+                           float* JXL_RESTRICT output, size_t output_stride) {
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  const size_t extent = NonzeroExtent(qblock);
+  if (extent == 1) {
+    // Same as DequantBlock() for the DC coefficient.
+    const float quant = qblock[0];
+    const float bias = quant < 0 ? -biases[0] : biases[0];
+    const auto dc = Set(d8, quant == 0 ? 0.0f : (quant - bias) * dequant[0]);
+    for (size_t iy = 0; iy < DCTSIZE; ++iy) {
+      for (size_t ix = 0; ix < DCTSIZE; ix += Lanes(d8)) {
+        StoreU(dc, d8, output + iy * output_stride + ix);
+      }
+    }
+    return;
+  }
+  DequantBlock(qblock, dequant, biases, block0);
+  if (extent == 8) {
+    ComputeScaledIDCT(block0, block1, output, output_stride);
+    return;
+  }
+  // The rows of the transposed first pass output that correspond to the
+  // zero rows of the input are not computed, since the second pass does not
+  // read them.
+  Transpose8x8Block(block0, block1);
+  for (size_t i = 0; i < extent; i += Lanes(d8)) {
+    if (extent == 2) {
+      IDCT1DSparse<2>(block1 + i, 8, block0 + i, 8);
+    } else {
+      IDCT1DSparse<4>(block1 + i, 8, block0 + i, 8);
+    }
+  }
+  Transpose8x8Block(block0, block1);
+  for (size_t i = 0; i < 8; i += Lanes(d8)) {
+    if (extent == 2) {
+      IDCT1DSparse<2>(block1 + i, 8, output + i, output_stride);
+    } else {
+      IDCT1DSparse<4>(block1 + i, 8, output + i, output_stride);
+    }
+  }
+}
+
 void InverseTransformBlock8x8(const int16_t* JXL_RESTRICT qblock,
                               const float* JXL_RESTRICT dequant,
                               const float* JXL_RESTRICT biases,
                               float* JXL_RESTRICT scratch_space,
                               float* JXL_RESTRICT output, size_t output_stride,
                               size_t dctsize) {
+  DequantAndComputeIDCT(qblock, dequant, biases, scratch_space, output,
+                        output_stride);
+}
+
+// Same as InverseTransformBlock8x8(), but always computes the full transform.
+void InverseTransformBlock8x8Full(const int16_t* JXL_RESTRICT qblock,
+                                  const float* JXL_RESTRICT dequant,
+                                  const float* JXL_RESTRICT biases,
+                                  float* JXL_RESTRICT scratch_space,
+                                  float* JXL_RESTRICT output,
+                                  size_t output_stride, size_t dctsize) {
   float* JXL_RESTRICT block0 = scratch_space;
   float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
   DequantBlock(qblock, dequant, biases, block0);
   ComputeScaledIDCT(block0, block1, output, output_stride);
 }
 
+// The scaled 1x1 output is the DC coefficient, which has no dequantization
+// bias, so this gives the same result as DequantBlock() without having to
+// dequantize the other coefficients.
+void InverseTransformBlock1x1(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  *output = qblock[0] * dequant[0];
+}
+
+// The 4x4 and 2x2 scaled outputs are the averages of the 2x2 and 4x4 boxes of
+// the 8x8 IDCT output. The box sums are computed with deinterleaving loads, in
+// the same order as the scalar sum block[0] + block[1] + block[8] + ..., so
+// that the result does not depend on the vector width.
+void InverseTransformBlock4x4(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
+  DequantAndComputeIDCT(qblock, dequant, biases, scratch_space, block2, 8);
+  const HWY_CAPPED(float, 4) d4;
+  const auto mul = Set(d4, 0.25f);
+  for (size_t iy = 0; iy < 4; ++iy) {
+    const float* row0 = &block2[16 * iy];
+    const float* row1 = row0 + DCTSIZE;
+    for (size_t ix = 0; ix < 4; ix += Lanes(d4)) {
+      Vec<decltype(d4)> e0, o0, e1, o1;
+      LoadInterleaved2(d4, row0 + 2 * ix, e0, o0);
+      LoadInterleaved2(d4, row1 + 2 * ix, e1, o1);
+      const auto sum = Add(Add(Add(e0, o0), e1), o1);
+      StoreU(Mul(mul, sum), d4, output + iy * output_stride + ix);
+    }
+  }
+}
+
+void InverseTransformBlock2x2(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
+  DequantAndComputeIDCT(qblock, dequant, biases, scratch_space, block2, 8);
+  const HWY_CAPPED(float, 2) d2;
+  const auto mul = Set(d2, 0.0625f);
+  for (size_t iy = 0; iy < 2; ++iy) {
+    for (size_t ix = 0; ix < 2; ix += Lanes(d2)) {
+      Vec<decltype(d2)> v0, v1, v2, v3;
+      LoadInterleaved4(d2, &block2[32 * iy + 4 * ix], v0, v1, v2, v3);
+      auto sum = Add(Add(Add(v0, v1), v2), v3);
+      for (size_t j = 1; j < 4; ++j) {
+        LoadInterleaved4(d2, &block2[32 * iy + 8 * j + 4 * ix], v0, v1, v2,
+                         v3);
+        sum = Add(Add(Add(Add(sum, v0), v1), v2), v3);
+      }
+      StoreU(Mul(mul, sum), d2, output + iy * output_stride + ix);
+    }
+  }
+}
+
+constexpr float kIDCT16Multipliers[16] = {
+    1.414213562373, 1.407403737526, 1.387039845322, 1.353318001174,
+    1.306562964876, 1.247225012987, 1.175875602419, 1.093201867002,
+    1.000000000000, 0.897167586343, 0.785694958387, 0.666655658478,
+    0.541196100146, 0.410524527522, 0.275899379283, 0.138617169199,
+};
+
+// Indexes into kIDCT16Multipliers of the multipliers of the even (in[2],
+// in[4], in[6]) and odd (in[1], in[3], in[5], in[7]) inputs for the first
+// eight outputs of the 16-point IDCT, negative indexes mean negated
+// multipliers.
+constexpr int kIDCT16Even[8][3] = {
+    {2, 4, 6},     {6, 12, -14},  {10, -12, -2}, {14, -4, -10},
+    {-14, -4, 10}, {-10, -12, 2}, {-6, 12, 14},  {-2, 4, -6},
+};
+constexpr int kIDCT16Odd[8][4] = {
+    {1, 3, 5, 7},    {3, 9, 15, -11}, {5, 15, -7, -3}, {7, -11, -3, 15},
+    {9, -5, -13, 1}, {11, -1, 9, 13}, {13, -7, 1, -5}, {15, -13, 11, -9},
+};
+
+HWY_INLINE float IDCT16Multiplier(int idx) {
+  return idx < 0 ? -kIDCT16Multipliers[-idx] : kIDCT16Multipliers[idx];
+}
+
+// Computes the 16-point IDCT of the 8 input rows of from[], where the
+// remaining 8 inputs are assumed to be 0, and stores the 16 output rows in
+// to[].
+void IDCT1D16(const float* JXL_RESTRICT from, size_t from_stride,
+              float* JXL_RESTRICT to, size_t to_stride) {
+  const auto in0 = LoadU(d8, from);
+  const auto in1 = LoadU(d8, from + 1 * from_stride);
+  const auto in2 = LoadU(d8, from + 2 * from_stride);
+  const auto in3 = LoadU(d8, from + 3 * from_stride);
+  const auto in4 = LoadU(d8, from + 4 * from_stride);
+  const auto in5 = LoadU(d8, from + 5 * from_stride);
+  const auto in6 = LoadU(d8, from + 6 * from_stride);
+  const auto in7 = LoadU(d8, from + 7 * from_stride);
+  for (size_t i = 0; i < 8; ++i) {
+    const int* me = kIDCT16Even[i];
+    const int* mo = kIDCT16Odd[i];
+    auto even = MulAdd(Set(d8, IDCT16Multiplier(me[0])), in2, in0);
+    even = MulAdd(Set(d8, IDCT16Multiplier(me[1])), in4, even);
+    even = MulAdd(Set(d8, IDCT16Multiplier(me[2])), in6, even);
+    auto odd = Mul(Set(d8, IDCT16Multiplier(mo[0])), in1);
+    odd = MulAdd(Set(d8, IDCT16Multiplier(mo[1])), in3, odd);
+    odd = MulAdd(Set(d8, IDCT16Multiplier(mo[2])), in5, odd);
+    odd = MulAdd(Set(d8, IDCT16Multiplier(mo[3])), in7, odd);
+    StoreU(Add(even, odd), d8, to + i * to_stride);
+    StoreU(Sub(even, odd), d8, to + (15 - i) * to_stride);
+  }
+}
+
+void InverseTransformBlock16x16(const int16_t* JXL_RESTRICT qblock,
+                                const float* JXL_RESTRICT dequant,
+                                const float* JXL_RESTRICT biases,
+                                float* JXL_RESTRICT scratch_space,
+                                float* JXL_RESTRICT output,
+                                size_t output_stride, size_t dctsize) {
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
+  DequantBlock(qblock, dequant, biases, block0);
+  // Horizontal pass on the transposed coefficients, the result is the 16x8
+  // transpose of the horizontally transformed coefficient rows.
+  Transpose8x8Block(block0, block1);
+  for (size_t i = 0; i < 8; i += Lanes(d8)) {
+    IDCT1D16(block1 + i, 8, block2 + i, 8);
+  }
+  // Vertical pass on the left and right halves of the output.
+  Transpose8x8Block(block2, block0);
+  Transpose8x8Block(block2 + DCTSIZE2, block1);
+  for (size_t i = 0; i < 8; i += Lanes(d8)) {
+    IDCT1D16(block0 + i, 8, output + i, output_stride);
+    IDCT1D16(block1 + i, 8, output + 8 + i, output_stride);
+  }
+}
+
 // Computes the N-point IDCT of in[], and stores the result in out[]. The in[]
 // array is at most 8 values long, values in[8:N-1] are assumed to be 0.
 void Compute1dIDCT(const float* in, float* out, size_t N) {
@@ -621,6 +910,9 @@ void Compute1dIDCT(const float* in, float* out, size_t N) {
   }
 }
 
+// Scalar inverse transform for any output size. The sizes that have their own
+// transform above also go through here when the decoder is asked for the
+// generic transform, which serves as the reference of the vectorized ones.
 void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
                                   const float* JXL_RESTRICT dequant,
                                   const float* JXL_RESTRICT biases,
@@ -632,7 +924,10 @@ void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
   DequantBlock(qblock, dequant, biases, block0);
   if (dctsize == 1) {
     *output = *block0;
-  } else if (dctsize == 2 || dctsize == 4) {
+    return;
+  }
+  if (dctsize == 2 || dctsize == 4) {
+    // Box averages of the 8x8 IDCT output.
     float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
     ComputeScaledIDCT(block0, block1, block2, 8);
     if (dctsize == 4) {
@@ -655,24 +950,24 @@ void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
         }
       }
     }
-  } else {
-    float dctin[DCTSIZE];
-    float dctout[DCTSIZE * 2];
-    size_t insize = std::min<size_t>(dctsize, DCTSIZE);
-    for (size_t ix = 0; ix < insize; ++ix) {
-      for (size_t iy = 0; iy < insize; ++iy) {
-        dctin[iy] = block0[iy * DCTSIZE + ix];
-      }
-      Compute1dIDCT(dctin, dctout, dctsize);
-      for (size_t iy = 0; iy < dctsize; ++iy) {
-        block1[iy * dctsize + ix] = dctout[iy];
-      }
+    return;
+  }
+  float dctin[DCTSIZE];
+  float dctout[DCTSIZE * 2];
+  size_t insize = std::min<size_t>(dctsize, DCTSIZE);
+  for (size_t ix = 0; ix < insize; ++ix) {
+    for (size_t iy = 0; iy < insize; ++iy) {
+      dctin[iy] = block0[iy * DCTSIZE + ix];
     }
+    Compute1dIDCT(dctin, dctout, dctsize);
     for (size_t iy = 0; iy < dctsize; ++iy) {
-      Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride,
-                    dctsize);
+      block1[iy * dctsize + ix] = dctout[iy];
     }
   }
+  for (size_t iy = 0; iy < dctsize; ++iy) {
+    Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride,
+                  dctsize);
+  }
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -684,6 +979,11 @@ HWY_AFTER_NAMESPACE();
 namespace jpegli {
 
 HWY_EXPORT(InverseTransformBlock8x8);
+HWY_EXPORT(InverseTransformBlock8x8Full);
+HWY_EXPORT(InverseTransformBlock1x1);
+HWY_EXPORT(InverseTransformBlock2x2);
+HWY_EXPORT(InverseTransformBlock4x4);
+HWY_EXPORT(InverseTransformBlock16x16);
 HWY_EXPORT(InverseTransformBlockGeneric);
 
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
@@ -693,8 +993,23 @@ jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
     if (dct_size < 1 || dct_size > 16) {
       return JXL_FAILURE("Compute1dIDCT does not support N=%d", dct_size);
     }
-    if (dct_size == DCTSIZE) {
+    if (dct_size != DCTSIZE && m->use_generic_idct) {
+      m->inverse_transform[c] =
+          HWY_DYNAMIC_DISPATCH(InverseTransformBlockGeneric);
+    } else if (dct_size == DCTSIZE && m->disable_sparse_idct) {
+      m->inverse_transform[c] =
+          HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8Full);
+    } else if (dct_size == DCTSIZE) {
       m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8);
+    } else if (dct_size == 1) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock1x1);
+    } else if (dct_size == 2) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock2x2);
+    } else if (dct_size == 4) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock4x4);
+    } else if (dct_size == 2 * DCTSIZE) {
+      m->inverse_transform[c] =
+          HWY_DYNAMIC_DISPATCH(InverseTransformBlock16x16);
     } else {
       m->inverse_transform[c] =
           HWY_DYNAMIC_DISPATCH(InverseTransformBlockGeneric);
@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <cstring>
 #include <ostream>
+#include <random>
 #include <sstream>
 #include <string>
 #include <utility>
@@ -502,6 +503,77 @@ TEST_P(InputSuspensionTestParam, PreConsumeInputNonBuffered) {
   VerifyOutputImage(output1, output0, config.max_rms_dist);
 }
 
+// Decodes the whole image with read_scanlines, feeding the input in chunks of
+// at most chunk_size bytes, or all at once if chunk_size is 0.
+void DecodeInChunks(const std::vector<uint8_t>& compressed, size_t chunk_size,
+                    TestImage* output) {
+  SourceManager src(compressed.data(), compressed.size(), chunk_size,
+                    /*is_partial_file=*/false);
+  DecompressParams dparams;
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+    while (jpegli_read_header(&cinfo, TRUE) == JPEG_SUSPENDED) {
+      JPEGLI_TEST_ENSURE_TRUE(src.LoadNextChunk());
+    }
+    while (!jpegli_start_decompress(&cinfo)) {
+      JPEGLI_TEST_ENSURE_TRUE(src.LoadNextChunk());
+    }
+    JPEGLI_TEST_ENSURE_TRUE(ReadOutputImage(dparams, &cinfo, &src, output));
+    while (!jpegli_finish_decompress(&cinfo)) {
+      JPEGLI_TEST_ENSURE_TRUE(src.LoadNextChunk());
+    }
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+}
+
+// Chunk boundaries that fall inside MCUs and marker segments must not change
+// the decoded image, including chunks that are one byte larger than the
+// 16 KiB staging limit of the decoder.
+TEST(InputSuspensionTest, ChunkedInputMatchesOneShotDecode) {
+  TestImage input;
+  input.xsize = 384;
+  input.ysize = 256;
+  input.components = 3;
+  input.pixels.resize(input.xsize * input.ysize * input.components);
+  std::mt19937 rng(77);
+  std::uniform_int_distribution<int> dist(0, 255);
+  for (uint8_t& v : input.pixels) v = dist(rng);
+  for (int progr : {0, 2}) {
+    for (unsigned int restart_interval : {0u, 7u}) {
+      CompressParams jparams;
+      jparams.quality = 100;
+      jparams.h_sampling = {1, 1, 1};
+      jparams.v_sampling = {1, 1, 1};
+      jparams.progressive_mode = progr;
+      jparams.restart_interval = restart_interval;
+      jparams.add_marker = true;
+      // An APP2 marker segment that spans several 16 KiB chunks.
+      jparams.icc.resize(40000);
+      for (size_t i = 0; i < jparams.icc.size(); ++i) {
+        jparams.icc[i] = i & 0xff;
+      }
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+      TestImage output0;
+      DecodeInChunks(compressed, 0, &output0);
+      for (size_t chunk_size : {1, 16385}) {
+        TestImage output1;
+        DecodeInChunks(compressed, chunk_size, &output1);
+        ASSERT_EQ(output0.pixels.size(), output1.pixels.size());
+        EXPECT_EQ(0, memcmp(output0.pixels.data(), output1.pixels.data(),
+                            output0.pixels.size()))
+            << "progr " << progr << " restart_interval " << restart_interval
+            << " chunk_size " << chunk_size;
+      }
+    }
+  }
+}
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   std::vector<std::pair<std::string, std::string>> testfiles({
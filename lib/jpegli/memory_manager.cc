@@ -11,12 +11,25 @@
 #include <cstdlib>
 #include <cstring>
 #include <hwy/aligned_allocator.h>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/error.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JPEGLI_HAS_BACKING_STORE 1
+#else
+#define JPEGLI_HAS_BACKING_STORE 0
+#endif
+
 struct jvirt_sarray_control {
   JSAMPARRAY full_buffer;
   size_t numrows;
@@ -33,14 +46,156 @@ namespace jpegli {
 
 namespace {
 
+// A memory mapped temporary file.
+struct BackingStore {
+  void* data;
+  size_t size;
+};
+
+// Returns a zero-initialized buffer of the given size that is backed by a
+// temporary file instead of the heap, or nullptr if this is not supported or
+// the file could not be created. The kernel can write the pages of the buffer
+// back to the file and evict them from memory when under memory pressure.
+// The file is created in $TMPDIR, or in /tmp if that is not set, and is
+// unlinked right away, so that it is removed when the mapping goes away.
+BackingStore CreateBackingStore(size_t size) {
+  BackingStore store = {nullptr, size};
+#if JPEGLI_HAS_BACKING_STORE
+  const char* tmpdir = getenv("TMPDIR");
+  if (tmpdir == nullptr || tmpdir[0] == '\0') tmpdir = "/tmp";
+  std::string path = std::string(tmpdir) + "/jpegli-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd == -1) return store;
+  unlink(path.c_str());
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    close(fd);
+    return store;
+  }
+  void* data =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, /*offset=*/0);
+  // The mapping stays valid after the file descriptor is closed.
+  close(fd);
+  if (data == MAP_FAILED) return store;
+  store.data = data;
+#endif
+  return store;
+}
+
+void DestroyBackingStore(const BackingStore& store) {
+#if JPEGLI_HAS_BACKING_STORE
+  munmap(store.data, store.size);
+#endif
+}
+
+// Returns a read-only mapping of the file at the given path, or a mapping with
+// nullptr data if this is not supported or the file could not be mapped.
+BackingStore MapReadOnlyFile(const char* path) {
+  BackingStore store = {nullptr, 0};
+#if JPEGLI_HAS_BACKING_STORE
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return store;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return store;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, /*offset=*/0);
+  // The mapping stays valid after the file descriptor is closed.
+  close(fd);
+  if (data == MAP_FAILED) return store;
+  madvise(data, size, MADV_SEQUENTIAL);
+  store.data = data;
+  store.size = size;
+#endif
+  return store;
+}
+
+// Minimum size of an arena slab.
+constexpr size_t kMinArenaSlabSize = 1 << 20;
+
 struct MemoryManager {
   struct jpeg_memory_mgr pub;
   std::vector<void*> owned_ptrs[2 * JPOOL_NUMPOOLS];
   uint64_t pool_memory_usage[2 * JPOOL_NUMPOOLS];
   uint64_t total_memory_usage;
   uint64_t peak_memory_usage;
+  // If true, image lifetime allocations are bump-allocated from the arena
+  // slabs, which are retained and reused after the image pool is freed.
+  bool use_arena;
+  // Aligned slabs of the arena as (pointer, size) pairs, allocations are made
+  // from arena_slabs[arena_slab_idx] starting at offset arena_pos.
+  std::vector<std::pair<uint8_t*, size_t>> arena_slabs;
+  size_t arena_slab_idx;
+  size_t arena_pos;
+  // Temporary files mapped into memory that hold the image lifetime virtual
+  // arrays that did not fit within max_memory_to_use.
+  std::vector<BackingStore> backing_stores;
+  // Input files mapped into memory by MapFile().
+  std::vector<BackingStore> mapped_files;
 };
 
+void* ArenaAlloc(MemoryManager* mem, size_t sizeofobject) {
+  const size_t size = RoundUpTo(std::max<size_t>(sizeofobject, 1),
+                                HWY_ALIGNMENT);
+  auto& slabs = mem->arena_slabs;
+  while (mem->arena_slab_idx < slabs.size()) {
+    auto& slab = slabs[mem->arena_slab_idx];
+    if (mem->arena_pos + size <= slab.second) {
+      void* p = slab.first + mem->arena_pos;
+      mem->arena_pos += size;
+      return p;
+    }
+    ++mem->arena_slab_idx;
+    mem->arena_pos = 0;
+  }
+  size_t slab_size = std::max(size, kMinArenaSlabSize);
+  if (!slabs.empty()) {
+    slab_size = std::max(slab_size, 2 * slabs.back().second);
+  }
+  uint8_t* slab = static_cast<uint8_t*>(
+      hwy::AllocateAlignedBytes(slab_size, nullptr, nullptr));
+  if (slab == nullptr) return nullptr;
+  slabs.emplace_back(slab, slab_size);
+  mem->arena_slab_idx = slabs.size() - 1;
+  mem->arena_pos = size;
+  return slab;
+}
+
+void FreeArenaSlabs(MemoryManager* mem) {
+  for (const auto& slab : mem->arena_slabs) {
+    hwy::FreeAlignedBytes(slab.first, nullptr, nullptr);
+  }
+  mem->arena_slabs.clear();
+  mem->arena_slab_idx = 0;
+  mem->arena_pos = 0;
+}
+
+// Makes the arena ready for the next image. If the last image needed more
+// than one slab, they are replaced by a single slab of the combined size, so
+// that the following images of similar size can be served from it without
+// any further system allocations.
+void ResetArena(MemoryManager* mem) {
+  if (!mem->use_arena) {
+    FreeArenaSlabs(mem);
+    return;
+  }
+  if (mem->arena_slabs.size() > 1) {
+    size_t total_size = 0;
+    for (const auto& slab : mem->arena_slabs) {
+      total_size += slab.second;
+    }
+    FreeArenaSlabs(mem);
+    uint8_t* slab = static_cast<uint8_t*>(
+        hwy::AllocateAlignedBytes(total_size, nullptr, nullptr));
+    if (slab != nullptr) {
+      mem->arena_slabs.emplace_back(slab, total_size);
+    }
+  }
+  mem->arena_slab_idx = 0;
+  mem->arena_pos = 0;
+}
+
 void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id < 0 || pool_id >= 2 * JPOOL_NUMPOOLS) {
@@ -53,7 +208,11 @@ void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
                  mem->pub.max_memory_to_use);
   }
   void* p;
-  if (pool_id < JPOOL_NUMPOOLS) {
+  const bool from_arena =
+      mem->use_arena && (pool_id % JPOOL_NUMPOOLS) == JPOOL_IMAGE;
+  if (from_arena) {
+    p = ArenaAlloc(mem, sizeofobject);
+  } else if (pool_id < JPOOL_NUMPOOLS) {
     p = malloc(sizeofobject);
   } else {
     p = hwy::AllocateAlignedBytes(sizeofobject, nullptr, nullptr);
@@ -61,7 +220,9 @@ void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
   if (p == nullptr) {
     JPEGLI_ERROR("Out of memory");
   }
-  mem->owned_ptrs[pool_id].push_back(p);
+  if (!from_arena) {
+    mem->owned_ptrs[pool_id].push_back(p);
+  }
   mem->pool_memory_usage[pool_id] += sizeofobject;
   mem->total_memory_usage += sizeofobject;
   mem->peak_memory_usage =
@@ -72,24 +233,60 @@ void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
 constexpr size_t gcd(size_t a, size_t b) { return b == 0 ? a : gcd(b, a % b); }
 constexpr size_t lcm(size_t a, size_t b) { return (a * b) / gcd(a, b); }
 
+// Returns the number of elements between the rows of 2d arrays.
 template <typename T>
-T** Alloc2dArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
-                 JDIMENSION numrows) {
-  T** array = Allocate<T*>(cinfo, numrows, pool_id);
-  // Always use aligned allocator for large 2d arrays.
-  if (pool_id < JPOOL_NUMPOOLS) {
-    pool_id += JPOOL_NUMPOOLS;
-  }
+size_t RowStride(JDIMENSION samplesperrow) {
   size_t alignment = lcm(sizeof(T), HWY_ALIGNMENT);
   size_t memstride = RoundUpTo(samplesperrow * sizeof(T), alignment);
-  size_t stride = memstride / sizeof(T);
-  T* buffer = Allocate<T>(cinfo, numrows * stride, pool_id);
+  return memstride / sizeof(T);
+}
+
+template <typename T>
+T** RowPointers(j_common_ptr cinfo, int pool_id, T* buffer, size_t stride,
+                JDIMENSION numrows) {
+  T** array = Allocate<T*>(cinfo, numrows, pool_id);
   for (size_t i = 0; i < numrows; ++i) {
     array[i] = &buffer[i * stride];
   }
   return array;
 }
 
+template <typename T>
+T** Alloc2dArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
+                 JDIMENSION numrows) {
+  size_t stride = RowStride<T>(samplesperrow);
+  // Always use aligned allocator for large 2d arrays.
+  int buffer_pool_id =
+      pool_id < JPOOL_NUMPOOLS ? pool_id + JPOOL_NUMPOOLS : pool_id;
+  T* buffer = Allocate<T>(cinfo, numrows * stride, buffer_pool_id);
+  return RowPointers(cinfo, pool_id, buffer, stride, numrows);
+}
+
+// Returns a 2d array whose rows live in a temporary file mapped into memory,
+// if the array would not fit within the max_memory_to_use limit, otherwise
+// returns nullptr.
+template <typename T>
+T** AllocBackedArray(j_common_ptr cinfo, int pool_id,
+                     JDIMENSION samplesperrow, JDIMENSION numrows) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  size_t stride = RowStride<T>(samplesperrow);
+  size_t buffer_size = numrows * stride * sizeof(T);
+  if (mem->pub.max_memory_to_use <= 0 || buffer_size == 0 ||
+      mem->total_memory_usage + buffer_size <=
+          static_cast<uint64_t>(mem->pub.max_memory_to_use)) {
+    return nullptr;
+  }
+  BackingStore store = CreateBackingStore(buffer_size);
+  if (store.data == nullptr) {
+    return nullptr;
+  }
+  mem->backing_stores.push_back(store);
+  JPEGLI_TRACE(1, "Using backing store for %u x %u virtual array",
+               samplesperrow, numrows);
+  return RowPointers(cinfo, pool_id, static_cast<T*>(store.data), stride,
+                     numrows);
+}
+
 template <typename Control, typename T>
 Control* RequestVirtualArray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
                              JDIMENSION samplesperrow, JDIMENSION numrows,
@@ -98,9 +295,14 @@ Control* RequestVirtualArray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
     JPEGLI_ERROR("Only image lifetime virtual arrays are supported.");
   }
   Control* p = Allocate<Control>(cinfo, 1, pool_id);
-  p->full_buffer = Alloc2dArray<T>(cinfo, pool_id, samplesperrow, numrows);
+  p->full_buffer = AllocBackedArray<T>(cinfo, pool_id, samplesperrow, numrows);
   p->numrows = numrows;
   p->maxaccess = maxaccess;
+  if (p->full_buffer != nullptr) {
+    // The backing store is zero-initialized already.
+    return p;
+  }
+  p->full_buffer = Alloc2dArray<T>(cinfo, pool_id, samplesperrow, numrows);
   if (pre_zero) {
     for (size_t i = 0; i < numrows; ++i) {
       memset(p->full_buffer[i], 0, samplesperrow * sizeof(T));
@@ -150,13 +352,25 @@ void FreePool(j_common_ptr cinfo, int pool_id) {
     hwy::FreeAlignedBytes(ptr, nullptr, nullptr);
   }
   ClearPool(cinfo, JPOOL_NUMPOOLS + pool_id);
+  if (pool_id == JPOOL_IMAGE) {
+    ResetArena(mem);
+    for (const BackingStore& store : mem->backing_stores) {
+      DestroyBackingStore(store);
+    }
+    mem->backing_stores.clear();
+  }
 }
 
 void SelfDestruct(j_common_ptr cinfo) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  // With the arena disabled, freeing the image pool releases the slabs.
+  mem->use_arena = false;
   for (int pool_id = 0; pool_id < JPOOL_NUMPOOLS; ++pool_id) {
     FreePool(cinfo, pool_id);
   }
+  for (const BackingStore& store : mem->mapped_files) {
+    DestroyBackingStore(store);
+  }
   delete mem;
   cinfo->mem = nullptr;
 }
@@ -184,7 +398,42 @@ void InitMemoryManager(j_common_ptr cinfo) {
   mem->total_memory_usage = 0;
   mem->peak_memory_usage = 0;
   memset(mem->pool_memory_usage, 0, sizeof(mem->pool_memory_usage));
+  mem->use_arena = false;
+  mem->arena_slab_idx = 0;
+  mem->arena_pos = 0;
   cinfo->mem = reinterpret_cast<struct jpeg_memory_mgr*>(mem);
 }
 
+const uint8_t* MapFile(j_common_ptr cinfo, const char* path, size_t* size) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  BackingStore store = MapReadOnlyFile(path);
+  if (store.data == nullptr) {
+    return nullptr;
+  }
+  mem->mapped_files.push_back(store);
+  *size = store.size;
+  return static_cast<const uint8_t*>(store.data);
+}
+
+void UnmapFile(j_common_ptr cinfo, const uint8_t* data) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  auto& files = mem->mapped_files;
+  for (auto it = files.begin(); it != files.end(); ++it) {
+    if (it->data == data) {
+      DestroyBackingStore(*it);
+      files.erase(it);
+      return;
+    }
+  }
+}
+
+void SetMemoryArena(j_common_ptr cinfo, bool enable) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  mem->use_arena = enable;
+  if (!enable && mem->pool_memory_usage[JPOOL_IMAGE] == 0 &&
+      mem->pool_memory_usage[JPOOL_IMAGE_ALIGNED] == 0) {
+    FreeArenaSlabs(mem);
+  }
+}
+
 }  // namespace jpegli
@@ -7,6 +7,8 @@
 #ifndef LIB_JPEGLI_MEMORY_MANAGER_H_
 #define LIB_JPEGLI_MEMORY_MANAGER_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 
 #include "lib/jpegli/common.h"
@@ -18,6 +20,17 @@ namespace jpegli {
 
 void InitMemoryManager(j_common_ptr cinfo);
 
+// Enables or disables the allocation of image lifetime memory from retained
+// arena slabs.
+void SetMemoryArena(j_common_ptr cinfo, bool enable);
+
+// Maps the file at path into memory for sequential reading and sets *size to
+// its size. The mapping is released by UnmapFile() or when the object is
+// destroyed. Returns nullptr if the file could not be mapped.
+const uint8_t* MapFile(j_common_ptr cinfo, const char* path, size_t* size);
+
+void UnmapFile(j_common_ptr cinfo, const uint8_t* data);
+
 template <typename T>
 T* Allocate(j_common_ptr cinfo, size_t len, int pool_id = JPOOL_PERMANENT) {
   const size_t size = len * sizeof(T);  // NOLINT
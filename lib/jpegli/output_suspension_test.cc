@@ -90,6 +90,7 @@ TEST_P(OutputSuspensionTestParam, PixelData) {
     cinfo.comp_info[0].v_samp_factor = config.jparams.v_sampling[0];
     jpegli_set_progressive_level(&cinfo, 0);
     cinfo.optimize_coding = FALSE;
+    cinfo.restart_interval = config.jparams.restart_interval;
     jpegli_start_compress(&cinfo, TRUE);
 
     size_t stride = cinfo.image_width * cinfo.input_components;
@@ -147,6 +148,7 @@ TEST_P(OutputSuspensionTestParam, RawData) {
     cinfo.comp_info[0].v_samp_factor = config.jparams.v_sampling[0];
     jpegli_set_progressive_level(&cinfo, 0);
     cinfo.optimize_coding = FALSE;
+    cinfo.restart_interval = config.jparams.restart_interval;
     cinfo.raw_data_in = TRUE;
     jpegli_start_compress(&cinfo, TRUE);
 
@@ -207,6 +209,19 @@ std::vector<TestConfig> GenerateTests() {
       }
     }
   }
+  for (int v_sampling : {1, 2}) {
+    for (int bufsize : {16, 16 << 10}) {
+      TestConfig config;
+      config.lines_batch_size = 8;
+      config.buffer_size = bufsize;
+      config.input.xsize = xsize0;
+      config.input.ysize = ysize0;
+      config.jparams.h_sampling = {1, 1, 1};
+      config.jparams.v_sampling = {v_sampling, 1, 1};
+      config.jparams.restart_interval = 7;
+      all_tests.push_back(config);
+    }
+  }
   return all_tests;
 }
 
@@ -766,4 +766,8 @@ void InitQuantizer(j_compress_ptr cinfo, QuantPass pass) {
   }
 }
 
+bool IsQuantSearchEnabled(j_compress_ptr cinfo) {
+  return cinfo->master->psnr_target > 0 || cinfo->master->target_size > 0;
+}
+
 }  // namespace jpegli
@@ -22,6 +22,10 @@ enum QuantPass {
 
 void InitQuantizer(j_compress_ptr cinfo, QuantPass pass);
 
+// Returns true if the quantization matrices are selected only after all the
+// DCT coefficients are computed, i.e. if there is a PSNR or file size target.
+bool IsQuantSearchEnabled(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_QUANT_H_
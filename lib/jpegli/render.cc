@@ -24,6 +24,7 @@
 #include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/idct.h"
+#include "lib/jpegli/simd.h"
 #include "lib/jpegli/types.h"
 #include "lib/jpegli/upsample.h"
 
@@ -59,6 +60,7 @@ using hwy::HWY_NAMESPACE::Clamp;
 using hwy::HWY_NAMESPACE::Gt;
 using hwy::HWY_NAMESPACE::IfThenElseZero;
 using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
 using hwy::HWY_NAMESPACE::NearestInt;
 using hwy::HWY_NAMESPACE::Or;
 using hwy::HWY_NAMESPACE::Rebind;
@@ -280,6 +282,160 @@ void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
   }
 }
 
+// Fills out[0, 2 * num) with the horizontally upsampled values of the
+// downsampled samples row[j0, j0 + num), using the same edge replication and
+// arithmetic as Upsample2Horizontal over a row of len_in samples.
+void UpsampleTile(const float* JXL_RESTRICT row, size_t len_in, size_t j0,
+                  size_t num, bool fancy, float* JXL_RESTRICT padded,
+                  float* JXL_RESTRICT out) {
+  const HWY_CAPPED(float, 8) df;
+  const size_t num_padded = RoundUpTo(num, Lanes(df)) + 2;
+  for (size_t k = 0; k < num_padded; ++k) {
+    ssize_t j = static_cast<ssize_t>(j0 + k) - 1;
+    j = std::max<ssize_t>(0, std::min<ssize_t>(j, len_in - 1));
+    padded[k] = row[j];
+  }
+  if (!fancy) {
+    for (size_t x = 0; x < num; x += Lanes(df)) {
+      auto current = LoadU(df, padded + x + 1);
+      StoreInterleaved2(current, current, df, out + 2 * x);
+    }
+    return;
+  }
+  auto threefour = Set(df, 0.75f);
+  auto onefour = Set(df, 0.25f);
+  for (size_t x = 0; x < num; x += Lanes(df)) {
+    auto current = Mul(LoadU(df, padded + x + 1), threefour);
+    auto prev = LoadU(df, padded + x);
+    auto next = LoadU(df, padded + x + 2);
+    auto left = MulAdd(onefour, prev, current);
+    auto right = MulAdd(onefour, next, current);
+    StoreInterleaved2(left, right, df, out + 2 * x);
+  }
+}
+
+template <class DU, class V>
+HWY_INLINE Vec<DU> DecenterToUnsigned(DU du, V v, V c128, V zero, V mul) {
+  return DemoteTo(du, NearestInt(Clamp(zero, Mul(Add(v, c128), mul), mul)));
+}
+
+template <bool kBGR, int kAlpha, class DU, class V>
+HWY_INLINE void StorePixels(DU du, V r, V g, V b, V a, uint8_t* output) {
+  if (kAlpha < 0) {
+    if (kBGR) {
+      StoreInterleaved3(b, g, r, du, output);
+    } else {
+      StoreInterleaved3(r, g, b, du, output);
+    }
+  } else if (kAlpha == 0) {
+    if (kBGR) {
+      StoreInterleaved4(a, b, g, r, du, output);
+    } else {
+      StoreInterleaved4(a, r, g, b, du, output);
+    }
+  } else {
+    if (kBGR) {
+      StoreInterleaved4(b, g, r, a, du, output);
+    } else {
+      StoreInterleaved4(r, g, b, a, du, output);
+    }
+  }
+}
+
+// Computes the len interleaved uint8 output pixels starting at rendered column
+// x0 directly from the full resolution luma row and the (possibly
+// horizontally downsampled) chroma rows. This is equivalent to horizontal
+// upsampling, YCbCrToExtRGB, DecenterRow and WriteToOutput, but the upsampled
+// chroma is only materialized for one tile at a time.
+template <bool kBGR, int kAlpha>
+void YCbCrToExtRGBOutput(const float* JXL_RESTRICT row_y,
+                         const float* JXL_RESTRICT row_cb,
+                         const float* JXL_RESTRICT row_cr, int h_cb, int h_cr,
+                         bool fancy, size_t render_width, size_t x0, size_t len,
+                         uint8_t* JXL_RESTRICT output) {
+  const HWY_CAPPED(float, 8) df;
+  const Rebind<uint8_t, decltype(df)> du;
+  const size_t num_channels = kAlpha < 0 ? 3 : 4;
+  constexpr size_t kTileSize = 256;
+  static_assert(kTileSize % 8 == 0, "tiles must consist of full vectors");
+  HWY_ALIGN float padded[kTileSize / 2 + 16];
+  HWY_ALIGN float tile_cb[kTileSize + 16];
+  HWY_ALIGN float tile_cr[kTileSize + 16];
+  HWY_ALIGN uint8_t tail[4 * 8];
+#if JXL_MEMORY_SANITIZER
+  const size_t padding = hwy::RoundUpTo(len, Lanes(df)) - len;
+  __msan_unpoison(row_y + x0 + len, sizeof(row_y[0]) * padding);
+  if (h_cb == 1) __msan_unpoison(row_cb + x0 + len, sizeof(float) * padding);
+  if (h_cr == 1) __msan_unpoison(row_cr + x0 + len, sizeof(float) * padding);
+#endif
+
+  // Full-range BT.601 as defined by JFIF Clause 7:
+  // https://www.itu.int/rec/T-REC-T.871-201105-I/en
+  const auto crcr = Set(df, 1.402f);
+  const auto cgcb = Set(df, -0.114f * 1.772f / 0.587f);
+  const auto cgcr = Set(df, -0.299f * 1.402f / 0.587f);
+  const auto cbcb = Set(df, 1.772f);
+  const auto c128 = Set(df, 128.0f / 255);
+  const auto zero = Zero(df);
+  const auto mul = Set(df, 255.0f);
+  const auto a_vec =
+      DecenterToUnsigned(du, Set(df, 127.0f / 255.0f), c128, zero, mul);
+  const size_t len_in = (render_width + 1) >> 1;
+
+  for (size_t t = 0; t < len; t += kTileSize) {
+    const size_t num = std::min(kTileSize, len - t);
+    const size_t tx = x0 + t;
+    const size_t shift = tx & 1;
+    const size_t num_in = DivCeil(num + shift, 2);
+    const float* JXL_RESTRICT cb = row_cb + tx;
+    const float* JXL_RESTRICT cr = row_cr + tx;
+    if (h_cb == 2) {
+      UpsampleTile(row_cb, len_in, tx / 2, num_in, fancy, padded, tile_cb);
+      cb = tile_cb + shift;
+    }
+    if (h_cr == 2) {
+      UpsampleTile(row_cr, len_in, tx / 2, num_in, fancy, padded, tile_cr);
+      cr = tile_cr + shift;
+    }
+    uint8_t* JXL_RESTRICT out = output + t * num_channels;
+    for (size_t i = 0; i < num; i += Lanes(df)) {
+      const auto y_vec = LoadU(df, row_y + tx + i);
+      const auto cb_vec = LoadU(df, cb + i);
+      const auto cr_vec = LoadU(df, cr + i);
+      const auto r_vec = MulAdd(crcr, cr_vec, y_vec);
+      const auto g_vec = MulAdd(cgcr, cr_vec, MulAdd(cgcb, cb_vec, y_vec));
+      const auto b_vec = MulAdd(cbcb, cb_vec, y_vec);
+      const auto r = DecenterToUnsigned(du, r_vec, c128, zero, mul);
+      const auto g = DecenterToUnsigned(du, g_vec, c128, zero, mul);
+      const auto b = DecenterToUnsigned(du, b_vec, c128, zero, mul);
+      if (i + Lanes(df) <= num) {
+        StorePixels<kBGR, kAlpha>(du, r, g, b, a_vec,
+                                  out + i * num_channels);
+      } else {
+        StorePixels<kBGR, kAlpha>(du, r, g, b, a_vec, tail);
+        memcpy(out + i * num_channels, tail, (num - i) * num_channels);
+      }
+    }
+  }
+}
+
+void WriteYCbCrToOutput(const float* JXL_RESTRICT rows[3], const int* h_factor,
+                        bool fancy, size_t render_width, size_t x0, size_t len,
+                        bool bgr, int alpha_pos, uint8_t* JXL_RESTRICT output) {
+  using OutputFunc = void (*)(const float*, const float*, const float*, int,
+                              int, bool, size_t, size_t, size_t, uint8_t*);
+  OutputFunc fn;
+  if (alpha_pos < 0) {
+    fn = bgr ? &YCbCrToExtRGBOutput<true, -1> : &YCbCrToExtRGBOutput<false, -1>;
+  } else if (alpha_pos == 0) {
+    fn = bgr ? &YCbCrToExtRGBOutput<true, 0> : &YCbCrToExtRGBOutput<false, 0>;
+  } else {
+    fn = bgr ? &YCbCrToExtRGBOutput<true, 3> : &YCbCrToExtRGBOutput<false, 3>;
+  }
+  fn(rows[0], rows[1], rows[2], h_factor[1], h_factor[2], fancy, render_width,
+     x0, len, output);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -292,6 +448,7 @@ namespace jpegli {
 HWY_EXPORT(GatherBlockStats);
 HWY_EXPORT(WriteToOutput);
 HWY_EXPORT(DecenterRow);
+HWY_EXPORT(WriteYCbCrToOutput);
 
 void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
                       const size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
@@ -310,6 +467,100 @@ void DecenterRow(float* row, size_t xsize) {
   HWY_DYNAMIC_DISPATCH(DecenterRow)(row, xsize);
 }
 
+void WriteYCbCrToOutput(const float* JXL_RESTRICT rows[3], const int* h_factor,
+                        bool fancy, size_t render_width, size_t x0, size_t len,
+                        bool bgr, int alpha_pos, uint8_t* JXL_RESTRICT output) {
+  HWY_DYNAMIC_DISPATCH(WriteYCbCrToOutput)
+  (rows, h_factor, fancy, render_width, x0, len, bgr, alpha_pos, output);
+}
+
+// Returns true if the output rows can be produced with WriteYCbCrToOutput,
+// i.e. for YCbCr to 8-bit RGB(A) output without color quantization, where the
+// chroma components are upsampled by at most 2x in each direction. Sets *bgr
+// and *alpha_pos to describe the channel order of the output pixels.
+bool UseFusedYCbCrOutput(j_decompress_ptr cinfo, bool* bgr, int* alpha_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->jpeg_color_space != JCS_YCbCr || cinfo->num_components != 3 ||
+      cinfo->quantize_colors || m->output_data_type_ != JPEGLI_TYPE_UINT8) {
+    return false;
+  }
+  if (m->h_factor[0] != 1 || m->v_factor[0] != 1) {
+    return false;
+  }
+  for (int c = 1; c < 3; ++c) {
+    if (m->h_factor[c] > 2 || m->v_factor[c] > 2) return false;
+  }
+  *bgr = false;
+  *alpha_pos = -1;
+  switch (cinfo->out_color_space) {
+    case JCS_RGB:
+      return true;
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_RGB:
+      return true;
+    case JCS_EXT_BGR:
+      *bgr = true;
+      return true;
+    case JCS_EXT_RGBX:
+      *alpha_pos = 3;
+      return true;
+    case JCS_EXT_BGRX:
+      *bgr = true;
+      *alpha_pos = 3;
+      return true;
+    case JCS_EXT_XRGB:
+      *alpha_pos = 0;
+      return true;
+    case JCS_EXT_XBGR:
+      *bgr = true;
+      *alpha_pos = 0;
+      return true;
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_RGBA:
+      *alpha_pos = 3;
+      return true;
+    case JCS_EXT_BGRA:
+      *bgr = true;
+      *alpha_pos = 3;
+      return true;
+    case JCS_EXT_ARGB:
+      *alpha_pos = 0;
+      return true;
+    case JCS_EXT_ABGR:
+      *bgr = true;
+      *alpha_pos = 0;
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+// Computes the range [*xbegin, *xend) of full resolution output columns that
+// are rendered. If the output is cropped, this covers the cropped columns and
+// at least one iMCU of context for the horizontal upsampling on both sides,
+// and both ends are aligned to full vectors in every downsampled component.
+void GetRenderColumns(j_decompress_ptr cinfo, size_t* xbegin, size_t* xend) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
+  const size_t full_width = m->iMCU_cols_ * imcu_width;
+  *xbegin = 0;
+  *xend = full_width;
+  if (cinfo->raw_data_out) {
+    return;
+  }
+  const size_t vec_floats =
+      std::max<size_t>(HWY_ALIGNMENT, VectorSize()) / sizeof(float);
+  const size_t align = imcu_width * vec_floats;
+  const size_t x0 = m->xoffset_;
+  const size_t x1 = m->xoffset_ + cinfo->output_width;
+  if (x0 >= imcu_width) {
+    *xbegin = (x0 - imcu_width) / align * align;
+  }
+  *xend = std::min(full_width, RoundUpTo(x1 + imcu_width, align));
+}
+
 bool ShouldApplyDequantBiases(j_decompress_ptr cinfo, int ci) {
   const auto& compinfo = cinfo->comp_info[ci];
   return (compinfo.h_samp_factor == cinfo->max_h_samp_factor &&
@@ -563,6 +814,7 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
   memset(m->biases_, 0, coeffs_per_block * sizeof(m->biases_[0]));
   cinfo->output_iMCU_row = 0;
   cinfo->output_scanline = 0;
+  m->skip_scanlines_end_ = 0;
   const float kDequantScale = 1.0f / (8 * 255);
   for (int c = 0; c < cinfo->num_components; c++) {
     const auto& comp = cinfo->comp_info[c];
@@ -579,9 +831,19 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
 void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   const size_t imcu_row = cinfo->output_iMCU_row;
+  const size_t context = m->need_context_rows_ ? 1 : 0;
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  // The iMCU rows that only contribute to output rows that are skipped over
+  // by jpegli_skip_scanlines() are not transformed.
+  const bool skip_transform =
+      (imcu_row + 1 + context) * imcu_height <= m->skip_scanlines_end_;
+  size_t xbegin;
+  size_t xend;
+  GetRenderColumns(cinfo, &xbegin, &xend);
   JBLOCKARRAY blocks[kMaxComponents];
   for (int c = 0; c < cinfo->num_components; ++c) {
     const jpeg_component_info* comp = &cinfo->comp_info[c];
+    if (!comp->component_needed) continue;
     int by0 = imcu_row * comp->v_samp_factor;
     int block_rows_left = comp->height_in_blocks - by0;
     int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
@@ -593,6 +855,7 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
   for (int c = 0; c < cinfo->num_components; ++c) {
     size_t k0 = c * DCTSIZE2;
     auto& compinfo = cinfo->comp_info[c];
+    if (!compinfo.component_needed) continue;
     size_t block_row = imcu_row * compinfo.v_samp_factor;
     if (ShouldApplyDequantBiases(cinfo, c)) {
       // Update statistics for this iMCU row.
@@ -614,15 +877,23 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
       }
     }
     RowBuffer<float>* raw_out = &m->raw_output_[c];
+    size_t dctsize = m->scaled_dct_size[c];
+    // Only the blocks that are needed for the rendered columns are
+    // transformed.
+    size_t bx0 = xbegin / m->h_factor[c] / dctsize;
+    size_t bx1 = std::min<size_t>(compinfo.width_in_blocks,
+                                  DivCeil(xend / m->h_factor[c], dctsize));
+    if (skip_transform) {
+      bx1 = bx0;
+    }
     for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
       size_t by = block_row + iy;
       if (by >= compinfo.height_in_blocks) {
         continue;
       }
-      size_t dctsize = m->scaled_dct_size[c];
       int16_t* JXL_RESTRICT row_in = &blocks[c][iy][0][0];
       float* JXL_RESTRICT row_out = raw_out->Row(by * dctsize);
-      for (size_t bx = 0; bx < compinfo.width_in_blocks; ++bx) {
+      for (size_t bx = bx0; bx < bx1; ++bx) {
         if (m->apply_smoothing) {
           PredictSmooth(cinfo, blocks[c], c, bx, iy);
           (*m->inverse_transform[c])(m->smoothing_scratch_, &m->dequant_[k0],
@@ -671,12 +942,9 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
                    JSAMPARRAY scanlines, size_t max_output_rows) {
   jpeg_decomp_master* m = cinfo->master;
   const int vfactor = cinfo->max_v_samp_factor;
-  const int hfactor = cinfo->max_h_samp_factor;
   const size_t context = m->need_context_rows_ ? 1 : 0;
   const size_t imcu_row = cinfo->output_iMCU_row;
   const size_t imcu_height = vfactor * m->min_scaled_dct_size;
-  const size_t imcu_width = hfactor * m->min_scaled_dct_size;
-  const size_t output_width = m->iMCU_cols_ * imcu_width;
   if (imcu_row == cinfo->total_iMCU_rows ||
       (imcu_row > context &&
        cinfo->output_scanline < (imcu_row - context) * imcu_height)) {
@@ -688,44 +956,66 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
     yend = std::min<size_t>(yend, ybegin + max_output_rows - *num_output_rows);
     size_t yb = (ybegin / vfactor) * vfactor;
     size_t ye = DivCeil(yend, vfactor) * vfactor;
+    size_t xbegin;
+    size_t xend;
+    GetRenderColumns(cinfo, &xbegin, &xend);
+    const size_t render_width = xend - xbegin;
+    bool bgr = false;
+    int alpha_pos = -1;
+    const bool fused =
+        scanlines != nullptr && UseFusedYCbCrOutput(cinfo, &bgr, &alpha_pos);
     for (size_t y = yb; y < ye; y += vfactor) {
-      for (int c = 0; c < cinfo->num_components; ++c) {
+      // Skipped over rows are not rendered.
+      for (int c = 0; c < cinfo->num_components && scanlines; ++c) {
+        if (!cinfo->comp_info[c].component_needed) continue;
         RowBuffer<float>* raw_out = &m->raw_output_[c];
         RowBuffer<float>* render_out = &m->render_output_[c];
+        if (fused && !(cinfo->do_fancy_upsampling && m->v_factor[c] == 2)) {
+          // The fused output reads these rows directly from raw_out.
+          continue;
+        }
         int line_groups = vfactor / m->v_factor[c];
-        int downsampled_width = output_width / m->h_factor[c];
+        // The downsampled samples of the rendered columns are placed at the
+        // start of the rendered range of the output row, and are upsampled
+        // in place from there.
+        size_t downsampled_x0 = xbegin / m->h_factor[c];
+        int downsampled_width = render_width / m->h_factor[c];
         size_t yc = y / m->v_factor[c];
         for (int dy = 0; dy < line_groups; ++dy) {
           size_t ymid = yc + dy;
-          const float* JXL_RESTRICT row_mid = raw_out->Row(ymid);
+          const float* JXL_RESTRICT row_mid =
+              raw_out->Row(ymid) + downsampled_x0;
           if (cinfo->do_fancy_upsampling && m->v_factor[c] == 2) {
             const float* JXL_RESTRICT row_top =
-                ymid == 0 ? row_mid : raw_out->Row(ymid - 1);
-            const float* JXL_RESTRICT row_bot = ymid + 1 == m->raw_height_[c]
-                                                    ? row_mid
-                                                    : raw_out->Row(ymid + 1);
+                (ymid == 0 ? raw_out->Row(ymid) : raw_out->Row(ymid - 1)) +
+                downsampled_x0;
+            const float* JXL_RESTRICT row_bot =
+                (ymid + 1 == m->raw_height_[c] ? raw_out->Row(ymid)
+                                               : raw_out->Row(ymid + 1)) +
+                downsampled_x0;
             Upsample2Vertical(row_top, row_mid, row_bot,
-                              render_out->Row(2 * dy),
-                              render_out->Row(2 * dy + 1), downsampled_width);
+                              render_out->Row(2 * dy) + xbegin,
+                              render_out->Row(2 * dy + 1) + xbegin,
+                              downsampled_width);
           } else {
             for (int yix = 0; yix < m->v_factor[c]; ++yix) {
-              memcpy(render_out->Row(m->v_factor[c] * dy + yix), row_mid,
-                     downsampled_width * sizeof(float));
+              memcpy(render_out->Row(m->v_factor[c] * dy + yix) + xbegin,
+                     row_mid, downsampled_width * sizeof(float));
             }
           }
-          if (m->h_factor[c] > 1) {
+          if (m->h_factor[c] > 1 && !fused) {
             for (int yix = 0; yix < m->v_factor[c]; ++yix) {
               int row_ix = m->v_factor[c] * dy + yix;
-              float* JXL_RESTRICT row = render_out->Row(row_ix);
+              float* JXL_RESTRICT row = render_out->Row(row_ix) + xbegin;
               float* JXL_RESTRICT tmp = m->upsample_scratch_;
               if (cinfo->do_fancy_upsampling && m->h_factor[c] == 2) {
-                Upsample2Horizontal(row, tmp, output_width);
+                Upsample2Horizontal(row, tmp, render_width);
               } else {
                 // TODO(szabadka) SIMDify this.
-                for (size_t x = 0; x < output_width; ++x) {
+                for (size_t x = 0; x < render_width; ++x) {
                   tmp[x] = row[x / m->h_factor[c]];
                 }
-                memcpy(row, tmp, output_width * sizeof(tmp[0]));
+                memcpy(row, tmp, render_width * sizeof(tmp[0]));
               }
             }
           }
@@ -733,18 +1023,35 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
       }
       for (int yix = 0; yix < vfactor; ++yix) {
         if (y + yix < ybegin || y + yix >= yend) continue;
-        float* rows[kMaxComponents];
-        int num_all_components =
-            std::max(cinfo->out_color_components, cinfo->num_components);
-        for (int c = 0; c < num_all_components; ++c) {
-          rows[c] = m->render_output_[c].Row(yix);
-        }
-        (*m->color_transform)(rows, output_width);
-        for (int c = 0; c < cinfo->out_color_components; ++c) {
-          // Undo the centering of the sample values around zero.
-          DecenterRow(rows[c], output_width);
-        }
-        if (scanlines) {
+        if (fused) {
+          const float* JXL_RESTRICT rows[3];
+          for (int c = 0; c < 3; ++c) {
+            const int v = m->v_factor[c];
+            if (cinfo->do_fancy_upsampling && v == 2) {
+              rows[c] = m->render_output_[c].Row(yix) + xbegin;
+            } else {
+              rows[c] = m->raw_output_[c].Row((y + yix) / v) +
+                        xbegin / m->h_factor[c];
+            }
+          }
+          WriteYCbCrToOutput(rows, m->h_factor, cinfo->do_fancy_upsampling,
+                             render_width, m->xoffset_ - xbegin,
+                             cinfo->output_width, bgr, alpha_pos,
+                             scanlines[*num_output_rows]);
+        } else if (scanlines) {
+          float* rows[kMaxComponents];
+          float* render_rows[kMaxComponents];
+          int num_all_components =
+              std::max(cinfo->out_color_components, cinfo->num_components);
+          for (int c = 0; c < num_all_components; ++c) {
+            rows[c] = m->render_output_[c].Row(yix);
+            render_rows[c] = rows[c] + xbegin;
+          }
+          (*m->color_transform)(render_rows, render_width);
+          for (int c = 0; c < cinfo->out_color_components; ++c) {
+            // Undo the centering of the sample values around zero.
+            DecenterRow(render_rows[c], render_width);
+          }
           uint8_t* output = scanlines[*num_output_rows];
           WriteToOutput(cinfo, rows, m->xoffset_, cinfo->output_width,
                         cinfo->out_color_components, output);
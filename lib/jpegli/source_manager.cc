@@ -10,6 +10,7 @@
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 
@@ -17,6 +18,7 @@ namespace jpegli {
 
 void init_mem_source(j_decompress_ptr cinfo) {}
 void init_stdio_source(j_decompress_ptr cinfo) {}
+void init_mmap_source(j_decompress_ptr cinfo) {}
 
 void skip_input_data(j_decompress_ptr cinfo, long num_bytes /* NOLINT */) {
   if (num_bytes <= 0) return;
@@ -57,6 +59,11 @@ struct StdioSourceManager {
   }
 };
 
+struct MmapSourceManager {
+  jpeg_source_mgr pub;
+  const uint8_t* data;
+};
+
 }  // namespace jpegli
 
 void jpegli_mem_src(j_decompress_ptr cinfo, const unsigned char* inbuffer,
@@ -95,3 +102,30 @@ void jpegli_stdio_src(j_decompress_ptr cinfo, FILE* infile) {
   src->pub.resync_to_restart = jpegli_resync_to_restart;
   src->pub.term_source = jpegli::term_source;
 }
+
+void jpegli_mmap_src(j_decompress_ptr cinfo, const char* path) {
+  if (cinfo->src && cinfo->src->init_source != jpegli::init_mmap_source) {
+    JPEGLI_ERROR("jpegli_mmap_src: a different source manager was already set");
+  }
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
+  if (!cinfo->src) {
+    cinfo->src = reinterpret_cast<jpeg_source_mgr*>(
+        jpegli::Allocate<jpegli::MmapSourceManager>(cinfo, 1));
+  } else {
+    auto* src = reinterpret_cast<jpegli::MmapSourceManager*>(cinfo->src);
+    if (src->data) jpegli::UnmapFile(comptr, src->data);
+  }
+  auto* src = reinterpret_cast<jpegli::MmapSourceManager*>(cinfo->src);
+  size_t size = 0;
+  src->data = jpegli::MapFile(comptr, path, &size);
+  if (!src->data) {
+    JPEGLI_ERROR("jpegli_mmap_src: could not map file %s", path);
+  }
+  src->pub.next_input_byte = src->data;
+  src->pub.bytes_in_buffer = size;
+  src->pub.init_source = jpegli::init_mmap_source;
+  src->pub.fill_input_buffer = jpegli::EmitFakeEoiMarker;
+  src->pub.skip_input_data = jpegli::skip_input_data;
+  src->pub.resync_to_restart = jpegli_resync_to_restart;
+  src->pub.term_source = jpegli::term_source;
+}
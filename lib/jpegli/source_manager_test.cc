@@ -7,6 +7,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -21,6 +22,11 @@
 #include "lib/jpegli/test_utils.h"
 #include "lib/jpegli/testing.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#include <unistd.h>
+#endif
+
 namespace jpegli {
 namespace {
 
@@ -109,6 +115,43 @@ TEST_P(SourceManagerTestParam, TestMemSourceManager) {
   VerifyOutputImage(output1, output0, 1.0f);
 }
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+TEST_P(SourceManagerTestParam, TestMmapSourceManager) {
+  TestConfig config = GetParam();
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, ReadTestData(config.fn),
+                     "Failed to read test data.");
+  if (config.dparams.size_factor < 1.0f) {
+    compressed.resize(compressed.size() * config.dparams.size_factor);
+  }
+  char path[] = "/tmp/jpegli_mmap_src_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  FILE* f = fdopen(fd, "wb");
+  ASSERT_TRUE(f);
+  ASSERT_EQ(compressed.size(),
+            fwrite(compressed.data(), 1, compressed.size(), f));
+  fclose(f);
+  TestImage output0;
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mmap_src(&cinfo, path);
+    ReadOutputImage(&cinfo, &output0);
+    return true;
+  };
+  bool ok = try_catch_block();
+  jpegli_destroy_decompress(&cinfo);
+  unlink(path);
+  ASSERT_TRUE(ok);
+
+  TestImage output1;
+  DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed, &output1);
+  VerifyOutputImage(output1, output0, 1.0f);
+}
+#endif
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   {
@@ -99,6 +99,8 @@ struct CompressParams {
   int progressive_mode = -1;
   unsigned int restart_interval = 0;
   int restart_in_rows = 0;
+  bool auto_restart_interval = false;
+  bool optimize_scans = false;
   int smoothing_factor = 0;
   int optimize_coding = -1;
   bool use_flat_dc_luma_code = false;
@@ -106,6 +108,12 @@ struct CompressParams {
   bool xyb_mode = false;
   bool libjpeg_mode = false;
   bool use_adaptive_quantization = true;
+  // 0 means no PSNR target
+  float psnr_target = 0.0f;
+  // 0 means no target size
+  size_t target_size = 0;
+  // 0 means no parallel runner
+  int num_threads = 0;
   std::vector<uint8_t> icc;
 
   int h_samp(int c) const { return h_sampling.empty() ? 1 : h_sampling[c]; }
@@ -152,6 +160,9 @@ struct DecompressParams {
   bool do_block_smoothing = false;
   bool do_fancy_upsampling = true;
   bool skip_scans = false;
+  // 0 means no parallel runner
+  int num_threads = 0;
+  bool speculative_decoding = false;
   int scale_num = 1;
   int scale_denom = 1;
   bool quantize_colors = false;
@@ -7,6 +7,7 @@
 #include "lib/jpegli/test_utils.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
@@ -18,6 +19,7 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -312,6 +314,21 @@ std::ostream& operator<<(std::ostream& os, const CompressParams& jparams) {
   if (jparams.restart_in_rows > 0) {
     os << "RR" << jparams.restart_in_rows;
   }
+  if (jparams.auto_restart_interval) {
+    os << "AR";
+  }
+  if (jparams.optimize_scans) {
+    os << "OS";
+  }
+  if (jparams.num_threads > 0) {
+    os << "MT" << jparams.num_threads;
+  }
+  if (jparams.psnr_target > 0) {
+    os << "PSNR" << jparams.psnr_target;
+  }
+  if (jparams.target_size > 0) {
+    os << "TargetSize" << jparams.target_size;
+  }
   if (jparams.xyb_mode) {
     os << "XYB";
   } else if (jparams.libjpeg_mode) {
@@ -637,8 +654,23 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
     jpegli_set_progressive_level(cinfo, jparams.progressive_mode);
   }
   jpegli_set_input_format(cinfo, input.data_type, input.endianness);
+  if (jparams.num_threads > 0) {
+    jpegli_set_parallel_runner(cinfo, TestParallelRunner,
+                               ThreadsAsRunnerOpaque(jparams.num_threads));
+  } else {
+    jpegli_set_parallel_runner(cinfo, nullptr, nullptr);
+  }
+  jpegli_enable_auto_restart_interval(
+      cinfo, TO_JXL_BOOL(jparams.auto_restart_interval));
+  jpegli_enable_optimize_scans(cinfo, TO_JXL_BOOL(jparams.optimize_scans));
   jpegli_enable_adaptive_quantization(
       cinfo, TO_JXL_BOOL(jparams.use_adaptive_quantization));
+  if (jparams.psnr_target > 0) {
+    jpegli_set_psnr(cinfo, jparams.psnr_target, 0.01f, 0.1f, 25.0f);
+  }
+  if (jparams.target_size > 0) {
+    jpegli_set_target_size(cinfo, jparams.target_size);
+  }
   cinfo->restart_interval = jparams.restart_interval;
   cinfo->restart_in_rows = jparams.restart_in_rows;
   cinfo->smoothing_factor = jparams.smoothing_factor;
@@ -773,6 +805,32 @@ bool EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
 
 int NumTestScanScripts() { return kNumTestScripts; }
 
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range, uint32_t end_range) {
+  size_t num_threads = reinterpret_cast<uintptr_t>(runner_opaque);
+  JxlParallelRetCode ret = (*init)(jpegxl_opaque, num_threads);
+  if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+  std::atomic<uint32_t> next_task{start_range};
+  std::vector<std::thread> threads;
+  for (size_t thread_id = 0; thread_id < num_threads; ++thread_id) {
+    threads.emplace_back([&, thread_id]() {
+      for (uint32_t task = next_task++; task < end_range; task = next_task++) {
+        (*func)(jpegxl_opaque, task, thread_id);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
+void* ThreadsAsRunnerOpaque(int num_threads) {
+  return reinterpret_cast<void*>(static_cast<uintptr_t>(num_threads));
+}
+
 void DumpImage(const TestImage& image, const std::string& fn) {
   Check(image.components == 1 || image.components == 3);
   size_t bytes_per_sample = jpegli_bytes_per_sample(image.data_type);
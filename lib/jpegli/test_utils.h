@@ -16,6 +16,7 @@
 #include <vector>
 
 #include "lib/base/include_jpeglib.h"  // NOLINT
+#include "lib/base/parallel_runner.h"
 #include "lib/base/status.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/test_params.h"
@@ -124,6 +125,15 @@ void VerifyOutputImage(const TestImage& input, const TestImage& output,
 
 void Check(bool ok);
 
+// Parallel runner that starts a new set of threads for each call. The number
+// of threads is encoded in runner_opaque, see ThreadsAsRunnerOpaque().
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range, uint32_t end_range);
+
+void* ThreadsAsRunnerOpaque(int num_threads);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_TEST_UTILS_H_
@@ -7,6 +7,8 @@
 #ifndef LIB_JPEGLI_TYPES_H_
 #define LIB_JPEGLI_TYPES_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,6 +32,13 @@ typedef enum {
   JPEGLI_BIG_ENDIAN = 2,
 } JpegliEndianness;
 
+// A contiguous piece of data, with the same layout as struct iovec on most
+// platforms.
+typedef struct {
+  unsigned char* data;
+  size_t size;
+} JpegliBuffer;
+
 int jpegli_bytes_per_sample(JpegliDataType data_type);
 
 #ifdef __cplusplus
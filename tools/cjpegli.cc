@@ -8,7 +8,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <memory>
 #include <string>
+#include <thread>  // NOLINT
 #include <vector>
 
 #include "lib/base/common.h"
@@ -23,6 +25,7 @@
 #include "tools/cmdline.h"
 #include "tools/file_io.h"
 #include "tools/speed_stats.h"
+#include "tools/thread_pool_internal.h"
 
 namespace jpegxl {
 namespace tools {
@@ -102,6 +105,12 @@ struct Args {
                             "How many times to compress. (For benchmarking).",
                             &num_reps, &ParseUnsigned, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "num_threads", "N",
+        "Number of worker threads (-1 == use machine default, "
+        "0 == do not use multithreading, default: 0).",
+        &num_threads, &ParseSigned, 1);
+
     cmdline->AddOptionFlag('\0', "quiet", "Suppress informative output", &quiet,
                            &SetBooleanTrue, 1);
 
@@ -118,6 +127,7 @@ struct Args {
   jxl::extras::JpegSettings settings;
   int quality = 90;
   size_t num_reps = 1;
+  int num_threads = 0;
   bool quiet = false;
   bool verbose = false;
   // References (ids) of specific options to check if they were matched.
@@ -231,11 +241,20 @@ int CJpegliMain(int argc, const char* argv[]) {
             s.optimize_coding ? "OPT" : "FIX");
   }
 
+  std::unique_ptr<jpegxl::tools::ThreadPoolInternal> pool;
+  const size_t num_threads = args.num_threads < 0
+                                 ? std::thread::hardware_concurrency()
+                                 : static_cast<size_t>(args.num_threads);
+  if (num_threads > 0) {
+    pool = jxl::make_unique<jpegxl::tools::ThreadPoolInternal>(num_threads);
+  }
+  jxl::ThreadPool* pool_ptr = pool ? pool->get() : nullptr;
+
   jpegxl::tools::SpeedStats stats;
   std::vector<uint8_t> jpeg_bytes;
   for (size_t num_rep = 0; num_rep < args.num_reps; ++num_rep) {
     const double t0 = jxl::Now();
-    if (!jxl::extras::EncodeJpeg(ppf, args.settings, nullptr, &jpeg_bytes)) {
+    if (!jxl::extras::EncodeJpeg(ppf, args.settings, pool_ptr, &jpeg_bytes)) {
       fprintf(stderr, "jpegli encoding failed\n");
       return EXIT_FAILURE;
     }
@@ -10,17 +10,22 @@
 
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT
+#include <utility>
 #include <vector>
 
+#include "lib/base/common.h"
 #include "lib/base/printf_macros.h"
 #include "lib/base/types.h"
 #include "lib/extras/dec/jpegli.h"
 #include "lib/extras/enc/encode.h"
+#include "lib/extras/mmap.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/time.h"
 #include "tools/cmdline.h"
 #include "tools/file_io.h"
 #include "tools/speed_stats.h"
+#include "tools/thread_pool_internal.h"
 
 namespace jpegxl {
 namespace tools {
@@ -50,6 +55,17 @@ struct Args {
                             "Used for benchmarking, the default is 1.",
                             &num_reps, &ParseUnsigned);
 
+    cmdline->AddOptionValue(
+        '\0', "num_threads", "N",
+        "Number of worker threads (-1 == use machine default, "
+        "0 == do not use multithreading, default: 0).",
+        &num_threads, &ParseSigned);
+
+    cmdline->AddOptionFlag('\0', "speculative_decoding",
+                           "Decode scans without restart markers in parallel "
+                           "(requires --num_threads).",
+                           &speculative_decoding, &SetBooleanTrue);
+
     cmdline->AddOptionFlag('\0', "quiet", "Silence output (except for errors).",
                            &quiet, &SetBooleanTrue);
   }
@@ -59,6 +75,8 @@ struct Args {
   bool disable_output = false;
   size_t bitdepth = 8;
   size_t num_reps = 1;
+  int num_threads = 0;
+  bool speculative_decoding = false;
   bool quiet = false;
 };
 
@@ -84,6 +102,7 @@ void SetDecompressParams(const Args& args, const std::string& extension,
   } else if (extension == ".ppm") {
     params->force_rgb = true;
   }
+  params->speculative_decoding = args.speculative_decoding;
 }
 
 int DJpegliMain(int argc, const char* argv[]) {
@@ -117,10 +136,26 @@ int DJpegliMain(int argc, const char* argv[]) {
     return EXIT_FAILURE;
   }
 
-  std::vector<uint8_t> jpeg_bytes;
-  if (!ReadFile(args.file_in, &jpeg_bytes)) {
-    fprintf(stderr, "Failed to read input image %s\n", args.file_in);
-    return EXIT_FAILURE;
+  // Map the input file into memory if possible, so that it is decoded without
+  // copying, and fall back to reading it otherwise.
+  std::vector<uint8_t> jpeg_file;
+  jxl::Bytes jpeg_bytes;
+  jxl::MemoryMappedFile mapped_file;
+  jxl::StatusOr<jxl::MemoryMappedFile> mapped =
+      jxl::MemoryMappedFile::Init(args.file_in);
+  bool use_mapped_file = false;
+  if (mapped.ok()) {
+    mapped_file = std::move(mapped).value_();
+    use_mapped_file = mapped_file.size() > 0;
+  }
+  if (use_mapped_file) {
+    jpeg_bytes = jxl::Bytes(mapped_file.data(), mapped_file.size());
+  } else {
+    if (!ReadFile(args.file_in, &jpeg_file)) {
+      fprintf(stderr, "Failed to read input image %s\n", args.file_in);
+      return EXIT_FAILURE;
+    }
+    jpeg_bytes = jxl::Bytes(jpeg_file);
   }
 
   if (!args.quiet) {
@@ -143,10 +178,19 @@ int DJpegliMain(int argc, const char* argv[]) {
   SetDecompressParams(args, extension, &dparams);
 
   jxl::extras::PackedPixelFile ppf;
+  std::unique_ptr<jpegxl::tools::ThreadPoolInternal> pool;
+  const size_t num_threads = args.num_threads < 0
+                                 ? std::thread::hardware_concurrency()
+                                 : static_cast<size_t>(args.num_threads);
+  if (num_threads > 0) {
+    pool = jxl::make_unique<jpegxl::tools::ThreadPoolInternal>(num_threads);
+  }
+  jxl::ThreadPool* pool_ptr = pool ? pool->get() : nullptr;
+
   jpegxl::tools::SpeedStats stats;
   for (size_t num_rep = 0; num_rep < args.num_reps; ++num_rep) {
     const double t0 = jxl::Now();
-    if (!jxl::extras::DecodeJpeg(jpeg_bytes, dparams, nullptr, &ppf)) {
+    if (!jxl::extras::DecodeJpeg(jpeg_bytes, dparams, pool_ptr, &ppf)) {
       fprintf(stderr, "jpegli decoding failed\n");
       return EXIT_FAILURE;
     }